@@ -0,0 +1,541 @@
+#include <linux/io_uring.h>
+// linux/fs.h, which the above pulls in, has a BLOCK_SIZE of its own
+#undef BLOCK_SIZE
+#include "async.h"
+#include "block.h"
+#include "disk.h"
+#include "checksum.h"
+#include "simfs.h"
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// This thread's filesystem's requests
+#define async (simfs_current->async)
+
+struct async_engine {
+    const char *name;
+    int (*supported)(void);
+    int (*start)(struct async_state *as);
+    void (*submit)(struct async_state *as);
+    void (*reap)(struct async_state *as, int block);  // block: wait for at least one
+    void (*stop)(struct async_state *as);
+};
+
+// Moves a request the slow way, with preadv or pwritev. Also what a short
+// io_uring transfer falls back on, so reads past the end of the image
+// come back as zeros either way.
+static int run_sync(struct async_io *io)
+{
+    struct iovec iov[DISK_MAX_IOV];
+
+    for (int i = 0; i < io->count; i++)
+    {
+        iov[i].iov_base = io->data + (size_t)i * BLOCK_SIZE;
+        iov[i].iov_len = BLOCK_SIZE;
+    }
+    if (io->write)
+    {
+        return disk_writev(io->block_num, iov, io->count);
+    }
+    return disk_readv(io->block_num, iov, io->count);
+}
+
+static void push(struct async_io **list, struct async_io *io)
+{
+    io->next = *list;
+    *list = io;
+}
+
+static struct async_io *pop(struct async_io **list)
+{
+    struct async_io *io = *list;
+    if (io != NULL)
+    {
+        *list = io->next;
+    }
+    return io;
+}
+
+// io_uring, set up and driven with the raw system calls
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+    memset(p, 0, sizeof(*p));
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_supported(void)
+{
+    static int supported = -1;
+    struct io_uring_params p;
+
+    if (supported == -1)
+    {
+        int fd = uring_setup(1, &p);
+        supported = fd >= 0;
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+    return supported;
+}
+
+static void uring_stop(struct async_state *as)
+{
+    if (as->sqes != NULL)
+    {
+        munmap(as->sqes, as->sq_entries * sizeof(struct io_uring_sqe));
+    }
+    if (as->cq_ring != NULL && as->cq_ring != as->sq_ring)
+    {
+        munmap(as->cq_ring, as->cq_ring_size);
+    }
+    if (as->sq_ring != NULL)
+    {
+        munmap(as->sq_ring, as->sq_ring_size);
+    }
+    if (as->ring_fd >= 0)
+    {
+        close(as->ring_fd);
+    }
+    as->ring_fd = -1;
+    as->sq_ring = as->cq_ring = NULL;
+    as->sqes = NULL;
+}
+
+static int uring_start(struct async_state *as)
+{
+    struct io_uring_params p;
+
+    as->sq_ring = as->cq_ring = NULL;
+    as->sqes = NULL;
+    as->ring_fd = uring_setup(ASYNC_DEPTH, &p);
+    if (as->ring_fd < 0)
+    {
+        return -1;
+    }
+
+    as->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    as->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    int single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && as->cq_ring_size > as->sq_ring_size)
+    {
+        as->sq_ring_size = as->cq_ring_size;
+    }
+
+    void *sq = mmap(NULL, as->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, as->ring_fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+    {
+        uring_stop(as);
+        return -1;
+    }
+    as->sq_ring = sq;
+    void *cq = sq;
+    if (!single)
+    {
+        cq = mmap(NULL, as->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, as->ring_fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED)
+        {
+            uring_stop(as);
+            return -1;
+        }
+    }
+    as->cq_ring = cq;
+    as->sq_entries = p.sq_entries;
+    void *sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, as->ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+    {
+        uring_stop(as);
+        return -1;
+    }
+    as->sqes = sqes;
+
+    as->sq_head = (unsigned int *)((char *)sq + p.sq_off.head);
+    as->sq_tail = (unsigned int *)((char *)sq + p.sq_off.tail);
+    as->sq_mask = (unsigned int *)((char *)sq + p.sq_off.ring_mask);
+    as->sq_array = (unsigned int *)((char *)sq + p.sq_off.array);
+    as->cq_head = (unsigned int *)((char *)cq + p.cq_off.head);
+    as->cq_tail = (unsigned int *)((char *)cq + p.cq_off.tail);
+    as->cq_mask = (unsigned int *)((char *)cq + p.cq_off.ring_mask);
+    as->cqes = (struct io_uring_cqe *)((char *)cq + p.cq_off.cqes);
+    return 0;
+}
+
+// Fills as many submission entries as the ring has room for and hands
+// them over with one io_uring_enter
+static void uring_submit(struct async_state *as)
+{
+    unsigned int tail = *as->sq_tail;
+    int count = 0;
+
+    while (as->queued != NULL && as->in_flight < (int)as->sq_entries)
+    {
+        struct async_io *io = pop(&as->queued);
+        unsigned int index = tail & *as->sq_mask;
+        struct io_uring_sqe *sqe = &as->sqes[index];
+
+        // The disk layer is bypassed, so checksums are handled here
+        if (io->write)
+        {
+            checksum_stamp(io->block_num, io->count, io->data);
+        }
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = io->write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe->fd = image_fd;
+        sqe->addr = (uintptr_t)io->data;
+        sqe->len = io->count * BLOCK_SIZE;
+        sqe->off = (unsigned long long)io->block_num * BLOCK_SIZE;
+        sqe->user_data = (uintptr_t)io;
+        as->sq_array[index] = index;
+        tail++;
+        count++;
+        as->in_flight++;
+    }
+    if (count == 0)
+    {
+        return;
+    }
+
+    __atomic_store_n(as->sq_tail, tail, __ATOMIC_RELEASE);
+    while (count > 0)
+    {
+        int n = uring_enter(as->ring_fd, count, 0, 0);
+        if (n < 0 && errno != EINTR && errno != EAGAIN)
+        {
+            break;
+        }
+        count -= n > 0 ? n : 0;
+    }
+}
+
+static void uring_reap(struct async_state *as, int block)
+{
+    unsigned int head = *as->cq_head;
+
+    if (block && as->in_flight > 0 && head == __atomic_load_n(as->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        uring_enter(as->ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+    }
+    while (head != __atomic_load_n(as->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        struct io_uring_cqe *cqe = &as->cqes[head & *as->cq_mask];
+        struct async_io *io = (struct async_io *)(uintptr_t)cqe->user_data;
+
+        // Errors and short transfers are retried the slow way
+        if (cqe->res != io->count * BLOCK_SIZE)
+        {
+            io->result = run_sync(io);
+        }
+        else
+        {
+            io->result = io->write ? checksum_written(io->block_num, io->count)
+                                   : checksum_verify(io->block_num, io->count, io->data);
+        }
+        push(&as->completed, io);
+        as->in_flight--;
+        head++;
+    }
+    __atomic_store_n(as->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// The fallback: a pool of threads, each moving one request at a time
+
+static int always(void)
+{
+    return 1;
+}
+
+static void *worker(void *arg)
+{
+    simfs_use(arg);
+    struct async_state *as = &async;
+
+    pthread_mutex_lock(&as->lock);
+    while (!as->stopping)
+    {
+        struct async_io *io = pop(&as->work);
+        if (io == NULL)
+        {
+            pthread_cond_wait(&as->work_ready, &as->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&as->lock);
+        io->result = run_sync(io);
+        pthread_mutex_lock(&as->lock);
+        push(&as->completed, io);
+        as->in_flight--;
+        pthread_cond_broadcast(&as->changed);
+    }
+    pthread_mutex_unlock(&as->lock);
+    return NULL;
+}
+
+static int threads_start(struct async_state *as)
+{
+    as->stopping = 0;
+    as->work = NULL;
+    for (int i = 0; i < ASYNC_WORKERS; i++)
+    {
+        if (pthread_create(&as->workers[i], NULL, worker, simfs_current) != 0)
+        {
+            as->stopping = 1;
+            pthread_cond_broadcast(&as->work_ready);
+            pthread_mutex_unlock(&as->lock);
+            while (--i >= 0)
+            {
+                pthread_join(as->workers[i], NULL);
+            }
+            pthread_mutex_lock(&as->lock);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void threads_submit(struct async_state *as)
+{
+    struct async_io *io;
+    while ((io = pop(&as->queued)) != NULL)
+    {
+        push(&as->work, io);
+        as->in_flight++;
+    }
+    pthread_cond_broadcast(&as->work_ready);
+}
+
+static void threads_reap(struct async_state *as, int block)
+{
+    if (block && as->completed == NULL)
+    {
+        pthread_cond_wait(&as->changed, &as->lock);
+    }
+}
+
+// Called with nothing in flight
+static void threads_stop(struct async_state *as)
+{
+    as->stopping = 1;
+    pthread_cond_broadcast(&as->work_ready);
+    pthread_mutex_unlock(&as->lock);
+    for (int i = 0; i < ASYNC_WORKERS; i++)
+    {
+        pthread_join(as->workers[i], NULL);
+    }
+    pthread_mutex_lock(&as->lock);
+}
+
+// Preferred last; the first filesystem to need one picks the last one
+// the kernel supports
+static const struct async_engine engines[] = {
+    { "threads", always, threads_start, threads_submit, threads_reap, threads_stop },
+    { "uring", uring_supported, uring_start, uring_submit, uring_reap, uring_stop },
+};
+
+static const struct async_engine *chosen = NULL;
+
+static const struct async_engine *pick_engine(void)
+{
+    if (chosen == NULL)
+    {
+        for (int i = sizeof(engines) / sizeof(engines[0]) - 1; i >= 0; i--)
+        {
+            if (engines[i].supported())
+            {
+                chosen = &engines[i];
+                break;
+            }
+        }
+    }
+    return chosen;
+}
+
+// Hands the queued requests to the engine, starting it on first use. If
+// no engine can be started they are done on the spot.
+static void submit_locked(void)
+{
+    if (async.queued == NULL)
+    {
+        return;
+    }
+    if (async.engine == NULL)
+    {
+        const struct async_engine *engine = pick_engine();
+        if (engine->start(&async) == -1)
+        {
+            engine = engine != &engines[0] && engines[0].start(&async) == 0 ? &engines[0] : NULL;
+        }
+        async.engine = engine;
+    }
+    if (async.engine == NULL)
+    {
+        struct async_io *io;
+        while ((io = pop(&async.queued)) != NULL)
+        {
+            io->result = run_sync(io);
+            push(&async.completed, io);
+        }
+        return;
+    }
+    async.engine->submit(&async);
+}
+
+// Queues io, which async_init filled in, for the next async_submit
+void async_queue(struct async_io *io)
+{
+    pthread_mutex_lock(&async.lock);
+    push(&async.queued, io);
+    async.pending++;
+    pthread_mutex_unlock(&async.lock);
+}
+
+// Reports io as done without any I/O, for requests served from memory
+void async_complete(struct async_io *io, int result)
+{
+    io->result = result;
+    pthread_mutex_lock(&async.lock);
+    push(&async.completed, io);
+    async.pending++;
+    pthread_cond_broadcast(&async.changed);
+    pthread_mutex_unlock(&async.lock);
+}
+
+void async_init(struct async_io *io, int write, int block_num, int count, unsigned char *data, void (*done)(struct async_io *), void *arg)
+{
+    io->block_num = block_num;
+    io->count = count;
+    io->data = data;
+    io->write = write;
+    io->result = 0;
+    io->done = done;
+    io->arg = arg;
+    io->next = NULL;
+}
+
+// Hands everything queued so far to the engine, without waiting
+int async_submit(void)
+{
+    pthread_mutex_lock(&async.lock);
+    submit_locked();
+    pthread_mutex_unlock(&async.lock);
+    return 0;
+}
+
+// Submits what is queued and waits until at least min requests have
+// finished, or none are left, running their callbacks. Requests made by
+// other threads on the filesystem may be among them; callbacks must not
+// block. Returns how many finished.
+int async_wait(int min)
+{
+    int reaped = 0;
+
+    pthread_mutex_lock(&async.lock);
+    for (;;)
+    {
+        submit_locked();
+        if (async.engine != NULL)
+        {
+            async.engine->reap(&async, 0);
+        }
+
+        struct async_io *done = async.completed;
+        async.completed = NULL;
+        if (done != NULL)
+        {
+            int count = 0;
+            pthread_mutex_unlock(&async.lock);
+            while (done != NULL)
+            {
+                struct async_io *io = pop(&done);
+                if (io->done != NULL)
+                {
+                    io->done(io);
+                }
+                count++;
+            }
+            pthread_mutex_lock(&async.lock);
+            async.pending -= count;
+            reaped += count;
+            pthread_cond_broadcast(&async.changed);
+            continue;
+        }
+
+        if (reaped >= min || async.pending == 0)
+        {
+            break;
+        }
+        if (async.in_flight > 0 && async.engine != NULL)
+        {
+            async.engine->reap(&async, 1);
+        }
+        else
+        {
+            // Another thread is running the callbacks of what is left
+            pthread_cond_wait(&async.changed, &async.lock);
+        }
+    }
+    pthread_mutex_unlock(&async.lock);
+    return reaped;
+}
+
+int async_pending(void)
+{
+    pthread_mutex_lock(&async.lock);
+    int pending = async.pending;
+    pthread_mutex_unlock(&async.lock);
+    return pending;
+}
+
+// Finishes every request and stops the engine, e.g. before the image is
+// closed. The next request starts it again.
+int async_shutdown(void)
+{
+    int pending;
+    while ((pending = async_pending()) > 0)
+    {
+        async_wait(pending);
+    }
+
+    pthread_mutex_lock(&async.lock);
+    if (async.engine != NULL)
+    {
+        async.engine->stop(&async);
+        async.engine = NULL;
+    }
+    pthread_mutex_unlock(&async.lock);
+    return 0;
+}
+
+// Switches to the named engine ("uring" or "threads"), e.g. to compare
+// them, after finishing what the current filesystem has in flight.
+// Returns -1 if it is unknown or the kernel lacks it.
+int async_use_engine(const char *name)
+{
+    for (unsigned int i = 0; i < sizeof(engines) / sizeof(engines[0]); i++)
+    {
+        if (strcmp(engines[i].name, name) == 0 && engines[i].supported())
+        {
+            async_shutdown();
+            chosen = &engines[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char *async_engine_name(void)
+{
+    pthread_mutex_lock(&async.lock);
+    const struct async_engine *engine = async.engine != NULL ? async.engine : pick_engine();
+    pthread_mutex_unlock(&async.lock);
+    return engine->name;
+}
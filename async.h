@@ -0,0 +1,75 @@
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+// Asynchronous block I/O. Requests made with bread_async, bwrite_async or
+// bprefetch are queued, handed to the engine in batches by async_submit,
+// and finish in async_wait, which runs their callbacks. Two engines do the
+// I/O: io_uring, through the raw system calls, and where that is missing a
+// pool of threads doing preadv and pwritev. Requests served from the
+// buffer cache or the mapping finish at once and are only reported by the
+// next async_wait.
+
+#define ASYNC_DEPTH 64    // requests the kernel is handed at a time
+#define ASYNC_WORKERS 16  // threads of the fallback engine
+
+struct async_io {
+    int block_num;
+    int count;          // contiguous blocks, at most DISK_MAX_IOV
+    unsigned char *data;
+    int write;
+    int result;         // 0, or -1 on error, once done
+    void (*done)(struct async_io *io);  // may be NULL
+    void *arg;
+    struct async_io *next;
+};
+
+struct async_engine;
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// One filesystem's requests and engine (see simfs.h). lock is taken last
+// but for the cache lock, which prefetch callbacks take after it is
+// released.
+struct async_state {
+    const struct async_engine *engine;  // NULL until first used
+    pthread_mutex_t lock;
+    pthread_cond_t changed;             // a request finished
+    struct async_io *queued;            // made, not yet handed to the engine
+    struct async_io *completed;         // finished, callback not yet run
+    int in_flight;                      // handed to the engine
+    int pending;                        // made and not yet reaped
+
+    // io_uring
+    int ring_fd;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    unsigned int sq_entries;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // Thread pool
+    pthread_cond_t work_ready;
+    struct async_io *work;
+    pthread_t workers[ASYNC_WORKERS];
+    int stopping;
+};
+
+void async_init(struct async_io *io, int write, int block_num, int count, unsigned char *data,
+                void (*done)(struct async_io *io), void *arg);
+void async_queue(struct async_io *io);
+void async_complete(struct async_io *io, int result);
+int async_submit(void);
+int async_wait(int min);
+int async_pending(void);
+int async_shutdown(void);
+int async_use_engine(const char *name);
+const char *async_engine_name(void);
+
+#endif
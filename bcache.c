@@ -0,0 +1,669 @@
+#include "bcache.h"
+#include "async.h"
+#include "disk.h"
+#include "journal.h"
+#include "writeback.h"
+#include "simfs.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// This thread's filesystem's cache
+#define cache (simfs_current->cache)
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static int hash_index(int block_num)
+{
+    return (unsigned int)block_num % BCACHE_HASH_SIZE;
+}
+
+static void lru_unlink(struct buf *b)
+{
+    b->lru_prev->lru_next = b->lru_next;
+    b->lru_next->lru_prev = b->lru_prev;
+}
+
+static void lru_push_front(struct buf *b)
+{
+    b->lru_next = cache.lru.lru_next;
+    b->lru_prev = &cache.lru;
+    cache.lru.lru_next->lru_prev = b;
+    cache.lru.lru_next = b;
+}
+
+static void hash_remove(struct buf *b)
+{
+    struct buf **p = &cache.hash[hash_index(b->block_num)];
+    while (*p != NULL)
+    {
+        if (*p == b)
+        {
+            *p = b->hash_next;
+            break;
+        }
+        p = &(*p)->hash_next;
+    }
+    b->hash_next = NULL;
+}
+
+static void bcache_init(void)
+{
+    memset(cache.hash, 0, sizeof(cache.hash));
+    cache.lru.lru_next = cache.lru.lru_prev = &cache.lru;
+    for (int i = 0; i < BCACHE_BLOCKS; i++)
+    {
+        cache.bufs[i].block_num = -1;
+        cache.bufs[i].valid = 0;
+        cache.bufs[i].dirty = 0;
+        cache.bufs[i].pins = 0;
+        cache.bufs[i].journaled = 0;
+        cache.bufs[i].prefetching = 0;
+        cache.bufs[i].hash_next = NULL;
+        lru_push_front(&cache.bufs[i]);
+    }
+    cache.dirty_count = 0;
+    cache.initialized = 1;
+}
+
+static struct buf *bcache_lookup(int block_num)
+{
+    for (struct buf *b = cache.hash[hash_index(block_num)]; b != NULL; b = b->hash_next)
+    {
+        if (b->block_num == block_num)
+        {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+// Waits for a read of b's block in progress on another thread, or for a
+// prefetch, which nobody may be reaping yet. The cache lock must be held
+// exactly once. Returns 0 if the read failed.
+static int bcache_wait(struct buf *b, int block_num)
+{
+    while (b->block_num == block_num && !b->valid)
+    {
+        if (b->prefetching)
+        {
+            pthread_mutex_unlock(&cache.lock);
+            async_wait(1);
+            pthread_mutex_lock(&cache.lock);
+            continue;
+        }
+        pthread_cond_wait(&cache.load_done, &cache.lock);
+    }
+    return b->block_num == block_num;
+}
+
+// bcache_lookup for callers that go on to use the contents
+static struct buf *bcache_lookup_ready(int block_num)
+{
+    struct buf *b;
+    while ((b = bcache_lookup(block_num)) != NULL && !b->valid)
+    {
+        b->pins++;
+        bcache_wait(b, block_num);
+        b->pins--;
+    }
+    return b;
+}
+
+static int bcache_writeback(struct buf *b)
+{
+    if (disk_write(b->block_num, b->data) == -1)
+    {
+        return -1;
+    }
+    b->dirty = 0;
+    cache.dirty_count--;
+    cache.stats.writebacks++;
+    return 0;
+}
+
+static void bcache_discard(struct buf *b)
+{
+    hash_remove(b);
+    cache.dirty_count -= b->dirty;
+    b->block_num = -1;
+    b->valid = 0;
+    b->dirty = 0;
+    b->journaled = 0;
+    lru_unlink(b);
+    cache.lru.lru_prev->lru_next = b;
+    b->lru_prev = cache.lru.lru_prev;
+    b->lru_next = &cache.lru;
+    cache.lru.lru_prev = b;
+}
+
+static struct buf *bcache_victim(void)
+{
+    struct buf *b = cache.lru.lru_prev;
+    while (b != &cache.lru && (b->pins > 0 || b->journaled))
+    {
+        b = b->lru_prev;
+    }
+    return b == &cache.lru ? NULL : b;
+}
+
+// Recycles the least recently used unpinned buffer for block_num without
+// reading it. Buffers waiting on the journal are passed over; if nothing
+// else is left the transaction commits early to free them.
+static struct buf *bcache_claim(int block_num)
+{
+    struct buf *b = bcache_victim();
+    if (b == NULL && journal_pending() > 0 && journal_commit() > 0)
+    {
+        b = bcache_victim();
+    }
+    if (b == NULL)
+    {
+        return NULL;
+    }
+    if (b->dirty && bcache_writeback(b) == -1)
+    {
+        return NULL;
+    }
+    if (b->valid)
+    {
+        hash_remove(b);
+    }
+
+    b->block_num = block_num;
+    b->valid = 1;
+    b->hash_next = cache.hash[hash_index(block_num)];
+    cache.hash[hash_index(block_num)] = b;
+
+    lru_unlink(b);
+    lru_push_front(b);
+    return b;
+}
+
+void bcache_lock(void)
+{
+    pthread_mutex_lock(&cache.lock);
+}
+
+void bcache_unlock(void)
+{
+    pthread_mutex_unlock(&cache.lock);
+}
+
+// Returns the buffer holding block_num, pinned until bcache_put. On a miss
+// the least recently used buffer is written back if dirty and recycled; if
+// fill is set its contents are read from the image, otherwise the caller is
+// about to overwrite the whole block and calls bcache_filled when done. The
+// read, or the caller's copy, happens without the cache lock; other threads
+// after the same block wait for it. Returns NULL on an I/O error.
+struct buf *bcache_get(int block_num, int fill)
+{
+    pthread_mutex_lock(&cache.lock);
+    if (!cache.initialized)
+    {
+        bcache_init();
+    }
+
+    struct buf *b = bcache_lookup(block_num);
+    if (b != NULL)
+    {
+        cache.stats.hits++;
+        lru_unlink(b);
+        lru_push_front(b);
+        b->pins++;
+        // Another thread may still be reading it in
+        if (!bcache_wait(b, block_num))
+        {
+            b->pins--;
+            b = NULL;
+        }
+        pthread_mutex_unlock(&cache.lock);
+        return b;
+    }
+
+    cache.stats.misses++;
+    b = bcache_claim(block_num);
+    if (b == NULL)
+    {
+        pthread_mutex_unlock(&cache.lock);
+        return NULL;
+    }
+    b->pins++;
+    if (!fill)
+    {
+        // Still holds the block it was claimed from
+        b->valid = 0;
+        pthread_mutex_unlock(&cache.lock);
+        return b;
+    }
+
+    // Stays hashed, but not valid until the read is done
+    b->valid = 0;
+    pthread_mutex_unlock(&cache.lock);
+    int result = disk_read(block_num, b->data);
+    pthread_mutex_lock(&cache.lock);
+    if (result == -1)
+    {
+        bcache_discard(b);
+        b->pins--;
+        b = NULL;
+    }
+    else
+    {
+        b->valid = 1;
+        cache.stats.reads++;
+    }
+    pthread_cond_broadcast(&cache.load_done);
+    pthread_mutex_unlock(&cache.lock);
+    return b;
+}
+
+// Makes a buffer bcache_get returned without filling valid once the
+// caller has written the whole block into it
+void bcache_filled(struct buf *b)
+{
+    pthread_mutex_lock(&cache.lock);
+    b->valid = 1;
+    pthread_cond_broadcast(&cache.load_done);
+    pthread_mutex_unlock(&cache.lock);
+}
+
+static void prefetch_done(struct async_io *io)
+{
+    struct buf *b = io->arg;
+
+    pthread_mutex_lock(&cache.lock);
+    if (io->result == -1)
+    {
+        bcache_discard(b);
+    }
+    else
+    {
+        b->valid = 1;
+        cache.stats.reads++;
+    }
+    b->prefetching = 0;
+    b->pins--;
+    pthread_cond_broadcast(&cache.load_done);
+    pthread_mutex_unlock(&cache.lock);
+}
+
+// Starts reading block_num into a buffer of its own and returns without
+// waiting; the buffer stays pinned and invalid until the read is reaped.
+// A bcache_get of the block meanwhile waits for it, reaping it itself if
+// need be. Returns -1 if no buffer is free.
+int bcache_prefetch(int block_num)
+{
+    pthread_mutex_lock(&cache.lock);
+    if (!cache.initialized)
+    {
+        bcache_init();
+    }
+    if (bcache_lookup(block_num) != NULL)
+    {
+        pthread_mutex_unlock(&cache.lock);
+        return 0;
+    }
+
+    struct buf *b = bcache_claim(block_num);
+    if (b == NULL)
+    {
+        pthread_mutex_unlock(&cache.lock);
+        return -1;
+    }
+    cache.stats.misses++;
+    b->pins++;
+    b->valid = 0;
+    b->prefetching = 1;
+    async_init(&b->io, 0, block_num, 1, b->data, prefetch_done, b);
+    pthread_mutex_unlock(&cache.lock);
+    async_queue(&b->io);
+    return 0;
+}
+
+// Returns 1 if any of count blocks from block_num is cached, even if
+// only on its way in
+int bcache_contains(int block_num, int count)
+{
+    pthread_mutex_lock(&cache.lock);
+    int found = 0;
+    for (int i = 0; cache.initialized && i < count && !found; i++)
+    {
+        found = bcache_lookup(block_num + i) != NULL;
+    }
+    pthread_mutex_unlock(&cache.lock);
+    return found;
+}
+
+void bcache_put(struct buf *b)
+{
+    pthread_mutex_lock(&cache.lock);
+    if (b->pins > 0)
+    {
+        b->pins--;
+    }
+    pthread_mutex_unlock(&cache.lock);
+}
+
+// Copies count contiguous blocks into blocks, reading each run of uncached
+// blocks with a single preadv into freshly claimed buffers. Runs too large
+// to cache without evicting themselves are read straight into the caller's
+// buffer instead.
+static int read_many_locked(int block_num, int count, unsigned char *blocks)
+{
+    struct iovec iov[DISK_MAX_IOV];
+    struct buf *run_bufs[DISK_MAX_IOV];
+    int cache_run = count <= BCACHE_BLOCKS / 2;
+
+    if (!cache.initialized)
+    {
+        bcache_init();
+    }
+
+    int i = 0;
+    while (i < count)
+    {
+        struct buf *b = bcache_lookup_ready(block_num + i);
+        if (b != NULL)
+        {
+            cache.stats.hits++;
+            lru_unlink(b);
+            lru_push_front(b);
+            memcpy(blocks + (size_t)i * BLOCK_SIZE, b->data, BLOCK_SIZE);
+            i++;
+            continue;
+        }
+
+        int run = 0;
+        while (i + run < count && run < DISK_MAX_IOV && bcache_lookup(block_num + i + run) == NULL)
+        {
+            unsigned char *dest = blocks + (size_t)(i + run) * BLOCK_SIZE;
+            if (cache_run)
+            {
+                run_bufs[run] = bcache_claim(block_num + i + run);
+                if (run_bufs[run] == NULL)
+                {
+                    break;
+                }
+                dest = run_bufs[run]->data;
+            }
+            iov[run].iov_base = dest;
+            iov[run].iov_len = BLOCK_SIZE;
+            run++;
+        }
+        if (run == 0)
+        {
+            return -1;
+        }
+
+        cache.stats.misses += run;
+        cache.stats.reads += run;
+        if (disk_readv(block_num + i, iov, run) == -1)
+        {
+            for (int k = 0; cache_run && k < run; k++)
+            {
+                bcache_discard(run_bufs[k]);
+            }
+            return -1;
+        }
+        for (int k = 0; cache_run && k < run; k++)
+        {
+            memcpy(blocks + (size_t)(i + k) * BLOCK_SIZE, run_bufs[k]->data, BLOCK_SIZE);
+        }
+        i += run;
+    }
+    return 0;
+}
+
+// The whole batch is read with the cache locked
+int bcache_read_many(int block_num, int count, unsigned char *blocks)
+{
+    pthread_mutex_lock(&cache.lock);
+    int result = read_many_locked(block_num, count, blocks);
+    pthread_mutex_unlock(&cache.lock);
+    return result;
+}
+
+static int write_through_locked(int block_num, int count, unsigned char *blocks)
+{
+    struct iovec iov[DISK_MAX_IOV];
+
+    if (!cache.initialized)
+    {
+        bcache_init();
+    }
+
+    for (int i = 0; i < count; i += DISK_MAX_IOV)
+    {
+        int run = count - i > DISK_MAX_IOV ? DISK_MAX_IOV : count - i;
+        for (int k = 0; k < run; k++)
+        {
+            unsigned char *src = blocks + (size_t)(i + k) * BLOCK_SIZE;
+            struct buf *b = bcache_lookup_ready(block_num + i + k);
+            if (b != NULL)
+            {
+                memcpy(b->data, src, BLOCK_SIZE);
+                cache.dirty_count -= b->dirty;
+                b->dirty = 0;
+            }
+            iov[k].iov_base = src;
+            iov[k].iov_len = BLOCK_SIZE;
+        }
+        if (disk_writev(block_num + i, iov, run) == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Stores count contiguous blocks. Small batches are only dirtied in the
+// cache; large ones are written through with pwritev, refreshing any
+// cached copies so they do not go stale.
+int bcache_write_many(int block_num, int count, unsigned char *blocks)
+{
+    if (count <= BCACHE_BLOCKS / 2)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            struct buf *b = bcache_get(block_num + i, 0);
+            if (b == NULL)
+            {
+                return -1;
+            }
+            memcpy(b->data, blocks + (size_t)i * BLOCK_SIZE, BLOCK_SIZE);
+            bcache_filled(b);
+            bcache_mark_dirty(block_num + i);
+            bcache_put(b);
+        }
+        return 0;
+    }
+
+    pthread_mutex_lock(&cache.lock);
+    int result = write_through_locked(block_num, count, blocks);
+    pthread_mutex_unlock(&cache.lock);
+    return result;
+}
+
+// Pins block_num in the cache and returns its buffer, which stays valid
+// until the matching bcache_unpin.
+unsigned char *bcache_pin(int block_num)
+{
+    struct buf *b = bcache_get(block_num, 1);
+    return b == NULL ? NULL : b->data;
+}
+
+void bcache_unpin(int block_num)
+{
+    pthread_mutex_lock(&cache.lock);
+    struct buf *b = bcache_lookup(block_num);
+    if (b != NULL && b->pins > 0)
+    {
+        b->pins--;
+    }
+    pthread_mutex_unlock(&cache.lock);
+}
+
+// Marks a cached block dirty. A block's age, for writeback_start, counts
+// from when it was first dirtied since it was last written.
+void bcache_mark_dirty(int block_num)
+{
+    pthread_mutex_lock(&cache.lock);
+    struct buf *b = bcache_lookup(block_num);
+    if (b != NULL && !b->dirty)
+    {
+        b->dirty = 1;
+        b->dirtied_ms = now_ms();
+        cache.dirty_count++;
+    }
+    int dirty = cache.dirty_count;
+    pthread_mutex_unlock(&cache.lock);
+    writeback_dirtied(dirty);
+}
+
+int bcache_dirty_count(void)
+{
+    pthread_mutex_lock(&cache.lock);
+    int dirty = cache.dirty_count;
+    pthread_mutex_unlock(&cache.lock);
+    return dirty;
+}
+
+// Holds a cached block back for the journal. Returns 1 if it was not
+// held yet, 0 if it was, -1 if it is not cached. This and the two below
+// leave locking to the journal, which holds the cache lock around them.
+int bcache_journal(int block_num)
+{
+    struct buf *b = bcache_lookup(block_num);
+    if (b == NULL)
+    {
+        return -1;
+    }
+    if (b->journaled)
+    {
+        return 0;
+    }
+    b->journaled = 1;
+    return 1;
+}
+
+void bcache_unjournal(int block_num)
+{
+    struct buf *b = bcache_lookup(block_num);
+    if (b != NULL)
+    {
+        b->journaled = 0;
+    }
+}
+
+// Returns the contents of block_num if it is cached, without counting a
+// hit or touching the LRU order
+unsigned char *bcache_peek(int block_num)
+{
+    struct buf *b = bcache_lookup(block_num);
+    return b == NULL ? NULL : b->data;
+}
+
+static int buf_compare(const void *a, const void *b)
+{
+    const struct buf *x = *(struct buf * const *)a;
+    const struct buf *y = *(struct buf * const *)b;
+    return (x->block_num > y->block_num) - (x->block_num < y->block_num);
+}
+
+// Writes back the dirty buffers first dirtied max_age_ms or longer ago;
+// all of them if max_age_ms is 0
+static int flush_locked(long long max_age_ms)
+{
+    struct buf *dirty[BCACHE_BLOCKS];
+    struct iovec iov[DISK_MAX_IOV];
+    int ndirty = 0;
+
+    if (!cache.initialized)
+    {
+        return 0;
+    }
+
+    long long dirtied_by = now_ms() - max_age_ms;
+    for (int i = 0; i < BCACHE_BLOCKS; i++)
+    {
+        if (cache.bufs[i].valid && cache.bufs[i].dirty && !cache.bufs[i].journaled &&
+            (max_age_ms == 0 || cache.bufs[i].dirtied_ms <= dirtied_by))
+        {
+            dirty[ndirty++] = &cache.bufs[i];
+        }
+    }
+    qsort(dirty, ndirty, sizeof(dirty[0]), buf_compare);
+
+    for (int i = 0; i < ndirty;)
+    {
+        int run = 0;
+        while (i + run < ndirty && run < DISK_MAX_IOV &&
+               dirty[i + run]->block_num == dirty[i]->block_num + run)
+        {
+            iov[run].iov_base = dirty[i + run]->data;
+            iov[run].iov_len = BLOCK_SIZE;
+            run++;
+        }
+        if (disk_writev(dirty[i]->block_num, iov, run) == -1)
+        {
+            return -1;
+        }
+        for (int k = 0; k < run; k++)
+        {
+            dirty[i + k]->dirty = 0;
+        }
+        cache.dirty_count -= run;
+        cache.stats.writebacks += run;
+        i += run;
+    }
+    return ndirty;
+}
+
+// Writes every dirty buffer back in block order, coalescing adjacent blocks
+// into one pwritev. Blocks in an uncommitted journal transaction stay
+// put. Returns the number of blocks written or -1 on error.
+int bcache_flush(void)
+{
+    pthread_mutex_lock(&cache.lock);
+    int result = flush_locked(0);
+    pthread_mutex_unlock(&cache.lock);
+    return result;
+}
+
+// bcache_flush for the background flusher: only blocks dirty for at least
+// max_age_ms
+int bcache_flush_aged(long long max_age_ms)
+{
+    pthread_mutex_lock(&cache.lock);
+    int result = flush_locked(max_age_ms);
+    pthread_mutex_unlock(&cache.lock);
+    return result;
+}
+
+void bcache_invalidate(void)
+{
+    pthread_mutex_lock(&cache.lock);
+    bcache_init();
+    pthread_mutex_unlock(&cache.lock);
+}
+
+void bcache_get_stats(struct bcache_stats *s)
+{
+    pthread_mutex_lock(&cache.lock);
+    *s = cache.stats;
+    pthread_mutex_unlock(&cache.lock);
+}
+
+void bcache_reset_stats(void)
+{
+    pthread_mutex_lock(&cache.lock);
+    memset(&cache.stats, 0, sizeof(cache.stats));
+    pthread_mutex_unlock(&cache.lock);
+}
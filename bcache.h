@@ -0,0 +1,71 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include "block.h"
+#include "async.h"
+#include <pthread.h>
+
+#define BCACHE_BLOCKS 128
+#define BCACHE_HASH_SIZE 256
+
+// A buffer whose block is being read in is hashed but not valid; the read is done without the
+// lock, and other threads after the block wait for it.
+struct buf {
+    int block_num;
+    int valid;
+    int dirty;
+    int pins;              // held by bget, never evicted while nonzero
+    int journaled;         // in the running journal transaction: not written home until it commits
+    int prefetching;       // being read by bcache_prefetch's request, io
+    long long dirtied_ms;  // when it last went from clean to dirty
+    struct async_io io;
+    struct buf *hash_next;
+    struct buf *lru_prev;  // toward most recently used
+    struct buf *lru_next;  // toward least recently used
+    unsigned char data[BLOCK_SIZE] __attribute__((aligned(8)));
+};
+
+struct bcache_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long reads;       // blocks read from the image
+    unsigned long writebacks;
+};
+
+// One filesystem's cache (see simfs.h). Everything but data is guarded by
+// lock, which is recursive: a claim may commit the journal, which comes
+// back in here.
+struct bcache {
+    struct buf bufs[BCACHE_BLOCKS];
+    struct buf *hash[BCACHE_HASH_SIZE];
+    struct buf lru;  // sentinel: lru.lru_next is the MRU buffer, lru.lru_prev the LRU one
+    struct bcache_stats stats;
+    int dirty_count;
+    int initialized;
+    pthread_mutex_t lock;
+    pthread_cond_t load_done;  // signalled whenever a read into the cache finishes, well or not
+};
+
+struct buf *bcache_get(int block_num, int fill);
+void bcache_filled(struct buf *b);
+void bcache_put(struct buf *b);
+int bcache_prefetch(int block_num);
+int bcache_contains(int block_num, int count);
+int bcache_read_many(int block_num, int count, unsigned char *blocks);
+int bcache_write_many(int block_num, int count, unsigned char *blocks);
+unsigned char *bcache_pin(int block_num);
+void bcache_unpin(int block_num);
+void bcache_mark_dirty(int block_num);
+int bcache_dirty_count(void);
+int bcache_journal(int block_num);
+void bcache_unjournal(int block_num);
+unsigned char *bcache_peek(int block_num);
+int bcache_flush(void);
+int bcache_flush_aged(long long max_age_ms);
+void bcache_invalidate(void);
+void bcache_get_stats(struct bcache_stats *stats);
+void bcache_lock(void);
+void bcache_unlock(void);
+void bcache_reset_stats(void);
+
+#endif
@@ -0,0 +1,318 @@
+#include "bitmap.h"
+#include "block.h"
+#include "free.h"
+#include "super.h"
+#include "simfs.h"
+#include <stdlib.h>
+
+static void bitmap_setup(struct bitmap *map, int map_start, int map_blocks, int nbits)
+{
+    free(map->free_counts);
+    map->map_start = map_start;
+    map->map_blocks = map_blocks;
+    map->nbits = nbits;
+    map->cursor = 0;
+    map->free_counts = malloc(map_blocks * sizeof(int));
+    for (int i = 0; i < map_blocks; i++)
+    {
+        map->free_counts[i] = -1;
+    }
+}
+
+// Points both bitmaps at the geometry in sb and forgets their counts
+void bitmap_reset(void)
+{
+    bitmap_setup(&inode_bitmap, sb.inode_map_start, sb.inode_map_blocks, sb.inode_count);
+    bitmap_setup(&block_bitmap, sb.block_map_start, sb.block_map_blocks, sb.block_count);
+}
+
+static int bits_in_block(struct bitmap *map, int index)
+{
+    int bits = map->nbits - index * BITS_PER_BLOCK;
+    return bits < BITS_PER_BLOCK ? bits : BITS_PER_BLOCK;
+}
+
+static int block_free_count(struct bitmap *map, int index)
+{
+    int count = __atomic_load_n(&map->free_counts[index], __ATOMIC_ACQUIRE);
+    if (count != -1)
+    {
+        return count;
+    }
+
+    pthread_rwlock_wrlock(&map->lock);
+    if (map->free_counts[index] == -1)
+    {
+        unsigned char *data = bget(map->map_start + index);
+        if (data != NULL)
+        {
+            __atomic_store_n(&map->free_counts[index], count_free(data, bits_in_block(map, index)), __ATOMIC_RELEASE);
+            brelse(map->map_start + index);
+        }
+    }
+    count = map->free_counts[index];
+    pthread_rwlock_unlock(&map->lock);
+    return count;
+}
+
+// Adjusts a block's free count, if it has been taken. The lock is held
+// shared, so a count cannot be in the middle of being taken.
+static void count_add(struct bitmap *map, int index, int delta)
+{
+    if (__atomic_load_n(&map->free_counts[index], __ATOMIC_ACQUIRE) != -1)
+    {
+        __atomic_fetch_add(&map->free_counts[index], delta, __ATOMIC_ACQ_REL);
+    }
+}
+
+static int get_cursor(struct bitmap *map)
+{
+    return __atomic_load_n(&map->cursor, __ATOMIC_RELAXED);
+}
+
+static void set_cursor(struct bitmap *map, int cursor)
+{
+    __atomic_store_n(&map->cursor, cursor, __ATOMIC_RELAXED);
+}
+
+// Sets and returns the next clear bit at or after the cursor, wrapping
+// around once. Full bitmap blocks are skipped on their count alone, and
+// the bit is changed in the cached block, which is written back when the
+// cache is flushed. Returns -1 if every bit is set.
+int bitmap_alloc(struct bitmap *map)
+{
+    if (map->map_blocks == 0)
+    {
+        return -1;
+    }
+    int cursor = get_cursor(map);
+    if (cursor >= map->nbits)
+    {
+        cursor = 0;
+    }
+
+    int start_index = cursor / BITS_PER_BLOCK;
+    for (int k = 0; k <= map->map_blocks; k++)
+    {
+        int index = (start_index + k) % map->map_blocks;
+        int count = block_free_count(map, index);
+        if (count == -1)
+        {
+            return -1;
+        }
+        if (count == 0)
+        {
+            continue;
+        }
+
+        // The cursor's block is searched from the cursor first and
+        // from its start again after wrapping around
+        int lo = 0, hi = bits_in_block(map, index);
+        if (k == 0)
+        {
+            lo = cursor % BITS_PER_BLOCK;
+        }
+        else if (k == map->map_blocks)
+        {
+            hi = cursor % BITS_PER_BLOCK;
+        }
+
+        int block_num = map->map_start + index;
+        pthread_rwlock_rdlock(&map->lock);
+        unsigned char *data = bget(block_num);
+        if (data == NULL)
+        {
+            pthread_rwlock_unlock(&map->lock);
+            return -1;
+        }
+        // A bit found clear may be claimed by another thread first
+        int bit = lo;
+        while ((bit = find_free_from(data, bit, hi)) != -1 && claim_bits(data, bit, 1) == 0)
+        {
+            bit++;
+        }
+        if (bit != -1)
+        {
+            bdirty(block_num);
+            count_add(map, index, -1);
+            set_cursor(map, index * BITS_PER_BLOCK + bit + 1);
+        }
+        brelse(block_num);
+        pthread_rwlock_unlock(&map->lock);
+
+        if (bit != -1)
+        {
+            return index * BITS_PER_BLOCK + bit;
+        }
+    }
+    return -1;
+}
+
+// Sets up to n clear bits in a row inside bitmap block index, starting at
+// bit (relative to the block). Returns how many, 0 if bit is taken.
+static int claim_run(struct bitmap *map, int index, int bit, int n)
+{
+    int block_num = map->map_start + index;
+
+    pthread_rwlock_rdlock(&map->lock);
+    unsigned char *data = bget(block_num);
+    if (data == NULL)
+    {
+        pthread_rwlock_unlock(&map->lock);
+        return -1;
+    }
+
+    int end = bits_in_block(map, index);
+    if (end - bit < n)
+    {
+        n = end - bit;
+    }
+    int count = claim_bits(data, bit, n);
+    if (count > 0)
+    {
+        bdirty(block_num);
+        count_add(map, index, -count);
+        set_cursor(map, index * BITS_PER_BLOCK + bit + count);
+    }
+    brelse(block_num);
+    pthread_rwlock_unlock(&map->lock);
+    return count;
+}
+
+// Allocates up to n consecutive bits, preferring, in order: a run that
+// starts exactly at goal, the first run of n at or after goal, and the
+// first clear bit at or after goal extended as far as it goes. Runs do
+// not cross bitmap blocks. *count gets the number of bits set; the
+// first one is returned, or -1 if every bit is set.
+int bitmap_alloc_run(struct bitmap *map, int n, int goal, int *count)
+{
+    if (map->map_blocks == 0 || n <= 0)
+    {
+        return -1;
+    }
+    if (goal < 0 || goal >= map->nbits)
+    {
+        int cursor = get_cursor(map);
+        goal = cursor < map->nbits ? cursor : 0;
+    }
+
+    int start_index = goal / BITS_PER_BLOCK;
+    *count = claim_run(map, start_index, goal % BITS_PER_BLOCK, n);
+    if (*count != 0)
+    {
+        return *count == -1 ? -1 : goal;
+    }
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (int k = 0; k <= map->map_blocks; k++)
+        {
+            int index = (start_index + k) % map->map_blocks;
+            int free_count = block_free_count(map, index);
+            if (free_count == -1)
+            {
+                return -1;
+            }
+            if (free_count == 0 || (pass == 0 && free_count < n))
+            {
+                continue;
+            }
+
+            int lo = 0, hi = bits_in_block(map, index);
+            if (k == 0)
+            {
+                lo = goal % BITS_PER_BLOCK;
+            }
+            else if (k == map->map_blocks)
+            {
+                hi = goal % BITS_PER_BLOCK;
+            }
+
+            unsigned char *data = bget(map->map_start + index);
+            if (data == NULL)
+            {
+                return -1;
+            }
+            int bit;
+            if (pass == 0)
+            {
+                bit = hi - lo >= n ? find_free_run(data, lo, hi, n) : -1;
+            }
+            else
+            {
+                bit = find_free_from(data, lo, hi);
+            }
+            brelse(map->map_start + index);
+
+            if (bit != -1)
+            {
+                *count = claim_run(map, index, bit, n);
+                if (*count == 0)
+                {
+                    // Lost it to another thread: look at this block again
+                    k--;
+                    continue;
+                }
+                return *count == -1 ? -1 : index * BITS_PER_BLOCK + bit;
+            }
+        }
+    }
+    return -1;
+}
+
+int bitmap_release(struct bitmap *map, int bit)
+{
+    if (bit < 0 || bit >= map->nbits)
+    {
+        return -1;
+    }
+
+    int index = bit / BITS_PER_BLOCK;
+    int block_num = map->map_start + index;
+    pthread_rwlock_rdlock(&map->lock);
+    unsigned char *data = bget(block_num);
+    if (data == NULL)
+    {
+        pthread_rwlock_unlock(&map->lock);
+        return -1;
+    }
+    if (release_bit(data, bit % BITS_PER_BLOCK))
+    {
+        count_add(map, index, 1);
+    }
+    bdirty(block_num);
+    brelse(block_num);
+    pthread_rwlock_unlock(&map->lock);
+    return 0;
+}
+
+int bitmap_count_free(struct bitmap *map)
+{
+    int total = 0;
+    for (int i = 0; i < map->map_blocks; i++)
+    {
+        int count = block_free_count(map, i);
+        if (count == -1)
+        {
+            return -1;
+        }
+        total += count;
+    }
+    return total;
+}
+
+static void bitmap_forget(struct bitmap *map, int block_num)
+{
+    if (block_num >= map->map_start && block_num < map->map_start + map->map_blocks)
+    {
+        __atomic_store_n(&map->free_counts[block_num - map->map_start], -1, __ATOMIC_RELEASE);
+    }
+}
+
+// Called when a whole block is overwritten: if it belongs to a bitmap,
+// its free count has to be taken again.
+void bitmap_block_written(int block_num)
+{
+    bitmap_forget(&inode_bitmap, block_num);
+    bitmap_forget(&block_bitmap, block_num);
+}
@@ -0,0 +1,29 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <pthread.h>
+
+// An on-disk allocation bitmap. The bits stay in their cached blocks and
+// are changed in place; the allocator only keeps a free count per bitmap
+// block and a next-fit cursor in memory. Threads claim bits with compare
+// and swap; the lock is only taken exclusively to count a block, so the
+// counts stay exact while bits change under it shared.
+struct bitmap {
+    int map_start;      // first block of the bitmap
+    int map_blocks;
+    int nbits;          // bits in use; the rest of the last block is ignored
+    int cursor;         // next-fit: the search resumes here
+    int *free_counts;   // per bitmap block, -1 until counted
+    pthread_rwlock_t lock;
+};
+
+// The open image's bitmaps are inode_bitmap and block_bitmap (see simfs.h)
+
+void bitmap_reset(void);
+int bitmap_alloc(struct bitmap *map);
+int bitmap_alloc_run(struct bitmap *map, int n, int goal, int *count);
+int bitmap_release(struct bitmap *map, int bit);
+int bitmap_count_free(struct bitmap *map);
+void bitmap_block_written(int block_num);
+
+#endif
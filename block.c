@@ -1,30 +1,221 @@
 #include "block.h"
+#include "bcache.h"
+#include "async.h"
+#include "disk.h"
 #include "image.h"
 #include "free.h"
-#include <unistd.h>
+#include "bitmap.h"
+#include "journal.h"
+#include "checksum.h"
+#include "simfs.h"
+#include <string.h>
+
+// In mmap mode blocks are copied straight to and from the mapping and the
+// buffer cache is bypassed; otherwise everything goes through the cache.
+
+static unsigned char *map_block(int block_num) {
+    if (block_num < 0 || block_num >= image_map_blocks) {
+        return NULL;
+    }
+    return image_map + (size_t)block_num * BLOCK_SIZE;
+}
 
 unsigned char *bread(int block_num, unsigned char *block) {
-    off_t byte_offset = (block_num * BLOCK_SIZE);
-    lseek(image_fd, byte_offset, SEEK_SET);
-    read(image_fd, block, BLOCK_SIZE); 
+    if (image_map != NULL) {
+        unsigned char *src = map_block(block_num);
+        if (src == NULL) {
+            return NULL;
+        }
+        memcpy(block, src, BLOCK_SIZE);
+        return block;
+    }
+
+    struct buf *b = bcache_get(block_num, 1);
+    if (b == NULL) {
+        return NULL;
+    }
+    memcpy(block, b->data, BLOCK_SIZE);
+    bcache_put(b);
     return block;
 }
 
-void bwrite(int block_num, unsigned char *block) {
-    off_t byte_offset = (block_num * BLOCK_SIZE);
-    lseek(image_fd, byte_offset, SEEK_SET);
-    write(image_fd, block, BLOCK_SIZE);
-    return;
+// Metadata joins the running journal transaction before it is marked
+// dirty and while its buffer is still pinned, so neither the flusher nor
+// an eviction can write it home before it is logged
+static int write_block(int block_num, unsigned char *block, int meta) {
+    bitmap_block_written(block_num);
+
+    if (image_map != NULL) {
+        unsigned char *dest = map_block(block_num);
+        if (dest == NULL) {
+            return -1;
+        }
+        memcpy(dest, block, BLOCK_SIZE);
+        image_mark_dirty(block_num);
+        return 0;
+    }
+
+    struct buf *b = bcache_get(block_num, 0);
+    if (b == NULL) {
+        return -1;
+    }
+    memcpy(b->data, block, BLOCK_SIZE);
+    bcache_filled(b);
+    if (meta) {
+        journal_add(block_num);
+    }
+    bcache_mark_dirty(block_num);
+    bcache_put(b);
+    return 0;
+}
+
+int bwrite(int block_num, unsigned char *block) {
+    return write_block(block_num, block, 0);
+}
+
+// bwrite for metadata: the block joins the running journal transaction
+// and is checksummed from now on
+int bwrite_meta(int block_num, unsigned char *block) {
+    checksum_track(block_num);
+    return write_block(block_num, block, 1);
+}
+
+int bread_many(int block_num, int count, unsigned char *blocks) {
+    if (image_map != NULL) {
+        if (map_block(block_num) == NULL || map_block(block_num + count - 1) == NULL) {
+            return -1;
+        }
+        memcpy(blocks, map_block(block_num), (size_t)count * BLOCK_SIZE);
+        return 0;
+    }
+    return bcache_read_many(block_num, count, blocks);
+}
+
+int bwrite_many(int block_num, int count, unsigned char *blocks) {
+    for (int i = 0; i < count; i++) {
+        bitmap_block_written(block_num + i);
+    }
+
+    if (image_map != NULL) {
+        if (map_block(block_num) == NULL || map_block(block_num + count - 1) == NULL) {
+            return -1;
+        }
+        memcpy(map_block(block_num), blocks, (size_t)count * BLOCK_SIZE);
+        image_mark_dirty(block_num);
+        image_mark_dirty(block_num + count - 1);
+        return 0;
+    }
+    return bcache_write_many(block_num, count, blocks);
+}
+
+// Starts reading count contiguous blocks into blocks; done(io) runs from
+// the async_wait that reaps it. Blocks the cache or the mapping may hold
+// are copied at once instead and only reported by the next async_wait.
+// Returns -1 if count is out of range.
+int bread_async(struct async_io *io, int block_num, int count, unsigned char *blocks,
+                void (*done)(struct async_io *), void *arg) {
+    if (count < 1 || count > DISK_MAX_IOV) {
+        return -1;
+    }
+    async_init(io, 0, block_num, count, blocks, done, arg);
+    if (image_map != NULL || bcache_contains(block_num, count)) {
+        async_complete(io, bread_many(block_num, count, blocks));
+        return 0;
+    }
+    async_queue(io);
+    return 0;
+}
+
+// Starts writing count contiguous blocks from blocks, which must stay put
+// until done(io) runs. Blocks that are not cached go straight to the
+// image; until the write is reaped, reading them may still return what
+// was there before.
+int bwrite_async(struct async_io *io, int block_num, int count, unsigned char *blocks,
+                 void (*done)(struct async_io *), void *arg) {
+    if (count < 1 || count > DISK_MAX_IOV) {
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        bitmap_block_written(block_num + i);
+    }
+    async_init(io, 1, block_num, count, blocks, done, arg);
+    if (image_map != NULL || bcache_contains(block_num, count)) {
+        async_complete(io, bwrite_many(block_num, count, blocks));
+        return 0;
+    }
+    async_queue(io);
+    return 0;
+}
+
+// Starts reading block_num into the cache, for a bread soon after. The
+// request goes out with the next async_submit or async_wait.
+int bprefetch(int block_num) {
+    if (image_map != NULL) {
+        return 0;
+    }
+    return bcache_prefetch(block_num);
 }
 
+// Returns a pointer to the block itself rather than a copy: straight into
+// the mapping in mmap mode, or to a pinned cache buffer otherwise. Callers
+// that modify it must call bdirty, and brelse once they are done with it.
+// Blocks changed in place are metadata, so bdirty also journals and
+// checksums them.
+unsigned char *bget(int block_num) {
+    if (image_map != NULL) {
+        return map_block(block_num);
+    }
+    return bcache_pin(block_num);
+}
+
+void bdirty(int block_num) {
+    if (image_map != NULL) {
+        image_mark_dirty(block_num);
+        return;
+    }
+    // Journaled first, as in write_block
+    checksum_track(block_num);
+    journal_add(block_num);
+    bcache_mark_dirty(block_num);
+}
+
+void brelse(int block_num) {
+    if (image_map == NULL) {
+        bcache_unpin(block_num);
+    }
+}
+
+// Commits the running journal transaction, if any, then writes back
+// everything dirty and, after the blocks, their checksums
+int bsync(void) {
+    if (image_map != NULL) {
+        return image_msync();
+    }
+    if (journal_commit() == -1) {
+        return -1;
+    }
+    int result = bcache_flush();
+    if (result == -1 || checksum_flush() == -1) {
+        return -1;
+    }
+    return result;
+}
+
+// A new block is not checked until it is written as metadata
 int alloc(void) {
-    unsigned char data_block[BLOCK_SIZE] = { 0 };
-    int free_bit_num;
-    bread(FREE_DATA_BLOCK_NUM, data_block);
-    free_bit_num = find_free(data_block);
-    if (free_bit_num != -1) {
-        set_free(data_block, free_bit_num, 1);
-    }
-    bwrite(FREE_DATA_BLOCK_NUM, data_block);
-    return free_bit_num;
+    int block_num = bitmap_alloc(&block_bitmap);
+    if (block_num != -1) {
+        checksum_untrack(block_num, 1);
+    }
+    return block_num;
+}
+
+// Allocates up to n contiguous blocks near goal (see bitmap_alloc_run);
+// *count gets how many were allocated.
+int alloc_run(int n, int goal, int *count) {
+    int block_num = bitmap_alloc_run(&block_bitmap, n, goal, count);
+    if (block_num != -1) {
+        checksum_untrack(block_num, *count);
+    }
+    return block_num;
 }
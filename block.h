@@ -1,11 +1,25 @@
 #ifndef BLOCK_H
 #define BLOCK_H
 
-#define FREE_DATA_BLOCK_NUM 2
 #define BLOCK_SIZE 4096
 
+struct async_io;
+
 unsigned char *bread(int block_num, unsigned char *block);
-void bwrite(int block_num, unsigned char *block);
+int bwrite(int block_num, unsigned char *block);
+int bwrite_meta(int block_num, unsigned char *block);
+int bread_many(int block_num, int count, unsigned char *blocks);
+int bwrite_many(int block_num, int count, unsigned char *blocks);
+int bread_async(struct async_io *io, int block_num, int count, unsigned char *blocks,
+                void (*done)(struct async_io *io), void *arg);
+int bwrite_async(struct async_io *io, int block_num, int count, unsigned char *blocks,
+                 void (*done)(struct async_io *io), void *arg);
+int bprefetch(int block_num);
+unsigned char *bget(int block_num);
+void bdirty(int block_num);
+void brelse(int block_num);
+int bsync(void);
 int alloc(void);
+int alloc_run(int n, int goal, int *count);
 
-#endif
\ No newline at end of file
+#endif
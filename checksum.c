@@ -0,0 +1,457 @@
+#include "checksum.h"
+#include "disk.h"
+#include "journal.h"
+#include "pack.h"
+#include "super.h"
+#include "simfs.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// This thread's filesystem's table
+#define checksums (simfs_current->checksums)
+
+#define CRC32C_POLY 0x82f63b78  // reflected Castagnoli polynomial
+
+// Slicing-by-8: crc_tables[k][b] is the CRC of byte b followed by k zero
+// bytes, so eight bytes are folded in with eight lookups
+static uint32_t crc_tables[8][256];
+static pthread_once_t crc_tables_once = PTHREAD_ONCE_INIT;
+
+static void crc_tables_init(void)
+{
+    for (int b = 0; b < 256; b++)
+    {
+        uint32_t crc = b;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+        }
+        crc_tables[0][b] = crc;
+    }
+    for (int b = 0; b < 256; b++)
+    {
+        for (int k = 1; k < 8; k++)
+        {
+            crc_tables[k][b] = (crc_tables[k - 1][b] >> 8) ^ crc_tables[0][crc_tables[k - 1][b] & 0xff];
+        }
+    }
+}
+
+static uint32_t crc_table(uint32_t crc, const unsigned char *p, size_t len)
+{
+    pthread_once(&crc_tables_once, crc_tables_init);
+    for (; len >= 8; p += 8, len -= 8)
+    {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        word = __builtin_bswap64(word);
+#endif
+        word ^= crc;
+        crc = crc_tables[7][word & 0xff] ^ crc_tables[6][(word >> 8) & 0xff] ^
+              crc_tables[5][(word >> 16) & 0xff] ^ crc_tables[4][(word >> 24) & 0xff] ^
+              crc_tables[3][(word >> 32) & 0xff] ^ crc_tables[2][(word >> 40) & 0xff] ^
+              crc_tables[1][(word >> 48) & 0xff] ^ crc_tables[0][word >> 56];
+    }
+    for (; len > 0; p++, len--)
+    {
+        crc = (crc >> 8) ^ crc_tables[0][(crc ^ *p) & 0xff];
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+// The crc32 instruction takes three cycles but can start one a cycle, so
+// it runs over three segments of STRIDE bytes at once. The CRC of the
+// whole is the first segment's shifted past the second, with the
+// second's folded in, shifted past the third, and so on; shifting a CRC
+// past n zero bytes is linear, so it takes four lookups in
+// shift_tables.
+#define STRIDE 1360
+
+static uint32_t shift_tables[4][256];
+static pthread_once_t shift_tables_once = PTHREAD_ONCE_INIT;
+
+static void shift_tables_init(void)
+{
+    static const unsigned char zeros[STRIDE];
+    uint32_t bit_shift[32];
+
+    for (int bit = 0; bit < 32; bit++)
+    {
+        bit_shift[bit] = crc_table(1u << bit, zeros, STRIDE);
+    }
+    for (int i = 0; i < 4; i++)
+    {
+        for (int b = 0; b < 256; b++)
+        {
+            uint32_t shifted = 0;
+            for (int bit = 0; bit < 8; bit++)
+            {
+                shifted ^= (b >> bit) & 1 ? bit_shift[i * 8 + bit] : 0;
+            }
+            shift_tables[i][b] = shifted;
+        }
+    }
+}
+
+static uint32_t shift_stride(uint32_t crc)
+{
+    return shift_tables[0][crc & 0xff] ^ shift_tables[1][(crc >> 8) & 0xff] ^
+           shift_tables[2][(crc >> 16) & 0xff] ^ shift_tables[3][crc >> 24];
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc_sse42(uint32_t crc, const unsigned char *p, size_t len)
+{
+    pthread_once(&shift_tables_once, shift_tables_init);
+    for (; len >= 3 * STRIDE; p += 3 * STRIDE, len -= 3 * STRIDE)
+    {
+        uint64_t c0 = crc, c1 = 0, c2 = 0;
+        for (int i = 0; i < STRIDE; i += 8)
+        {
+            uint64_t w0, w1, w2;
+            memcpy(&w0, p + i, sizeof(w0));
+            memcpy(&w1, p + STRIDE + i, sizeof(w1));
+            memcpy(&w2, p + 2 * STRIDE + i, sizeof(w2));
+            c0 = _mm_crc32_u64(c0, w0);
+            c1 = _mm_crc32_u64(c1, w1);
+            c2 = _mm_crc32_u64(c2, w2);
+        }
+        crc = shift_stride(shift_stride((uint32_t)c0) ^ (uint32_t)c1) ^ (uint32_t)c2;
+    }
+
+    uint64_t crc64 = crc;
+    for (; len >= 8; p += 8, len -= 8)
+    {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t)crc64;
+    for (; len > 0; p++, len--)
+    {
+        crc = _mm_crc32_u8(crc, *p);
+    }
+    return crc;
+}
+
+static int has_sse42(void)
+{
+    return __builtin_cpu_supports("sse4.2");
+}
+#endif
+
+struct checksum_kernel {
+    const char *name;
+    uint32_t (*crc)(uint32_t crc, const unsigned char *p, size_t len);
+    int (*supported)(void);
+};
+
+static int always(void)
+{
+    return 1;
+}
+
+// Fastest last; the first call picks the last one the CPU supports
+static const struct checksum_kernel kernels[] = {
+    { "table", crc_table, always },
+#if defined(__x86_64__)
+    { "sse4.2", crc_sse42, has_sse42 },
+#endif
+};
+
+static const struct checksum_kernel *kernel = NULL;
+
+static const struct checksum_kernel *checksum_kernel(void)
+{
+    if (kernel == NULL)
+    {
+        for (int i = sizeof(kernels) / sizeof(kernels[0]) - 1; i >= 0; i--)
+        {
+            if (kernels[i].supported())
+            {
+                kernel = &kernels[i];
+                break;
+            }
+        }
+    }
+    return kernel;
+}
+
+// Switches to the named kernel ("table" or "sse4.2"), e.g. to compare
+// them. Returns -1 if it is unknown or the CPU lacks it.
+int checksum_use_kernel(const char *name)
+{
+    for (unsigned int i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+    {
+        if (strcmp(kernels[i].name, name) == 0 && kernels[i].supported())
+        {
+            kernel = &kernels[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char *checksum_kernel_name(void)
+{
+    return checksum_kernel()->name;
+}
+
+// Continues the CRC32C crc of earlier data (0 to start) over len bytes
+unsigned int crc32c(unsigned int crc, const void *data, size_t len)
+{
+    return ~checksum_kernel()->crc(~crc, data, len);
+}
+
+static unsigned int block_checksum(int block_num, unsigned char *block)
+{
+    unsigned char seed[4];
+    write_u32(seed, block_num);
+    unsigned int sum = crc32c(crc32c(0, seed, sizeof(seed)), block, BLOCK_SIZE);
+    return sum == 0 ? 1 : sum;
+}
+
+static void table_set(int block_num, unsigned int sum)
+{
+    __atomic_store_n(&checksums.table[block_num], sum, __ATOMIC_RELAXED);
+    __atomic_store_n(&checksums.dirty[block_num / CHECKSUMS_PER_BLOCK], 1, __ATOMIC_RELEASE);
+}
+
+static unsigned int table_get(int block_num)
+{
+    return __atomic_load_n(&checksums.table[block_num], __ATOMIC_RELAXED);
+}
+
+static int in_table(int block_num)
+{
+    return checksums.table != NULL && block_num >= 0 && block_num < (int)sb.block_count;
+}
+
+static int always_covered(int block_num)
+{
+    return block_num >= (int)sb.inode_map_start && block_num < (int)(sb.inode_table_start + sb.inode_table_blocks);
+}
+
+static int table_alloc(void)
+{
+    checksums.table_blocks = sb.checksum_blocks;
+    checksums.table = calloc((size_t)checksums.table_blocks * CHECKSUMS_PER_BLOCK, sizeof(unsigned int));
+    checksums.dirty = calloc(checksums.table_blocks, 1);
+    if (checksums.table == NULL || checksums.dirty == NULL)
+    {
+        checksum_unload();
+        return -1;
+    }
+    return 0;
+}
+
+// Sets up the table of a freshly formatted image, whose blocks are all
+// zeros and so all unchecked
+int checksum_format(void)
+{
+    checksum_unload();
+    if (!(sb.features & FEATURE_CHECKSUMS))
+    {
+        return 0;
+    }
+    return table_alloc();
+}
+
+// Reads the table of the image just opened. Called before the journal is
+// replayed, so the blocks it puts back are stamped.
+int checksum_load(void)
+{
+    struct iovec iov[DISK_MAX_IOV];
+
+    checksum_unload();
+    if (!(sb.features & FEATURE_CHECKSUMS))
+    {
+        return 0;
+    }
+    if (table_alloc() == -1)
+    {
+        return -1;
+    }
+
+    // Read into the table before it is in use, so the reads are not checked
+    unsigned int *table = checksums.table;
+    checksums.table = NULL;
+    for (int t = 0; t < checksums.table_blocks; t += DISK_MAX_IOV)
+    {
+        int run = checksums.table_blocks - t < DISK_MAX_IOV ? checksums.table_blocks - t : DISK_MAX_IOV;
+        for (int k = 0; k < run; k++)
+        {
+            iov[k].iov_base = table + (size_t)(t + k) * CHECKSUMS_PER_BLOCK;
+            iov[k].iov_len = BLOCK_SIZE;
+        }
+        if (disk_readv(sb.checksum_start + t, iov, run) == -1)
+        {
+            checksums.table = table;
+            checksum_unload();
+            return -1;
+        }
+    }
+    for (size_t i = 0; i < (size_t)checksums.table_blocks * CHECKSUMS_PER_BLOCK; i++)
+    {
+        table[i] = read_u32(&table[i]);
+    }
+    checksums.table = table;
+    return 0;
+}
+
+void checksum_unload(void)
+{
+    free(checksums.table);
+    free(checksums.dirty);
+    checksums.table = NULL;
+    checksums.dirty = NULL;
+    checksums.table_blocks = 0;
+}
+
+// Writes back the parts of the table changed since the last call.
+// Returns how many table blocks were written or -1 on error.
+int checksum_flush(void)
+{
+    unsigned char block[BLOCK_SIZE];
+    int written = 0;
+
+    for (int t = 0; t < checksums.table_blocks; t++)
+    {
+        if (!__atomic_exchange_n(&checksums.dirty[t], 0, __ATOMIC_ACQUIRE))
+        {
+            continue;
+        }
+        for (int i = 0; i < CHECKSUMS_PER_BLOCK; i++)
+        {
+            write_u32(block + i * 4, table_get(t * CHECKSUMS_PER_BLOCK + i));
+        }
+        if (disk_write(sb.checksum_start + t, block) == -1)
+        {
+            __atomic_store_n(&checksums.dirty[t], 1, __ATOMIC_RELEASE);
+            return -1;
+        }
+        written++;
+    }
+    return written;
+}
+
+// Called by the disk layer once count blocks from block_num are written.
+// A journal puts back whatever a crash leaves unstamped, but without one
+// the table blocks covering them follow them to the image straight away.
+int checksum_written(int block_num, int count)
+{
+    if (checksums.table == NULL || journal_active() ||
+        (block_num < (int)(sb.checksum_start + sb.checksum_blocks) && block_num + count > (int)sb.checksum_start))
+    {
+        return 0;
+    }
+    return checksum_flush() == -1 ? -1 : 0;
+}
+
+// Recomputes the checksum of every covered block from what the image
+// holds, taking blocks that fail their check as they are, and writes the
+// table. For fsck, once nothing else uses the image. Returns how many
+// checksums were wrong or -1 on error.
+int checksum_rebuild(void)
+{
+    unsigned char block[BLOCK_SIZE];
+    int changed = 0;
+
+    if (checksums.table == NULL)
+    {
+        return 0;
+    }
+    for (int b = 0; b < (int)sb.block_count; b++)
+    {
+        if (table_get(b) == 0 && !always_covered(b))
+        {
+            continue;
+        }
+        if (disk_read_unchecked(b, block) == -1)
+        {
+            return -1;
+        }
+        // Blocks never written have no checksum yet, which is no fault
+        unsigned int sum = block_checksum(b, block);
+        unsigned int old = table_get(b);
+        if (sum != old)
+        {
+            table_set(b, sum);
+            changed += old != 0;
+        }
+    }
+    return checksum_flush() == -1 ? -1 : changed;
+}
+
+// Starts checking block_num, which is being written as metadata. Called
+// before the block can reach the disk, so its first write is stamped.
+void checksum_track(int block_num)
+{
+    if (in_table(block_num) && table_get(block_num) == 0)
+    {
+        table_set(block_num, 1);
+    }
+}
+
+// Stops checking count blocks from block_num, which were just allocated
+// and may be about to hold file data
+void checksum_untrack(int block_num, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (in_table(block_num + i) && table_get(block_num + i) != 0)
+        {
+            table_set(block_num + i, 0);
+        }
+    }
+}
+
+// Records the checksums of count blocks about to be written from blocks
+void checksum_stamp(int block_num, int count, unsigned char *blocks)
+{
+    for (int i = 0; i < count; i++)
+    {
+        int b = block_num + i;
+        if (in_table(b) && (table_get(b) != 0 || always_covered(b)))
+        {
+            unsigned int sum = block_checksum(b, blocks + (size_t)i * BLOCK_SIZE);
+            if (sum != table_get(b))
+            {
+                table_set(b, sum);
+            }
+        }
+    }
+}
+
+// Checks count blocks just read into blocks against the table. Returns -1
+// if any of them does not match.
+int checksum_verify(int block_num, int count, unsigned char *blocks)
+{
+    for (int i = 0; i < count; i++)
+    {
+        int b = block_num + i;
+        if (!in_table(b))
+        {
+            continue;
+        }
+        unsigned int sum = table_get(b);
+        if (sum != 0 && sum != block_checksum(b, blocks + (size_t)i * BLOCK_SIZE))
+        {
+            __atomic_add_fetch(&checksums.failures, 1, __ATOMIC_RELAXED);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+unsigned long checksum_failures(void)
+{
+    return __atomic_load_n(&checksums.failures, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,52 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include "block.h"
+#include <stddef.h>
+
+// Metadata checksums, with FEATURE_CHECKSUMS. A table after the journal
+// holds a 32-bit CRC32C for every block of the image, seeded with the
+// block number so a block written to the wrong place fails too. It is
+// kept in memory while the image is open: blocks are stamped as the disk
+// layer writes them and verified as it reads them. With a journal the
+// dirty parts of the table go back to the image with bsync and at each
+// checkpoint, and replay restamps whatever a crash cut off; without one
+// they are written right after the blocks they cover. A crash between the
+// two leaves a block failing its check until fsck rebuilds the table.
+//
+// The bitmaps and the inode table are always covered. Other blocks are
+// covered once they are written as metadata (bwrite_meta or bdirty), which
+// takes in directory, indirect and extent leaf blocks, until they are
+// allocated again. An entry of 0 means the block is not checked, so a
+// checksum that comes out 0 is stored as 1.
+//
+// Mapped pages reach the image without passing through the disk layer, so
+// images with checksums are always opened without IMAGE_MMAP.
+
+#define CHECKSUMS_PER_BLOCK (BLOCK_SIZE / 4)
+
+// One filesystem's checksum table (see simfs.h), NULL without the feature
+struct checksum_state {
+    unsigned int *table;    // one per block of the image
+    unsigned char *dirty;   // one per table block
+    int table_blocks;
+    unsigned long failures; // blocks that failed verification
+};
+
+unsigned int crc32c(unsigned int crc, const void *data, size_t len);
+int checksum_use_kernel(const char *name);
+const char *checksum_kernel_name(void);
+
+int checksum_format(void);
+int checksum_load(void);
+void checksum_unload(void);
+int checksum_flush(void);
+int checksum_written(int block_num, int count);
+int checksum_rebuild(void);
+void checksum_track(int block_num);
+void checksum_untrack(int block_num, int count);
+void checksum_stamp(int block_num, int count, unsigned char *blocks);
+int checksum_verify(int block_num, int count, unsigned char *blocks);
+unsigned long checksum_failures(void);
+
+#endif
@@ -0,0 +1,167 @@
+#include "disk.h"
+#include "block.h"
+#include "image.h"
+#include "checksum.h"
+#include "simfs.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+// Drops the first done bytes from an iovec array, returning the number of
+// entries that still have data left.
+static int iov_advance(struct iovec **iov, int count, size_t done)
+{
+    while (count > 0 && done >= (*iov)->iov_len)
+    {
+        done -= (*iov)->iov_len;
+        (*iov)++;
+        count--;
+    }
+    if (count > 0)
+    {
+        (*iov)->iov_base = (unsigned char *)(*iov)->iov_base + done;
+        (*iov)->iov_len -= done;
+    }
+    return count;
+}
+
+// Reads count contiguous blocks starting at block_num into the buffers of
+// iov, one preadv per pass. Short reads are retried; anything past the end
+// of the image reads back as zeros. The iovec array is consumed.
+static int disk_readv_all(int block_num, struct iovec *iov, int count)
+{
+    off_t byte_offset = (off_t)block_num * BLOCK_SIZE;
+
+    while (count > 0)
+    {
+        ssize_t n = preadv(image_fd, iov, count > DISK_MAX_IOV ? DISK_MAX_IOV : count, byte_offset);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0)
+        {
+            for (int i = 0; i < count; i++)
+            {
+                memset(iov[i].iov_base, 0, iov[i].iov_len);
+            }
+            return 0;
+        }
+        byte_offset += n;
+        count = iov_advance(&iov, count, n);
+    }
+    return 0;
+}
+
+static int disk_writev_all(int block_num, struct iovec *iov, int count)
+{
+    off_t byte_offset = (off_t)block_num * BLOCK_SIZE;
+
+    while (count > 0)
+    {
+        ssize_t n = pwritev(image_fd, iov, count > DISK_MAX_IOV ? DISK_MAX_IOV : count, byte_offset);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        byte_offset += n;
+        count = iov_advance(&iov, count, n);
+    }
+    return 0;
+}
+
+// Blocks are checked against their checksums as they are read and stamped
+// as they are written (see checksum.h). A block that fails its check is
+// an error, EBADMSG.
+
+static int verify_iov(int block_num, struct iovec *iov, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (checksum_verify(block_num + i, 1, iov[i].iov_base) == -1)
+        {
+            errno = EBADMSG;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int disk_read(int block_num, unsigned char *block)
+{
+    struct iovec iov = { block, BLOCK_SIZE };
+    if (disk_readv_all(block_num, &iov, 1) == -1)
+    {
+        return -1;
+    }
+    return verify_iov(block_num, &iov, 1);
+}
+
+// disk_read without the checksum check, for rebuilding the checksums
+int disk_read_unchecked(int block_num, unsigned char *block)
+{
+    struct iovec iov = { block, BLOCK_SIZE };
+    return disk_readv_all(block_num, &iov, 1);
+}
+
+int disk_write(int block_num, unsigned char *block)
+{
+    struct iovec iov = { block, BLOCK_SIZE };
+    checksum_stamp(block_num, 1, block);
+    if (disk_writev_all(block_num, &iov, 1) == -1)
+    {
+        return -1;
+    }
+    return checksum_written(block_num, 1);
+}
+
+int disk_readv(int block_num, struct iovec *iov, int count)
+{
+    struct iovec local[DISK_MAX_IOV];
+
+    // Work on a copy so the caller's iovecs survive a short transfer
+    while (count > 0)
+    {
+        int n = count > DISK_MAX_IOV ? DISK_MAX_IOV : count;
+        memcpy(local, iov, n * sizeof(struct iovec));
+        if (disk_readv_all(block_num, local, n) == -1 || verify_iov(block_num, iov, n) == -1)
+        {
+            return -1;
+        }
+        block_num += n;
+        iov += n;
+        count -= n;
+    }
+    return 0;
+}
+
+int disk_writev(int block_num, struct iovec *iov, int count)
+{
+    struct iovec local[DISK_MAX_IOV];
+
+    while (count > 0)
+    {
+        int n = count > DISK_MAX_IOV ? DISK_MAX_IOV : count;
+        memcpy(local, iov, n * sizeof(struct iovec));
+        for (int i = 0; i < n; i++)
+        {
+            checksum_stamp(block_num + i, 1, iov[i].iov_base);
+        }
+        if (disk_writev_all(block_num, local, n) == -1 || checksum_written(block_num, n) == -1)
+        {
+            return -1;
+        }
+        block_num += n;
+        iov += n;
+        count -= n;
+    }
+    return 0;
+}
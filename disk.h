@@ -0,0 +1,15 @@
+#ifndef DISK_H
+#define DISK_H
+
+#include <sys/uio.h>
+
+#define DISK_MAX_IOV 64
+
+int disk_read(int block_num, unsigned char *block);
+int disk_read_unchecked(int block_num, unsigned char *block);
+int disk_write(int block_num, unsigned char *block);
+// The vectored calls move one block per iovec, starting at block_num
+int disk_readv(int block_num, struct iovec *iov, int count);
+int disk_writev(int block_num, struct iovec *iov, int count);
+
+#endif
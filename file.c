@@ -0,0 +1,426 @@
+#include "file.h"
+#include "block.h"
+#include "inode.h"
+#include "mkfs.h"
+#include "super.h"
+#include "journal.h"
+#include "simfs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Allocates an empty regular file and returns its inode number
+int file_create(void)
+{
+    struct inode *in = ialloc();
+    if (in == NULL)
+    {
+        return -1;
+    }
+
+    ilock(in);
+    in->flags = FILE_FLAG;
+    if (sb.features & FEATURE_EXTENTS)
+    {
+        in->flags |= EXTENTS_FLAG;
+    }
+    if (sb.features & FEATURE_INLINE_DATA)
+    {
+        in->flags |= INLINE_FLAG;
+    }
+    idirty(in);
+    iunlock(in);
+
+    int inode_num = in->inode_num;
+    iput(in);
+    return inode_num;
+}
+
+struct file *file_open(int inode_num)
+{
+    struct inode *in = iget(inode_num);
+    if (in == NULL)
+    {
+        return NULL;
+    }
+
+    struct file *f = malloc(sizeof(struct file));
+    if (f == NULL)
+    {
+        iput(in);
+        return NULL;
+    }
+    f->inode = in;
+    f->offset = 0;
+    f->cursor.block_num = 0;
+    readahead_init(&f->ra);
+    f->buf_index = -1;
+    f->buf_dirty = 0;
+    return f;
+}
+
+static int file_bmap(struct file *f, int index)
+{
+    return bmap_cached(f->inode, index, &f->cursor);
+}
+
+static int file_flush(struct file *f)
+{
+    if (f->buf_index != -1 && f->buf_dirty)
+    {
+        if (bwrite(file_bmap(f, f->buf_index), f->buf) == -1)
+        {
+            return -1;
+        }
+        f->buf_dirty = 0;
+        f->inode->data_version++;
+    }
+    return 0;
+}
+
+// Makes buf hold logical block index, writing back whatever it held
+// before. Only a block that already has data in it is read; one past the
+// end of the file starts out as zeros.
+static int file_buffer(struct file *f, int index)
+{
+    if (f->buf_index == index)
+    {
+        return 0;
+    }
+    if (file_flush(f) == -1)
+    {
+        return -1;
+    }
+
+    f->buf_index = -1;
+    if ((unsigned int)index * BLOCK_SIZE < f->inode->size)
+    {
+        if (bread(file_bmap(f, index), f->buf) == NULL)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        memset(f->buf, 0, BLOCK_SIZE);
+    }
+    f->buf_index = index;
+    return 0;
+}
+
+// Maps logical blocks [first, last], allocating every run of unmapped
+// blocks in one go. Returns the last block it managed to map.
+static int file_map(struct file *f, int first, int last)
+{
+    unsigned char zero_block[BLOCK_SIZE] = { 0 };
+    struct inode *in = f->inode;
+
+    for (int index = first; index <= last; index++)
+    {
+        int block_num = file_bmap(f, index);
+        if (block_num == -1)
+        {
+            return index - 1;
+        }
+        if (block_num != 0)
+        {
+            continue;
+        }
+
+        int count = 1;
+        while (index + count <= last && file_bmap(f, index + count) == 0)
+        {
+            count++;
+        }
+        if (inode_add_blocks(in, index, count) == -1)
+        {
+            return index - 1;
+        }
+        // Holes inside the file have to read back as zeros
+        for (int i = index; i < index + count && (unsigned int)i * BLOCK_SIZE < in->size; i++)
+        {
+            bwrite(file_bmap(f, i), zero_block);
+        }
+        index += count - 1;
+    }
+    return last;
+}
+
+// Length of the run of whole blocks starting at index that sit next to
+// each other on disk, up to max
+static int contiguous_blocks(struct file *f, int index, int max)
+{
+    int first = file_bmap(f, index);
+    int run = 1;
+
+    while (run < max && file_bmap(f, index + run) == first + run)
+    {
+        run++;
+    }
+    return run;
+}
+
+// A write to a file that stays within INLINE_DATA_SIZE bytes only changes
+// the inode
+static int write_inline(struct file *f, const unsigned char *src, int count)
+{
+    struct inode *in = f->inode;
+
+    memcpy(in->inline_data + f->offset, src, count);
+    f->offset += count;
+    if (f->offset > in->size)
+    {
+        in->size = f->offset;
+    }
+    idirty(in);
+    in->data_version++;
+    return count;
+}
+
+// Moves an inline file's data out to a block of its own, once a write
+// would take it past INLINE_DATA_SIZE bytes
+static int file_uninline(struct file *f)
+{
+    struct inode *in = f->inode;
+    unsigned char block[BLOCK_SIZE] = { 0 };
+
+    memcpy(block, in->inline_data, in->size);
+    in->flags &= ~INLINE_FLAG;
+    idirty(in);
+    if (in->size == 0)
+    {
+        return 0;
+    }
+    if (inode_add_blocks(in, 0, 1) == -1)
+    {
+        in->flags |= INLINE_FLAG;
+        return -1;
+    }
+    return bwrite(file_bmap(f, 0), block) == -1 ? -1 : 0;
+}
+
+static int write_locked(struct file *f, const void *buf, int count)
+{
+    const unsigned char *src = buf;
+    struct inode *in = f->inode;
+    int written = 0;
+
+    if (count <= 0)
+    {
+        return count == 0 ? 0 : -1;
+    }
+
+    if ((long long)f->offset + count > FILE_MAX_SIZE)
+    {
+        count = FILE_MAX_SIZE - f->offset;
+        if (count == 0)
+        {
+            return -1;
+        }
+    }
+
+    if (in->flags & INLINE_FLAG)
+    {
+        if (f->offset + count <= INLINE_DATA_SIZE)
+        {
+            return write_inline(f, src, count);
+        }
+        if (file_uninline(f) == -1)
+        {
+            return -1;
+        }
+    }
+
+    // Map everything up front so growth is allocated as one run, and cut
+    // the write short where the disk runs out of room
+    int first = f->offset / BLOCK_SIZE;
+    int last = (f->offset + count - 1) / BLOCK_SIZE;
+    journal_begin();
+    int mapped = file_map(f, first, last);
+    journal_end();
+    if (mapped < first)
+    {
+        return -1;
+    }
+    if (mapped < last)
+    {
+        count = (mapped + 1) * BLOCK_SIZE - f->offset;
+    }
+
+    while (written < count)
+    {
+        int index = f->offset / BLOCK_SIZE;
+        int in_block = f->offset % BLOCK_SIZE;
+        int chunk = count - written < BLOCK_SIZE - in_block ? count - written : BLOCK_SIZE - in_block;
+
+        if (in_block == 0 && chunk == BLOCK_SIZE)
+        {
+            // Whole blocks replace what is there, so nothing is read
+            int run = contiguous_blocks(f, index, (count - written) / BLOCK_SIZE);
+            if (f->buf_index >= index && f->buf_index < index + run)
+            {
+                f->buf_index = -1;
+                f->buf_dirty = 0;
+            }
+            if (bwrite_many(file_bmap(f, index), run, (unsigned char *)src + written) == -1)
+            {
+                break;
+            }
+            chunk = run * BLOCK_SIZE;
+        }
+        else
+        {
+            if (file_buffer(f, index) == -1)
+            {
+                break;
+            }
+            memcpy(f->buf + in_block, src + written, chunk);
+            f->buf_dirty = 1;
+        }
+
+        written += chunk;
+        f->offset += chunk;
+        if (f->offset > in->size)
+        {
+            in->size = f->offset;
+            idirty(in);
+        }
+    }
+    if (written == 0)
+    {
+        return -1;
+    }
+    in->data_version++;
+    return written;
+}
+
+// A file is read and written under its inode's lock, so the mapping and
+// size seen by one thread are never half updated by another. Separate
+// struct files on the same inode may be used from different threads; one
+// struct file may not.
+int file_write(struct file *f, const void *buf, int count)
+{
+    ilock(f->inode);
+    int result = write_locked(f, buf, count);
+    iunlock(f->inode);
+    return result;
+}
+
+static int read_locked(struct file *f, void *buf, int count)
+{
+    unsigned char *dest = buf;
+    struct inode *in = f->inode;
+    int done = 0;
+
+    if (count < 0)
+    {
+        return -1;
+    }
+    if (f->offset >= in->size)
+    {
+        return 0;
+    }
+    if ((unsigned int)count > in->size - f->offset)
+    {
+        count = in->size - f->offset;
+    }
+    if (in->flags & INLINE_FLAG)
+    {
+        memcpy(dest, in->inline_data + f->offset, count);
+        f->offset += count;
+        return count;
+    }
+
+    while (done < count)
+    {
+        int index = f->offset / BLOCK_SIZE;
+        int in_block = f->offset % BLOCK_SIZE;
+        int chunk = count - done < BLOCK_SIZE - in_block ? count - done : BLOCK_SIZE - in_block;
+        int block_num = file_bmap(f, index);
+
+        if (index == f->buf_index)
+        {
+            memcpy(dest + done, f->buf + in_block, chunk);
+        }
+        else if (block_num <= 0)
+        {
+            memset(dest + done, 0, chunk);
+        }
+        else if (in_block == 0 && (count - done) / BLOCK_SIZE >= RA_MAX_BLOCKS)
+        {
+            // Reads larger than the readahead window go straight into the
+            // caller's buffer
+            int run = contiguous_blocks(f, index, (count - done) / BLOCK_SIZE);
+            if (f->buf_index > index && f->buf_index < index + run)
+            {
+                run = f->buf_index - index;
+            }
+            if (bread_many(block_num, run, dest + done) == -1)
+            {
+                return done == 0 ? -1 : done;
+            }
+            chunk = run * BLOCK_SIZE;
+        }
+        else
+        {
+            unsigned char *block = readahead_block(&f->ra, in, &f->cursor, index);
+            if (block == NULL)
+            {
+                return done == 0 ? -1 : done;
+            }
+            memcpy(dest + done, block + in_block, chunk);
+        }
+
+        done += chunk;
+        f->offset += chunk;
+    }
+    return done;
+}
+
+int file_read(struct file *f, void *buf, int count)
+{
+    ilock(f->inode);
+    int result = read_locked(f, buf, count);
+    iunlock(f->inode);
+    return result;
+}
+
+long long file_seek(struct file *f, long long offset, int whence)
+{
+    long long base;
+
+    switch (whence)
+    {
+    case SEEK_SET:
+        base = 0;
+        break;
+    case SEEK_CUR:
+        base = f->offset;
+        break;
+    case SEEK_END:
+        ilock(f->inode);
+        base = f->inode->size;
+        iunlock(f->inode);
+        break;
+    default:
+        return -1;
+    }
+    if (base + offset < 0 || base + offset > FILE_MAX_SIZE)
+    {
+        return -1;
+    }
+    f->offset = base + offset;
+    return f->offset;
+}
+
+int file_close(struct file *f)
+{
+    ilock(f->inode);
+    int result = file_flush(f);
+    readahead_free(&f->ra);
+    bmap_release(&f->cursor);
+    iunlock(f->inode);
+    iput(f->inode);
+    free(f);
+    return result;
+}
@@ -0,0 +1,30 @@
+#ifndef FILE_H
+#define FILE_H
+
+#include "block.h"
+#include "inode.h"
+#include "readahead.h"
+
+// Sizes are 32 bits on disk
+#define FILE_MAX_SIZE 0xffffffffu
+
+struct file {
+    struct inode *inode;
+    unsigned int offset;
+    struct bmap_cursor cursor;
+    struct readahead ra;
+
+    // Partial-block writes collect here until another block is touched
+    int buf_index;          // logical block held in buf, -1 if none
+    int buf_dirty;
+    unsigned char buf[BLOCK_SIZE];
+};
+
+int file_create(void);
+struct file *file_open(int inode_num);
+int file_read(struct file *f, void *buf, int count);
+int file_write(struct file *f, const void *buf, int count);
+long long file_seek(struct file *f, long long offset, int whence);
+int file_close(struct file *f);
+
+#endif
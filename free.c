@@ -1,5 +1,10 @@
 #include "free.h"
 #include "block.h"
+#include <string.h>
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 void set_free(unsigned char *block, int num, int set)
 {
@@ -9,17 +14,349 @@ void set_free(unsigned char *block, int num, int set)
     block[byte_num] = set ? (block[byte_num] | (1 << bit_num)) : (block[byte_num] & ~(1 << bit_num));
 }
 
+// Bulk scanning kernels. Each returns the index of the first of nbytes
+// bytes that differs from skip (0xff when looking for a clear bit, 0x00
+// when looking for a set one), or -1.
+
+static unsigned long long load_word(const unsigned char *p)
+{
+    unsigned long long word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+static int scan_word(const unsigned char *p, int nbytes, unsigned char skip)
+{
+    unsigned long long pattern = skip * 0x0101010101010101ULL;
+    int i = 0;
+
+    for (; i + 8 <= nbytes; i += 8)
+    {
+        if (load_word(p + i) != pattern)
+        {
+            break;
+        }
+    }
+    for (; i < nbytes; i++)
+    {
+        if (p[i] != skip)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int count_set_word(const unsigned char *p, int nbytes)
+{
+    int count = 0;
+    int i = 0;
+
+    for (; i + 8 <= nbytes; i += 8)
+    {
+        count += __builtin_popcountll(load_word(p + i));
+    }
+    for (; i < nbytes; i++)
+    {
+        count += __builtin_popcount(p[i]);
+    }
+    return count;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("sse2")))
+static int scan_sse2(const unsigned char *p, int nbytes, unsigned char skip)
+{
+    __m128i pattern = _mm_set1_epi8((char)skip);
+    int i = 0;
+
+    for (; i + 16 <= nbytes; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, pattern));
+        if (mask != 0xffff)
+        {
+            return i + __builtin_ctz(~mask);
+        }
+    }
+    int rest = scan_word(p + i, nbytes - i, skip);
+    return rest == -1 ? -1 : i + rest;
+}
+
+__attribute__((target("avx2")))
+static int scan_avx2(const unsigned char *p, int nbytes, unsigned char skip)
+{
+    __m256i pattern = _mm256_set1_epi8((char)skip);
+    int i = 0;
+
+    for (; i + 64 <= nbytes; i += 64)
+    {
+        __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), pattern);
+        __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i + 32)), pattern);
+        if (!_mm256_testc_si256(_mm256_and_si256(a, b), _mm256_set1_epi8(-1)))
+        {
+            unsigned int mask = _mm256_movemask_epi8(a);
+            if (mask != 0xffffffffu)
+            {
+                return i + __builtin_ctz(~mask);
+            }
+            mask = _mm256_movemask_epi8(b);
+            return i + 32 + __builtin_ctz(~mask);
+        }
+    }
+    // Not scan_sse2: mixing legacy SSE code in with live AVX state stalls
+    int rest = scan_word(p + i, nbytes - i, skip);
+    return rest == -1 ? -1 : i + rest;
+}
+
+__attribute__((target("popcnt")))
+static int count_set_popcnt(const unsigned char *p, int nbytes)
+{
+    return count_set_word(p, nbytes);
+}
+
+#endif
+
+struct free_kernel {
+    const char *name;
+    int (*scan)(const unsigned char *p, int nbytes, unsigned char skip);
+    int (*count_set)(const unsigned char *p, int nbytes);
+    int (*supported)(void);
+};
+
+static int always(void)
+{
+    return 1;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static int has_sse2(void)
+{
+    return __builtin_cpu_supports("sse2") && __builtin_cpu_supports("popcnt");
+}
+
+static int has_avx2(void)
+{
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+}
+#endif
+
+// Fastest last; the first call picks the last one the CPU supports
+static const struct free_kernel kernels[] = {
+    { "word", scan_word, count_set_word, always },
+#if defined(__x86_64__) || defined(__i386__)
+    { "sse2", scan_sse2, count_set_popcnt, has_sse2 },
+    { "avx2", scan_avx2, count_set_popcnt, has_avx2 },
+#endif
+};
+
+static const struct free_kernel *kernel = NULL;
+
+static const struct free_kernel *free_kernel(void)
+{
+    if (kernel == NULL)
+    {
+        for (int i = sizeof(kernels) / sizeof(kernels[0]) - 1; i >= 0; i--)
+        {
+            if (kernels[i].supported())
+            {
+                kernel = &kernels[i];
+                break;
+            }
+        }
+    }
+    return kernel;
+}
+
+// Switches to the named kernel ("word", "sse2" or "avx2"), e.g. to
+// compare them. Returns -1 if it is unknown or the CPU lacks it.
+int free_use_kernel(const char *name)
+{
+    for (unsigned int i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+    {
+        if (strcmp(kernels[i].name, name) == 0 && kernels[i].supported())
+        {
+            kernel = &kernels[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char *free_kernel_name(void)
+{
+    return free_kernel()->name;
+}
+
+static int bit_is_set(const unsigned char *block, int bit)
+{
+    return (block[bit / 8] >> (bit % 8)) & 1;
+}
+
+// Returns the first bit in [start, end) equal to want, or -1. Whole bytes
+// in the middle go through the bulk kernel.
+static int find_bit(const unsigned char *block, int start, int end, int want)
+{
+    int bit = start;
+
+    for (; bit < end && bit % 8 != 0; bit++)
+    {
+        if (bit_is_set(block, bit) == want)
+        {
+            return bit;
+        }
+    }
+
+    int nbytes = (end - bit) / 8;
+    if (nbytes > 0)
+    {
+        int i = free_kernel()->scan(block + bit / 8, nbytes, want ? 0x00 : 0xff);
+        if (i != -1)
+        {
+            int byte = block[bit / 8 + i];
+            return bit + i * 8 + __builtin_ctz(want ? byte : (~byte & 0xff));
+        }
+        bit += nbytes * 8;
+    }
+
+    for (; bit < end; bit++)
+    {
+        if (bit_is_set(block, bit) == want)
+        {
+            return bit;
+        }
+    }
+    return -1;
+}
 
 int find_free(unsigned char *block)
 {
-    for(int i=0; i < BLOCK_SIZE; i++)
+    return find_bit(block, 0, BLOCK_SIZE * 8, 0);
+}
+
+// Returns the first clear bit in [start, end), or -1
+int find_free_from(unsigned char *block, int start, int end)
+{
+    return find_bit(block, start, end, 0);
+}
+
+// Returns the first set bit in [start, end), or -1
+int find_used_from(unsigned char *block, int start, int end)
+{
+    return find_bit(block, start, end, 1);
+}
+
+// Sets (or clears) count bits starting at start
+void set_free_range(unsigned char *block, int start, int count, int set)
+{
+    int bit = start;
+    int end = start + count;
+
+    for (; bit < end && bit % 8 != 0; bit++)
+    {
+        set_free(block, bit, set);
+    }
+    if (end - bit >= 8)
+    {
+        memset(block + bit / 8, set ? 0xff : 0x00, (end - bit) / 8);
+        bit += (end - bit) / 8 * 8;
+    }
+    for (; bit < end; bit++)
+    {
+        set_free(block, bit, set);
+    }
+}
+
+// Returns the first bit of a run of len clear bits inside [start, end),
+// or -1 if there is none.
+int find_free_run(unsigned char *block, int start, int end, int len)
+{
+    int bit = start;
+
+    while (bit < end)
     {
-        if(block[i] != 0xff)
+        int run_start = find_bit(block, bit, end, 0);
+        if (run_start == -1 || end - run_start < len)
         {
-            int bit_num = __builtin_ctz(~block[i]);
-            return (i * 8) + bit_num;
+            return -1;
         }
+        int run_end = find_bit(block, run_start, run_start + len, 1);
+        if (run_end == -1)
+        {
+            return run_start;
+        }
+        bit = run_end + 1;
     }
     return -1;
 }
 
+// Atomic updates for bitmaps shared between threads, one compare and swap
+// on an aligned 64-bit word at a time. Masks are built with bit i of the
+// word being bitmap bit i, then swapped to how the word sits in memory.
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define BITMAP_WORD(x) __builtin_bswap64(x)
+#else
+#define BITMAP_WORD(x) (x)
+#endif
+
+static uint64_t range_mask(int lo, int n)
+{
+    return (n == 64 ? ~0ULL : ((1ULL << n) - 1)) << lo;
+}
+
+// Sets clear bits from start on, up to count of them, stopping at the
+// first bit that is already set. Returns how many it set: 0 means start
+// itself was taken, e.g. by another thread.
+int claim_bits(unsigned char *block, int start, int count)
+{
+    int done = 0;
+
+    while (done < count)
+    {
+        int bit = start + done;
+        int lo = bit % 64;
+        int n = 64 - lo < count - done ? 64 - lo : count - done;
+        uint64_t *word = (uint64_t *)(block + bit / 64 * 8);
+        uint64_t want = range_mask(lo, n);
+        uint64_t old = __atomic_load_n(word, __ATOMIC_RELAXED);
+        uint64_t take;
+        do
+        {
+            // Only the bits before the first one someone else holds
+            uint64_t taken = BITMAP_WORD(old) & want;
+            take = taken == 0 ? want : want & ((1ULL << __builtin_ctzll(taken)) - 1);
+            if (take == 0)
+            {
+                return done;
+            }
+        } while (!__atomic_compare_exchange_n(word, &old, old | BITMAP_WORD(take), 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+        done += __builtin_popcountll(take);
+        if (take != want)
+        {
+            return done;
+        }
+    }
+    return done;
+}
+
+// Clears one bit, returning whether it was set
+int release_bit(unsigned char *block, int bit)
+{
+    uint64_t *word = (uint64_t *)(block + bit / 64 * 8);
+    uint64_t mask = BITMAP_WORD(range_mask(bit % 64, 1));
+    return (__atomic_fetch_and(word, ~mask, __ATOMIC_ACQ_REL) & mask) != 0;
+}
+
+// Counts the clear bits among the first nbits
+int count_free(unsigned char *block, int nbits)
+{
+    int used = free_kernel()->count_set(block, nbits / 8);
+
+    for (int bit = nbits / 8 * 8; bit < nbits; bit++)
+    {
+        used += bit_is_set(block, bit);
+    }
+    return nbits - used;
+}
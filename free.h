@@ -3,5 +3,14 @@
 
 void set_free(unsigned char *block, int num, int set);
 int find_free(unsigned char *block);
+int find_free_from(unsigned char *block, int start, int end);
+int find_used_from(unsigned char *block, int start, int end);
+void set_free_range(unsigned char *block, int start, int count, int set);
+int find_free_run(unsigned char *block, int start, int end, int len);
+int count_free(unsigned char *block, int nbits);
+int claim_bits(unsigned char *block, int start, int count);
+int release_bit(unsigned char *block, int bit);
+int free_use_kernel(const char *name);
+const char *free_kernel_name(void);
 
 #endif
@@ -0,0 +1,682 @@
+#define _GNU_SOURCE
+#include "fsck.h"
+#include "block.h"
+#include "bitmap.h"
+#include "checksum.h"
+#include "disk.h"
+#include "inode.h"
+#include "mkfs.h"
+#include "namei.h"
+#include "pack.h"
+#include "super.h"
+#include "simfs.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Inode table blocks a worker takes, and reads, at a time
+#define FSCK_TABLE_RUN 16
+
+// A slot in a directory block, or with block_num 0 the byte offset of an
+// entry in inline directory dir_num
+struct dangling_entry {
+    int block_num;
+    int slot;
+    int dir_num;
+};
+
+// What the workers share. The maps are copies read from the image; refs
+// and links are changed with atomic operations, the rest under lock.
+struct scan {
+    struct simfs *fs;
+    unsigned char *inode_map;
+    unsigned char *block_map;
+    uint64_t *refs;              // one bit per block mapped by some inode
+    unsigned int *links;         // entries naming each inode
+    unsigned char *link_counts;  // each allocated inode's link_count
+    int next_table_block;
+    pthread_mutex_t lock;
+    struct fsck_report report;
+    struct dangling_entry *dangling;
+    int dangling_count;
+    int dangling_capacity;
+};
+
+struct worker {
+    struct scan *scan;
+    int release;                // take blocks and entries back out of the scan
+    struct fsck_report report;  // merged into the scan's when done
+    pthread_t thread;
+    unsigned char table[FSCK_TABLE_RUN * BLOCK_SIZE];
+    unsigned char top[BLOCK_SIZE];   // double indirect or leaf block
+    unsigned char ptrs[BLOCK_SIZE];  // indirect block
+    unsigned char data[BLOCK_SIZE];  // directory block
+};
+
+// Bitmaps keep bit n in bit n % 8 of byte n / 8, so eight bytes loaded
+// little-endian hold bits [64 * word, 64 * word + 64) in order
+static uint64_t load_le64(const unsigned char *p)
+{
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+static void store_le64(unsigned char *p, uint64_t word)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    memcpy(p, &word, sizeof(word));
+}
+
+static int map_bit(const unsigned char *map, int bit)
+{
+    return (map[bit / 8] >> (bit % 8)) & 1;
+}
+
+static int read_blocks(int block_num, int count, unsigned char *blocks)
+{
+    struct iovec iov[DISK_MAX_IOV];
+
+    for (int i = 0; i < count; i += DISK_MAX_IOV)
+    {
+        int run = count - i < DISK_MAX_IOV ? count - i : DISK_MAX_IOV;
+        for (int k = 0; k < run; k++)
+        {
+            iov[k].iov_base = blocks + (size_t)(i + k) * BLOCK_SIZE;
+            iov[k].iov_len = BLOCK_SIZE;
+        }
+        if (disk_readv(block_num + i, iov, run) == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int read_block(struct worker *w, int block_num, unsigned char *block)
+{
+    if (disk_read(block_num, block) == -1)
+    {
+        w->report.unreadable++;
+        return -1;
+    }
+    return 0;
+}
+
+// Records that an inode uses block_num, or when releasing that it no
+// longer does. Returns -1 if it is not a data block, which is then not to
+// be read either.
+static int mark(struct worker *w, unsigned int block_num)
+{
+    if (block_num < sb.data_start || block_num >= sb.block_count)
+    {
+        w->report.bad_pointers++;
+        return -1;
+    }
+    uint64_t bit = 1ULL << (block_num % 64);
+    if (w->release)
+    {
+        __atomic_and_fetch(&w->scan->refs[block_num / 64], ~bit, __ATOMIC_RELAXED);
+        w->scan->block_map[block_num / 8] &= ~(1 << (block_num % 8));
+        return 0;
+    }
+    if (__atomic_fetch_or(&w->scan->refs[block_num / 64], bit, __ATOMIC_RELAXED) & bit)
+    {
+        w->report.shared_blocks++;
+    }
+    return 0;
+}
+
+static void add_dangling(struct scan *scan, int block_num, int slot, int dir_num)
+{
+    pthread_mutex_lock(&scan->lock);
+    if (scan->dangling_count == scan->dangling_capacity)
+    {
+        int capacity = scan->dangling_capacity ? scan->dangling_capacity * 2 : 64;
+        struct dangling_entry *grown = realloc(scan->dangling, capacity * sizeof(*grown));
+        if (grown == NULL)
+        {
+            pthread_mutex_unlock(&scan->lock);
+            return;
+        }
+        scan->dangling = grown;
+        scan->dangling_capacity = capacity;
+    }
+    scan->dangling[scan->dangling_count].block_num = block_num;
+    scan->dangling[scan->dangling_count].slot = slot;
+    scan->dangling[scan->dangling_count].dir_num = dir_num;
+    scan->dangling_count++;
+    pthread_mutex_unlock(&scan->lock);
+}
+
+// Checks one entry of a directory, found at slot of block_num
+static void check_entry(struct worker *w, struct inode *in, struct directory_entry *ent, int block_num, int slot)
+{
+    if (ent->inode_num >= sb.inode_count || !map_bit(w->scan->inode_map, ent->inode_num))
+    {
+        if (w->release)
+        {
+            return;
+        }
+        w->report.dangling++;
+        add_dangling(w->scan, block_num, slot, in->inode_num);
+    }
+    else if (strcmp(ent->name, ".") != 0 && strcmp(ent->name, "..") != 0)
+    {
+        __atomic_add_fetch(&w->scan->links[ent->inode_num], w->release ? -1 : 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Counts the entries of a directory's logical block index, held in
+// block_num, in the inodes they name
+static void scan_dir_block(struct worker *w, struct inode *in, unsigned int index, int block_num)
+{
+    if ((unsigned long long)index * BLOCK_SIZE >= in->size || read_block(w, block_num, w->data) == -1)
+    {
+        return;
+    }
+    unsigned int left = (in->size - index * BLOCK_SIZE) / DIR_ENTRY_SIZE;
+    int entries = left < DIR_ENTRIES_PER_BLOCK ? (int)left : DIR_ENTRIES_PER_BLOCK;
+    for (int i = 0; i < entries; i++)
+    {
+        struct directory_entry ent;
+        dirent_decode(w->data + i * DIR_ENTRY_SIZE, &ent);
+        if (ent.name[0] == '\0')
+        {
+            continue;
+        }
+        check_entry(w, in, &ent, block_num, i);
+    }
+}
+
+// Checks the packed entries of an inline directory, which has no blocks
+static void scan_inline_dir(struct worker *w, struct inode *in)
+{
+    struct directory_entry ent;
+
+    for (unsigned int offset = DIR_INLINE_START_SIZE; offset < in->size;)
+    {
+        unsigned int next = dirent_inline_decode(in, offset, &ent);
+        if (ent.name[0] != '\0')
+        {
+            check_entry(w, in, &ent, 0, offset);
+        }
+        offset = next;
+    }
+}
+
+static void use_block(struct worker *w, struct inode *in, unsigned int index, unsigned int block_num)
+{
+    if (mark(w, block_num) == 0 && (in->flags & DIR_FLAG))
+    {
+        scan_dir_block(w, in, index, block_num);
+    }
+}
+
+// Marks the blocks mapped by the pointers in ptrs, the first of which
+// maps logical block first
+static void use_ptr_block(struct worker *w, struct inode *in, unsigned char *ptrs, unsigned int first)
+{
+    for (int i = 0; i < PTRS_PER_BLOCK; i++)
+    {
+        unsigned int block_num = read_u32(ptrs + i * 4);
+        if (block_num != 0)
+        {
+            use_block(w, in, first + i, block_num);
+        }
+    }
+}
+
+static void use_extent(struct worker *w, struct inode *in, unsigned int logical, unsigned int physical, unsigned int length)
+{
+    for (unsigned int k = 0; k < length; k++)
+    {
+        use_block(w, in, logical + k, physical + k);
+    }
+}
+
+// Marks every block in uses: its data blocks and the pointer or leaf
+// blocks mapping them. Inline inodes have none.
+static void use_blocks(struct worker *w, struct inode *in)
+{
+    if (in->flags & INLINE_FLAG)
+    {
+        if (in->flags & DIR_FLAG)
+        {
+            scan_inline_dir(w, in);
+        }
+        return;
+    }
+    if (in->flags & EXTENTS_FLAG)
+    {
+        int count = in->extent_count < INODE_EXTENTS ? in->extent_count : INODE_EXTENTS;
+        for (int i = 0; i < count; i++)
+        {
+            struct extent *e = &in->extents[i];
+            if (in->extent_depth == 0)
+            {
+                use_extent(w, in, e->logical, e->physical, e->length);
+                continue;
+            }
+            if (mark(w, e->physical) == -1 || read_block(w, e->physical, w->top) == -1)
+            {
+                continue;
+            }
+            unsigned int records = read_u32(w->top + LEAF_COUNT_OFFSET);
+            for (unsigned int r = 0; r < records && r < EXTENTS_PER_BLOCK; r++)
+            {
+                unsigned char *rec = w->top + LEAF_EXTENT_OFFSET + r * BYTES_PER_LEAF_EXTENT;
+                use_extent(w, in, read_u32(rec), read_u32(rec + 4), read_u32(rec + 8));
+            }
+        }
+        return;
+    }
+
+    for (int i = 0; i < INODE_PTR_COUNT; i++)
+    {
+        if (in->block_ptr[i] != 0)
+        {
+            use_block(w, in, i, in->block_ptr[i]);
+        }
+    }
+    if (in->indirect != 0 && mark(w, in->indirect) == 0 && read_block(w, in->indirect, w->ptrs) == 0)
+    {
+        use_ptr_block(w, in, w->ptrs, INODE_PTR_COUNT);
+    }
+    if (in->double_indirect != 0 && mark(w, in->double_indirect) == 0 && read_block(w, in->double_indirect, w->top) == 0)
+    {
+        for (int slot = 0; slot < PTRS_PER_BLOCK; slot++)
+        {
+            unsigned int ptr_block = read_u32(w->top + slot * 4);
+            if (ptr_block != 0 && mark(w, ptr_block) == 0 && read_block(w, ptr_block, w->ptrs) == 0)
+            {
+                use_ptr_block(w, in, w->ptrs, INODE_PTR_COUNT + PTRS_PER_BLOCK + slot * PTRS_PER_BLOCK);
+            }
+        }
+    }
+}
+
+// Checks the inodes in inode table block t, held in table
+static void scan_table_block(struct worker *w, int t, unsigned char *table)
+{
+    struct inode in;
+
+    for (int i = 0; i < INODES_PER_BLOCK; i++)
+    {
+        int inode_num = t * INODES_PER_BLOCK + i;
+        if (inode_num >= (int)sb.inode_count)
+        {
+            break;
+        }
+        if (!map_bit(w->scan->inode_map, inode_num))
+        {
+            continue;
+        }
+        inode_decode(table + i * INODE_SIZE, &in);
+        in.inode_num = inode_num;
+        w->report.inodes++;
+        w->report.directories += (in.flags & DIR_FLAG) != 0;
+        w->scan->link_counts[inode_num] = in.link_count;
+        use_blocks(w, &in);
+    }
+}
+
+// Takes runs of inode table blocks until there are none left
+static void *worker_run(void *arg)
+{
+    struct worker *w = arg;
+    struct scan *scan = w->scan;
+    int table_blocks = sb.inode_table_blocks;
+
+    simfs_use(scan->fs);
+    int first;
+    while ((first = __atomic_fetch_add(&scan->next_table_block, FSCK_TABLE_RUN, __ATOMIC_RELAXED)) < table_blocks)
+    {
+        int run = table_blocks - first < FSCK_TABLE_RUN ? table_blocks - first : FSCK_TABLE_RUN;
+        if (read_blocks(sb.inode_table_start + first, run, w->table) == 0)
+        {
+            for (int t = 0; t < run; t++)
+            {
+                scan_table_block(w, first + t, w->table + t * BLOCK_SIZE);
+            }
+            continue;
+        }
+        // Find which blocks could not be read
+        for (int t = 0; t < run; t++)
+        {
+            if (read_block(w, sb.inode_table_start + first + t, w->table) == 0)
+            {
+                scan_table_block(w, first + t, w->table);
+            }
+        }
+    }
+
+    pthread_mutex_lock(&scan->lock);
+    unsigned long *from = (unsigned long *)&w->report;
+    unsigned long *to = (unsigned long *)&scan->report;
+    for (size_t i = 0; i < sizeof(struct fsck_report) / sizeof(unsigned long); i++)
+    {
+        to[i] += from[i];
+    }
+    pthread_mutex_unlock(&scan->lock);
+    return NULL;
+}
+
+// The entries naming inode_num as its link_count holds them
+static unsigned char links_stored(struct scan *scan, int inode_num)
+{
+    return scan->links[inode_num] < 0xff ? scan->links[inode_num] : 0xff;
+}
+
+// Compares the references with the block map, fixing the copy in
+// scan->block_map if repairing. Returns 1 if the copy changed.
+static int check_block_map(struct scan *scan, int repair)
+{
+    int words = (sb.block_count + 63) / 64;
+    int changed = 0;
+
+    for (int w = 0; w < words; w++)
+    {
+        uint64_t valid = ~0ULL;
+        if (w == words - 1 && sb.block_count % 64 != 0)
+        {
+            valid = (1ULL << (sb.block_count % 64)) - 1;
+        }
+        uint64_t reserved = 0;
+        if (w * 64ULL < sb.data_start)
+        {
+            reserved = sb.data_start - w * 64ULL >= 64 ? ~0ULL : (1ULL << (sb.data_start - w * 64)) - 1;
+        }
+
+        uint64_t want = (scan->refs[w] | reserved) & valid;
+        uint64_t have = load_le64(scan->block_map + w * 8);
+        uint64_t wrong = (want ^ have) & valid;
+        scan->report.blocks += __builtin_popcountll(want);
+        scan->report.missing_blocks += __builtin_popcountll(wrong & want);
+        scan->report.leaked_blocks += __builtin_popcountll(wrong & have);
+        if (wrong != 0 && repair)
+        {
+            store_le64(scan->block_map + w * 8, (have & ~valid) | want);
+            scan->report.repaired += __builtin_popcountll(wrong);
+            changed = 1;
+        }
+    }
+    return changed;
+}
+
+// Writes back the blocks of the map at start that differ from copy
+static void write_map(int start, int blocks, const unsigned char *copy)
+{
+    for (int m = 0; m < blocks; m++)
+    {
+        int block_num = start + m;
+        unsigned char *block = bget(block_num);
+        if (block == NULL)
+        {
+            continue;
+        }
+        if (memcmp(block, copy + (size_t)m * BLOCK_SIZE, BLOCK_SIZE) != 0)
+        {
+            memcpy(block, copy + (size_t)m * BLOCK_SIZE, BLOCK_SIZE);
+            bdirty(block_num);
+        }
+        brelse(block_num);
+    }
+    // The allocator's free counts were taken from the old map
+    bitmap_reset();
+}
+
+static int is_orphan(struct scan *scan, int inode_num)
+{
+    return map_bit(scan->inode_map, inode_num) && scan->links[inode_num] == 0 && inode_num != ROOT_INODE_NUM;
+}
+
+// Counts the allocated inodes no entry names and, if repairing, frees
+// them: their blocks leave the references and scan->block_map, their
+// entries stop counting and their bits are cleared in scan->inode_map.
+// What only a freed directory named is an orphan in turn. Returns 1 if
+// the copies changed.
+static int check_orphans(struct scan *scan, struct worker *w, int repair)
+{
+    unsigned char table[BLOCK_SIZE];
+    struct inode in;
+    int changed = 0;
+
+    for (int inode_num = 0; inode_num < (int)sb.inode_count; inode_num++)
+    {
+        scan->report.orphans += is_orphan(scan, inode_num);
+    }
+    if (!repair)
+    {
+        return 0;
+    }
+
+    w->release = 1;
+    for (int freed = 1; freed;)
+    {
+        freed = 0;
+        for (int inode_num = 0; inode_num < (int)sb.inode_count; inode_num++)
+        {
+            if (!is_orphan(scan, inode_num) ||
+                disk_read(sb.inode_table_start + inode_num / INODES_PER_BLOCK, table) == -1)
+            {
+                continue;
+            }
+            inode_decode(table + (inode_num % INODES_PER_BLOCK) * INODE_SIZE, &in);
+            in.inode_num = inode_num;
+            use_blocks(w, &in);
+            scan->inode_map[inode_num / 8] &= ~(1 << (inode_num % 8));
+            scan->report.repaired++;
+            freed = changed = 1;
+        }
+    }
+    return changed;
+}
+
+static void check_links(struct scan *scan, int repair)
+{
+    for (int inode_num = 0; inode_num < (int)sb.inode_count; inode_num++)
+    {
+        if (!map_bit(scan->inode_map, inode_num))
+        {
+            continue;
+        }
+        if (scan->link_counts[inode_num] == links_stored(scan, inode_num))
+        {
+            continue;
+        }
+        scan->report.bad_links++;
+        struct inode *in = repair ? iget(inode_num) : NULL;
+        if (in != NULL)
+        {
+            ilock(in);
+            in->link_count = links_stored(scan, inode_num);
+            idirty(in);
+            iunlock(in);
+            iput(in);
+            scan->report.repaired++;
+        }
+    }
+}
+
+// Removes the packed entry at offset from an inline directory
+static int remove_inline_entry(int dir_num, unsigned int offset)
+{
+    struct inode *in = iget(dir_num);
+    if (in == NULL)
+    {
+        return -1;
+    }
+    ilock(in);
+    unsigned int len = DIR_INLINE_HEADER + in->inline_data[offset + 2];
+    memmove(in->inline_data + offset, in->inline_data + offset + len, in->size - offset - len);
+    in->size -= len;
+    memset(in->inline_data + in->size, 0, INLINE_DATA_SIZE - in->size);
+    idirty(in);
+    iunlock(in);
+    iput(in);
+    return 0;
+}
+
+// Backwards, so removing an inline entry never moves one still to come
+static void clear_dangling(struct scan *scan)
+{
+    for (int i = scan->dangling_count - 1; i >= 0; i--)
+    {
+        int block_num = scan->dangling[i].block_num;
+        if (!map_bit(scan->inode_map, scan->dangling[i].dir_num))
+        {
+            continue;  // its directory was freed as an orphan
+        }
+        if (block_num == 0)
+        {
+            if (remove_inline_entry(scan->dangling[i].dir_num, scan->dangling[i].slot) == 0)
+            {
+                scan->report.repaired++;
+            }
+            continue;
+        }
+        unsigned char *block = bget(block_num);
+        if (block == NULL)
+        {
+            continue;
+        }
+        memset(block + scan->dangling[i].slot * DIR_ENTRY_SIZE, 0, DIR_ENTRY_SIZE);
+        bdirty(block_num);
+        brelse(block_num);
+        scan->report.repaired++;
+    }
+
+    // A hashed lookup stops at the first bucket with an empty slot, so
+    // entries that had overflowed past one just emptied are placed again
+    for (int i = 0; i < scan->dangling_count; i++)
+    {
+        int seen = scan->dangling[i].block_num == 0 || !map_bit(scan->inode_map, scan->dangling[i].dir_num);
+        for (int j = 0; j < i && !seen; j++)
+        {
+            seen = scan->dangling[j].dir_num == scan->dangling[i].dir_num;
+        }
+        if (!seen)
+        {
+            directory_rehash(scan->dangling[i].dir_num);
+        }
+    }
+    dcache_clear();
+}
+
+static void scan_free(struct scan *scan)
+{
+    free(scan->inode_map);
+    free(scan->block_map);
+    free(scan->refs);
+    free(scan->links);
+    free(scan->link_counts);
+    free(scan->dangling);
+    pthread_mutex_destroy(&scan->lock);
+}
+
+// Checks the current filesystem with threads workers, or one per CPU if
+// threads is 0, filling in report. Nothing else may use the filesystem
+// meanwhile. Returns the number of problems found, repaired or not, or -1
+// if the check could not be made.
+int fsck(int threads, int repair, struct fsck_report *report)
+{
+    struct scan scan = { 0 };
+    struct worker *workers = NULL;
+    int result = -1;
+
+    // The workers read the image, so everything cached has to be there
+    if (inode_sync() == -1 || bsync() == -1)
+    {
+        return -1;
+    }
+    // A crash can leave blocks without their checksums (see checksum.h).
+    // Repair takes the blocks as they are and checks what they hold.
+    int rebuilt = repair ? checksum_rebuild() : 0;
+    if (rebuilt == -1)
+    {
+        return -1;
+    }
+    if (threads <= 0)
+    {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    threads = threads < 1 ? 1 : threads > FSCK_MAX_THREADS ? FSCK_MAX_THREADS : threads;
+
+    scan.fs = simfs_current;
+    pthread_mutex_init(&scan.lock, NULL);
+    scan.inode_map = malloc((size_t)sb.inode_map_blocks * BLOCK_SIZE);
+    scan.block_map = malloc((size_t)sb.block_map_blocks * BLOCK_SIZE);
+    scan.refs = calloc((sb.block_count + 63) / 64, sizeof(uint64_t));
+    scan.links = calloc(sb.inode_count, sizeof(unsigned int));
+    scan.link_counts = calloc(sb.inode_count, 1);
+    workers = calloc(threads, sizeof(struct worker));
+    if (scan.inode_map == NULL || scan.block_map == NULL || scan.refs == NULL || scan.links == NULL ||
+        scan.link_counts == NULL || workers == NULL ||
+        read_blocks(sb.inode_map_start, sb.inode_map_blocks, scan.inode_map) == -1 ||
+        read_blocks(sb.block_map_start, sb.block_map_blocks, scan.block_map) == -1)
+    {
+        goto done;
+    }
+
+    int started = 0;
+    for (; started < threads; started++)
+    {
+        workers[started].scan = &scan;
+        if (pthread_create(&workers[started].thread, NULL, worker_run, &workers[started]) != 0)
+        {
+            break;
+        }
+    }
+    // Whatever could not be started is made up for by the caller
+    if (started < threads)
+    {
+        workers[started].scan = &scan;
+        worker_run(&workers[started]);
+    }
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    // The references only say which blocks and inodes are in use if every
+    // mapping could be followed; otherwise blocks still mapped through an
+    // unreadable or damaged pointer block would be freed
+    int trusted = scan.report.unreadable == 0 && scan.report.bad_pointers == 0 && scan.report.shared_blocks == 0;
+    int freed = check_orphans(&scan, &workers[0], repair && trusted);
+    if (freed)
+    {
+        write_map(sb.inode_map_start, sb.inode_map_blocks, scan.inode_map);
+    }
+    if ((check_block_map(&scan, repair && trusted) || freed) && repair)
+    {
+        write_map(sb.block_map_start, sb.block_map_blocks, scan.block_map);
+    }
+    check_links(&scan, repair && trusted);
+    if (repair)
+    {
+        clear_dangling(&scan);
+        if (inode_sync() == -1 || bsync() == -1)
+        {
+            goto done;
+        }
+    }
+
+    scan.report.bad_checksums = rebuilt;
+    scan.report.repaired += rebuilt;
+    *report = scan.report;
+    result = report->leaked_blocks + report->missing_blocks + report->shared_blocks + report->bad_pointers +
+             report->bad_links + report->dangling + report->orphans + report->unreadable + report->bad_checksums;
+
+done:
+    free(workers);
+    scan_free(&scan);
+    return result;
+}
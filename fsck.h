@@ -0,0 +1,37 @@
+#ifndef FSCK_H
+#define FSCK_H
+
+// Checks the current filesystem's image. A pool of worker threads takes
+// inode table blocks in turn; for each allocated inode they set a bit in a
+// shared reference bitmap for every block it maps or uses for mapping,
+// and for each directory they count the entries naming every inode. Then
+// the reference bitmap is compared with the free block map, the counts
+// with the inodes' link_count, and every entry is checked to name an
+// allocated inode. With repair set orphaned inodes are freed with their
+// blocks, and the block map, the link counts and the entries are fixed,
+// after the checksums, if any, are rebuilt from the blocks as they are;
+// blocks mapped twice and pointers out of range are only reported, and
+// while there are any, or blocks that cannot be read, orphans, the block
+// map and link counts are left alone.
+
+#define FSCK_MAX_THREADS 64
+
+struct fsck_report {
+    unsigned long inodes;         // allocated inodes checked
+    unsigned long directories;
+    unsigned long blocks;         // blocks in use, counting the reserved ones
+    unsigned long orphans;        // allocated inodes no entry names
+    unsigned long leaked_blocks;  // marked used but mapped by nothing
+    unsigned long missing_blocks; // mapped but marked free
+    unsigned long shared_blocks;  // mapped more than once
+    unsigned long bad_pointers;   // outside the data blocks
+    unsigned long bad_links;      // link_count not the number of entries
+    unsigned long dangling;       // entries naming a free inode
+    unsigned long unreadable;     // blocks that could not be read or failed their checksum
+    unsigned long bad_checksums;  // with repair, checksums rebuilt to match their blocks
+    unsigned long repaired;
+};
+
+int fsck(int threads, int repair, struct fsck_report *report);
+
+#endif
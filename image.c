@@ -1,19 +1,214 @@
+#define _GNU_SOURCE
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "image.h"
+#include "block.h"
+#include "bcache.h"
+#include "mkfs.h"
+#include "super.h"
+#include "inode.h"
+#include "bitmap.h"
+#include "namei.h"
+#include "journal.h"
+#include "async.h"
+#include "writeback.h"
+#include "checksum.h"
+#include "simfs.h"
 
-int image_fd;
+int image_default_flags = 0;
 
-int image_open(char *filename, int truncate)
+// This thread's filesystem's image
+#define image (simfs_current->file)
+
+// Maps the whole file, growing it first to at least min_blocks blocks
+static int image_map_file(int min_blocks)
 {
-    int flags = O_RDWR | O_CREAT | (truncate? O_TRUNC:0);
-    
-    int image_fd = open(filename, flags, 0600);
+    struct stat st;
+    off_t size = (off_t)min_blocks * BLOCK_SIZE;
+
+    if (fstat(image_fd, &st) == -1)
+    {
+        return -1;
+    }
+    if (st.st_size > size)
+    {
+        size = (st.st_size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    }
+    // Grow the file so every mapped page is backed; the new tail is sparse
+    if (st.st_size < size && ftruncate(image_fd, size) == -1)
+    {
+        return -1;
+    }
+
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, image_fd, 0);
+    if (map == MAP_FAILED)
+    {
+        return -1;
+    }
+    image_map = map;
+    image_map_blocks = size / BLOCK_SIZE;
+    image.dirty_lo = image.dirty_hi = -1;
+    return 0;
+}
+
+static void image_unmap(void)
+{
+    if (image_map != NULL)
+    {
+        munmap(image_map, (size_t)image_map_blocks * BLOCK_SIZE);
+        image_map = NULL;
+        image_map_blocks = 0;
+    }
+}
+
+int image_open(char *filename, int flags)
+{
+    flags |= image_default_flags;
+    int open_flags = O_RDWR | ((flags & IMAGE_EXISTING)? 0:O_CREAT) | ((flags & IMAGE_TRUNCATE)? O_TRUNC:0);
+
+    // Cached blocks and requests in flight belong to whatever image was
+    // open before
+    writeback_stop();
+    async_shutdown();
+    if (image_fd >= 0)
+    {
+        inode_sync();
+        bsync();
+    }
+    image_unmap();
+    bcache_invalidate();
+    journal_unload();
+    checksum_unload();
+    incore_drop_cached();
+    dcache_clear();
+    if (image_fd >= 0)
+    {
+        close(image_fd);
+        image_fd = -1;
+    }
+
+    image.flags = flags;
+    image_fd = open(filename, open_flags, 0600);
+    if (image_fd == -1)
+    {
+        return -1;
+    }
+
+    if (((flags & IMAGE_MMAP) && image_map_file(NUMBER_OF_BLOCKS) == -1) || super_read() == -1)
+    {
+        image_unmap();
+        close(image_fd);
+        image_fd = -1;
+        return -1;
+    }
+    // Checksums are kept by the disk layer, which mapped pages bypass
+    if (sb.features & FEATURE_CHECKSUMS)
+    {
+        image_unmap();
+    }
+    if (checksum_load() == -1 || journal_load() == -1)
+    {
+        image_unmap();
+        close(image_fd);
+        image_fd = -1;
+        return -1;
+    }
+
+    bitmap_reset();
+
+    // The superblock may describe more blocks than the file holds yet
+    if (image_map != NULL && (int)sb.block_count > image_map_blocks)
+    {
+        image_unmap();
+        if (image_map_file(sb.block_count) == -1)
+        {
+            close(image_fd);
+            image_fd = -1;
+            return -1;
+        }
+    }
     return image_fd;
 }
 
 
 int image_close(void)
 {
-    return close(image_fd); 
+    writeback_stop();
+    async_shutdown();
+    inode_sync();
+    bsync();
+    image_unmap();
+    bcache_invalidate();
+    journal_unload();
+    checksum_unload();
+    incore_drop_cached();
+    dcache_clear();
+    // Nothing may use the descriptor once it is closed
+    int fd = image_fd;
+    image_fd = -1;
+    return close(fd);
+}
+
+// Throws away the image's contents and resizes it to block_count blocks
+// of zeros. The file is truncated rather than written, so blocks stay
+// sparse until something is stored in them; with IMAGE_PREALLOCATE the
+// space is reserved up front with fallocate where the file system can.
+// A mapped image stays mapped unless sb, about to be formatted, has
+// FEATURE_CHECKSUMS.
+int image_zero(int block_count)
+{
+    off_t size = (off_t)block_count * BLOCK_SIZE;
+    int mapped = image_map != NULL && !(sb.features & FEATURE_CHECKSUMS);
+
+    writeback_stop();
+    async_shutdown();
+    bcache_invalidate();
+    incore_drop_cached();
+    image_unmap();
+
+    if (ftruncate(image_fd, 0) == -1 || ftruncate(image_fd, size) == -1)
+    {
+        return -1;
+    }
+    if (image.flags & IMAGE_PREALLOCATE)
+    {
+        fallocate(image_fd, 0, 0, size);
+    }
+    if (mapped)
+    {
+        return image_map_file(block_count);
+    }
+    return 0;
+}
+
+void image_mark_dirty(int block_num)
+{
+    if (image.dirty_lo == -1 || block_num < image.dirty_lo)
+    {
+        image.dirty_lo = block_num;
+    }
+    if (block_num > image.dirty_hi)
+    {
+        image.dirty_hi = block_num;
+    }
+}
+
+// Flushes the blocks written through the mapping since the last call.
+// Returns how many blocks the synced range covered or -1 on error.
+int image_msync(void)
+{
+    if (image_map == NULL || image.dirty_lo == -1)
+    {
+        return 0;
+    }
+
+    int count = image.dirty_hi - image.dirty_lo + 1;
+    if (msync(image_map + (size_t)image.dirty_lo * BLOCK_SIZE, (size_t)count * BLOCK_SIZE, MS_SYNC) == -1)
+    {
+        return -1;
+    }
+    image.dirty_lo = image.dirty_hi = -1;
+    return count;
 }
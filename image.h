@@ -1,9 +1,29 @@
 #ifndef IMAGE_H
 #define IMAGE_H
 
-int image_open(char *filename, int truncate);
+#define IMAGE_TRUNCATE 1
+#define IMAGE_MMAP 2
+#define IMAGE_PREALLOCATE 4
+#define IMAGE_EXISTING 8  // fail rather than create a missing image
+
+int image_open(char *filename, int flags);
 int image_close(void);
+int image_zero(int block_count);
+int image_msync(void);
+void image_mark_dirty(int block_num);
+
+// One filesystem's image file (see simfs.h). Its fields are reached as
+// image_fd, image_map and image_map_blocks.
+struct image_state {
+    int fd;
+    int flags;
+    unsigned char *map;  // set while the image is memory-mapped (IMAGE_MMAP)
+    int map_blocks;
+    int dirty_lo;        // block range written through the mapping since the last msync
+    int dirty_hi;
+};
 
-extern int image_fd;
+// Flags every image_open adds, in every filesystem
+extern int image_default_flags;
 
-#endif
\ No newline at end of file
+#endif
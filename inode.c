@@ -2,148 +2,1181 @@
 #include "block.h"
 #include "free.h"
 #include "pack.h"
+#include "super.h"
+#include "bitmap.h"
+#include "journal.h"
+#include "simfs.h"
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 
-static struct inode incore[MAX_SYS_OPEN_FILES] = {0};
+// This thread's filesystem's inode table
+#define incore (simfs_current->incore)
 
-struct inode *ialloc(void)
+static unsigned int incore_hash_index(unsigned int inode_num)
+{
+    return (inode_num * 2654435761u) & incore.hash_mask;
+}
+
+static void incore_lru_unlink(struct inode *in)
+{
+    in->lru_prev->lru_next = in->lru_next;
+    in->lru_next->lru_prev = in->lru_prev;
+    in->lru_prev = in->lru_next = NULL;
+}
+
+static void incore_lru_append(struct inode *in)
+{
+    in->lru_prev = incore.lru.lru_prev;
+    in->lru_next = &incore.lru;
+    incore.lru.lru_prev->lru_next = in;
+    incore.lru.lru_prev = in;
+}
+
+static void incore_hash_insert(struct inode *in)
+{
+    unsigned int index = incore_hash_index(in->inode_num);
+    in->hash_next = incore.hash[index];
+    incore.hash[index] = in;
+}
+
+static void incore_hash_remove(struct inode *in)
+{
+    struct inode **p = &incore.hash[incore_hash_index(in->inode_num)];
+    while (*p != NULL)
+    {
+        if (*p == in)
+        {
+            *p = in->hash_next;
+            break;
+        }
+        p = &(*p)->hash_next;
+    }
+    in->hash_next = NULL;
+}
+
+// Sizes the hash to at least twice the capacity and reindexes every
+// cached slot.
+static int incore_rehash(void)
+{
+    unsigned int size = 1;
+    while (size < (unsigned int)incore.capacity * 2)
+    {
+        size <<= 1;
+    }
+
+    struct inode **hash = calloc(size, sizeof(struct inode *));
+    if (hash == NULL)
+    {
+        return -1;
+    }
+    free(incore.hash);
+    incore.hash = hash;
+    incore.hash_mask = size - 1;
+
+    for (int c = 0; c < incore.chunk_count; c++)
+    {
+        for (int i = 0; i < incore.chunk_sizes[c]; i++)
+        {
+            if (incore.chunks[c][i].cached)
+            {
+                incore_hash_insert(&incore.chunks[c][i]);
+            }
+        }
+    }
+    return 0;
+}
+
+static int incore_add_chunk(int count)
 {
-    unsigned char inode_block[BLOCK_SIZE] = {0};
-    int free_bit_num;
+    if (incore.chunk_count == MAX_INCORE_CHUNKS)
+    {
+        return -1;
+    }
 
-    bread(FREE_INODE_BLOCK_NUM, inode_block);
-    free_bit_num = find_free(inode_block);
+    struct inode *chunk = calloc(count, sizeof(struct inode));
+    if (chunk == NULL)
+    {
+        return -1;
+    }
+    incore.chunks[incore.chunk_count] = chunk;
+    incore.chunk_sizes[incore.chunk_count] = count;
+    incore.chunk_count++;
+    incore.capacity += count;
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    for (int i = 0; i < count; i++)
+    {
+        pthread_mutex_init(&chunk[i].lock, &attr);
+        incore_lru_append(&chunk[i]);
+    }
+    pthread_mutexattr_destroy(&attr);
+    return 0;
+}
+
+static void incore_init(void)
+{
+    incore.lru.lru_next = incore.lru.lru_prev = &incore.lru;
+    incore_add_chunk(MAX_SYS_OPEN_FILES);
+    incore_rehash();
+}
+
+// Grows the in-core inode table to hold capacity inodes. The table never
+// shrinks here; clear_incore puts it back to MAX_SYS_OPEN_FILES.
+int incore_resize(int capacity)
+{
+    int result = 0;
+
+    pthread_mutex_lock(&incore.lock);
+    if (incore.capacity == 0)
+    {
+        incore_init();
+    }
+    if (capacity <= incore.capacity)
+    {
+        result = capacity == incore.capacity ? 0 : -1;
+    }
+    else if (incore_add_chunk(capacity - incore.capacity) == -1)
+    {
+        result = -1;
+    }
+    else
+    {
+        result = incore_rehash();
+    }
+    pthread_mutex_unlock(&incore.lock);
+    return result;
+}
+
+int incore_size(void)
+{
+    pthread_mutex_lock(&incore.lock);
+    int capacity = incore.capacity;
+    pthread_mutex_unlock(&incore.lock);
+    return capacity;
+}
+
+// Finds inode_num in the table whether or not anyone holds a reference
+static struct inode *incore_lookup(unsigned int inode_num)
+{
+    if (incore.capacity == 0)
+    {
+        incore_init();
+    }
+    for (struct inode *in = incore.hash[incore_hash_index(inode_num)]; in != NULL; in = in->hash_next)
+    {
+        if (in->inode_num == inode_num)
+        {
+            return in;
+        }
+    }
+    return NULL;
+}
+
+struct inode *ialloc(void)
+{
+    journal_begin();
+    int free_bit_num = bitmap_alloc(&inode_bitmap);
 
     if (free_bit_num != -1)
     {
-        set_free(inode_block, free_bit_num, 1);
-        bwrite(FREE_INODE_BLOCK_NUM, inode_block);
         struct inode *incore_node = iget(free_bit_num);
+        if (incore_node != NULL)
+        {
+            ilock(incore_node);
+            // Whatever the table block held, a new inode starts out empty
+            incore_node->size = 0;
+            incore_node->owner_id = 0;
+            incore_node->permissions = 0;
+            incore_node->flags = 0;
+            incore_node->link_count = 0;
+            memset(incore_node->block_ptr, 0, sizeof(incore_node->block_ptr));
+            incore_node->indirect = 0;
+            incore_node->double_indirect = 0;
+            incore_node->extent_count = 0;
+            incore_node->extent_depth = 0;
+            memset(incore_node->inline_data, 0, sizeof(incore_node->inline_data));
+            idirty(incore_node);
+            iunlock(incore_node);
+        }
+        else
+        {
+            // No slot for it in-core: the number is not used after all
+            bitmap_release(&inode_bitmap, free_bit_num);
+        }
+        journal_end();
         return incore_node;
     }
 
+    journal_end();
     return NULL;
 }
 
 
-struct inode *find_incore_free(void)
+// Allocates a zeroed pointer block near goal
+static int alloc_ptr_block(int goal)
+{
+    unsigned char zero_block[BLOCK_SIZE] = { 0 };
+    int got;
+
+    int block_num = alloc_run(1, goal, &got);
+    if (block_num == -1)
+    {
+        return -1;
+    }
+    if (bwrite_meta(block_num, zero_block) == -1)
+    {
+        bitmap_release(&block_bitmap, block_num);
+        return -1;
+    }
+    return block_num;
+}
+
+// Finds the pointer block holding the entry for logical block index (at
+// least INODE_PTR_COUNT) and the logical block its first entry maps.
+// Returns 0 if that pointer block does not exist and create is not set,
+// or -1 on error.
+static int ptr_block_for(struct inode *in, int index, int *first, int create, int goal)
 {
-    for (int i = 0; i < MAX_SYS_OPEN_FILES; i++)
+    index -= INODE_PTR_COUNT;
+    if (index < PTRS_PER_BLOCK)
     {
-        if (incore[i].ref_count == 0)
+        *first = INODE_PTR_COUNT;
+        if (in->indirect == 0 && create)
         {
-            return &incore[i];
+            int block_num = alloc_ptr_block(goal);
+            if (block_num == -1)
+            {
+                return -1;
+            }
+            in->indirect = block_num;
         }
+        return in->indirect;
     }
-    return NULL;
+
+    index -= PTRS_PER_BLOCK;
+    if (index >= PTRS_PER_BLOCK * PTRS_PER_BLOCK)
+    {
+        return -1;
+    }
+    if (in->double_indirect == 0)
+    {
+        if (!create)
+        {
+            return 0;
+        }
+        int block_num = alloc_ptr_block(goal);
+        if (block_num == -1)
+        {
+            return -1;
+        }
+        in->double_indirect = block_num;
+    }
+
+    int slot = index / PTRS_PER_BLOCK;
+    *first = INODE_PTR_COUNT + PTRS_PER_BLOCK + slot * PTRS_PER_BLOCK;
+
+    unsigned char *top = bget(in->double_indirect);
+    if (top == NULL)
+    {
+        return -1;
+    }
+    int block_num = read_u32(top + slot * 4);
+    if (block_num == 0 && create)
+    {
+        block_num = alloc_ptr_block(goal);
+        if (block_num != -1)
+        {
+            write_u32(top + slot * 4, block_num);
+            bdirty(in->double_indirect);
+        }
+    }
+    brelse(in->double_indirect);
+    return block_num;
 }
 
-struct inode *find_incore(unsigned int inode_num)
+static int cursor_covers(struct bmap_cursor *cursor, struct inode *in, int index)
 {
-    for (int i = 0; i < MAX_SYS_OPEN_FILES; i++)
+    return cursor->block_num != 0 && cursor->version == in->map_version &&
+           index >= cursor->first && index < cursor->end;
+}
+
+static void leaf_get(unsigned char *leaf, int i, struct extent *e)
+{
+    unsigned char *rec = leaf + LEAF_EXTENT_OFFSET + i * BYTES_PER_LEAF_EXTENT;
+    e->logical = read_u32(rec);
+    e->physical = read_u32(rec + 4);
+    e->length = read_u32(rec + 8);
+}
+
+static void leaf_put(unsigned char *leaf, int i, const struct extent *e)
+{
+    unsigned char *rec = leaf + LEAF_EXTENT_OFFSET + i * BYTES_PER_LEAF_EXTENT;
+    write_u32(rec, e->logical);
+    write_u32(rec + 4, e->physical);
+    write_u32(rec + 8, e->length);
+}
+
+// Binary search for the last of count sorted records starting at or
+// before index; -1 if they all start after it
+static int extent_search(struct extent *ext, int count, unsigned int index)
+{
+    int lo = 0, hi = count;
+    while (lo < hi)
     {
-        if (incore[i].ref_count != 0 && incore[i].inode_num == inode_num)
+        int mid = (lo + hi) / 2;
+        if (ext[mid].logical <= index)
+        {
+            lo = mid + 1;
+        }
+        else
         {
-            return &incore[i];
+            hi = mid;
         }
     }
-    return NULL;
+    return lo - 1;
 }
 
-void read_inode_block(unsigned char *inode_block, struct inode *in, int block_offset)
+static int leaf_search(unsigned char *leaf, unsigned int index)
+{
+    int lo = 0, hi = read_u32(leaf + LEAF_COUNT_OFFSET);
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (read_u32(leaf + LEAF_EXTENT_OFFSET + mid * BYTES_PER_LEAF_EXTENT) <= index)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo - 1;
+}
+
+static int extent_bmap(struct inode *in, int index, struct bmap_cursor *cursor)
+{
+    struct extent e;
+    int i;
+
+    if (in->extent_depth == 0)
+    {
+        i = extent_search(in->extents, in->extent_count, index);
+        if (i == -1)
+        {
+            return 0;
+        }
+        e = in->extents[i];
+    }
+    else
+    {
+        if (!cursor_covers(cursor, in, index))
+        {
+            int slot = extent_search(in->extents, in->extent_count, index);
+            if (slot == -1)
+            {
+                return 0;
+            }
+            bmap_release(cursor);
+            cursor->data = bget(in->extents[slot].physical);
+            if (cursor->data == NULL)
+            {
+                return -1;
+            }
+            cursor->block_num = in->extents[slot].physical;
+            cursor->first = in->extents[slot].logical;
+            cursor->end = slot + 1 < in->extent_count ? (int)in->extents[slot + 1].logical : INODE_MAX_BLOCKS;
+            cursor->version = in->map_version;
+        }
+        i = leaf_search(cursor->data, index);
+        if (i == -1)
+        {
+            return 0;
+        }
+        leaf_get(cursor->data, i, &e);
+    }
+
+    if ((unsigned int)index >= e.logical + e.length)
+    {
+        return 0;
+    }
+    return e.physical + (index - e.logical);
+}
+
+// Adds e to the sorted records ext[0..*count), growing the record before
+// it instead when e continues it on disk. Returns -1 if there is no room.
+static int extent_add(struct extent *ext, int *count, int max, const struct extent *e)
+{
+    int i = extent_search(ext, *count, e->logical);
+    if (i >= 0 && ext[i].logical + ext[i].length == e->logical &&
+        ext[i].physical + ext[i].length == e->physical &&
+        ext[i].length + e->length <= MAX_EXTENT_LENGTH)
+    {
+        ext[i].length += e->length;
+        return 0;
+    }
+    if (*count == max)
+    {
+        return -1;
+    }
+    memmove(ext + i + 2, ext + i + 1, (*count - i - 1) * sizeof(struct extent));
+    ext[i + 1] = *e;
+    (*count)++;
+    return 0;
+}
+
+static int leaf_load(int block_num, struct extent *ext)
 {
-    int block_offset_bytes = block_offset * INODE_SIZE;
+    unsigned char *leaf = bget(block_num);
+    if (leaf == NULL)
+    {
+        return -1;
+    }
+    int count = read_u32(leaf + LEAF_COUNT_OFFSET);
+    for (int i = 0; i < count; i++)
+    {
+        leaf_get(leaf, i, &ext[i]);
+    }
+    brelse(block_num);
+    return count;
+}
 
-    in->size = read_u32(inode_block + block_offset_bytes + SIZE_OFFSET);
-    in->owner_id = read_u16(inode_block + block_offset_bytes + ID_OFFSET);
-    in->permissions = read_u8(inode_block + block_offset_bytes + PERMISSIONS_OFFSET);
-    in->flags = read_u8(inode_block + block_offset_bytes + FLAGS_OFFSET);
-    in->link_count = read_u8(inode_block + block_offset_bytes + LINK_COUNT_OFFSET);
+static int leaf_store(int block_num, struct extent *ext, int count)
+{
+    unsigned char *leaf = bget(block_num);
+    if (leaf == NULL)
+    {
+        return -1;
+    }
+    write_u32(leaf + LEAF_COUNT_OFFSET, count);
+    for (int i = 0; i < count; i++)
+    {
+        leaf_put(leaf, i, &ext[i]);
+    }
+    bdirty(block_num);
+    brelse(block_num);
+    return 0;
+}
 
+// Records that logical blocks [e->logical, + e->length) now map to
+// [e->physical, + e->length). A full inode moves its records out to a
+// leaf block, and a full leaf is split in two.
+static int extent_insert(struct inode *in, const struct extent *e)
+{
+    struct extent ext[EXTENTS_PER_BLOCK];
+    int count = in->extent_count;
+
+    if (in->extent_depth == 0)
+    {
+        if (extent_add(in->extents, &count, INODE_EXTENTS, e) == 0)
+        {
+            in->extent_count = count;
+            return 0;
+        }
+
+        int leaf = alloc_ptr_block(-1);
+        if (leaf == -1 || leaf_store(leaf, in->extents, count) == -1)
+        {
+            return -1;
+        }
+        in->extents[0].logical = 0;
+        in->extents[0].physical = leaf;
+        in->extents[0].length = 0;
+        in->extent_count = 1;
+        in->extent_depth = 1;
+        in->map_version++;
+    }
+
+    int slot = extent_search(in->extents, in->extent_count, e->logical);
+    int leaf = in->extents[slot].physical;
+    count = leaf_load(leaf, ext);
+    if (count == -1)
+    {
+        return -1;
+    }
+    if (extent_add(ext, &count, EXTENTS_PER_BLOCK, e) == 0)
+    {
+        return leaf_store(leaf, ext, count);
+    }
+
+    // Split the leaf, moving its upper half to a new one
+    if (in->extent_count == INODE_EXTENTS)
+    {
+        return -1;
+    }
+    int upper = alloc_ptr_block(-1);
+    if (upper == -1)
+    {
+        return -1;
+    }
+    // Appending to the last leaf starts a new one rather than leaving two
+    // half-full leaves behind
+    int half = count / 2;
+    unsigned int upper_first = ext[half].logical;
+    if (slot == in->extent_count - 1 && e->logical > ext[count - 1].logical)
+    {
+        half = count;
+        upper_first = e->logical;
+    }
+    if (leaf_store(upper, ext + half, count - half) == -1 || leaf_store(leaf, ext, half) == -1)
+    {
+        return -1;
+    }
+    memmove(in->extents + slot + 2, in->extents + slot + 1, (in->extent_count - slot - 1) * sizeof(struct extent));
+    in->extents[slot + 1].logical = upper_first;
+    in->extents[slot + 1].physical = upper;
+    in->extents[slot + 1].length = 0;
+    in->extent_count++;
+    in->map_version++;
+    return extent_insert(in, e);
+}
+
+// Returns the data block holding logical block index of the inode, 0 if
+// it is not mapped (a hole), or -1 if index is past what the inode can map.
+int bmap(struct inode *in, int index)
+{
+    struct bmap_cursor cursor = { 0 };
+    int block_num = bmap_cached(in, index, &cursor);
+    bmap_release(&cursor);
+    return block_num;
+}
+
+// bmap, keeping the last pointer block it used pinned in cursor. The
+// cursor must be released with bmap_release.
+int bmap_cached(struct inode *in, int index, struct bmap_cursor *cursor)
+{
+    if (index < 0 || index >= INODE_MAX_BLOCKS)
+    {
+        return -1;
+    }
+    if (in->flags & INLINE_FLAG)
+    {
+        return 0;
+    }
+    if (in->flags & EXTENTS_FLAG)
+    {
+        return extent_bmap(in, index, cursor);
+    }
+    if (index < INODE_PTR_COUNT)
+    {
+        return in->block_ptr[index];
+    }
+
+    if (!cursor_covers(cursor, in, index))
+    {
+        int first;
+        int block_num = ptr_block_for(in, index, &first, 0, -1);
+        if (block_num <= 0)
+        {
+            return block_num;
+        }
+
+        bmap_release(cursor);
+        cursor->data = bget(block_num);
+        if (cursor->data == NULL)
+        {
+            return -1;
+        }
+        cursor->block_num = block_num;
+        cursor->first = first;
+        cursor->end = first + PTRS_PER_BLOCK;
+        cursor->version = in->map_version;
+    }
+    return read_u32(cursor->data + (index - cursor->first) * 4);
+}
+
+void bmap_release(struct bmap_cursor *cursor)
+{
+    if (cursor->block_num != 0)
+    {
+        brelse(cursor->block_num);
+        cursor->block_num = 0;
+        cursor->data = NULL;
+    }
+}
+
+static int extent_add_blocks(struct inode *in, int first, int count, int goal)
+{
+    while (count > 0)
+    {
+        int got;
+        int block_num = alloc_run(count < MAX_EXTENT_LENGTH ? count : MAX_EXTENT_LENGTH, goal, &got);
+        if (block_num == -1)
+        {
+            return -1;
+        }
+
+        struct extent e = { first, block_num, got };
+        if (extent_insert(in, &e) == -1)
+        {
+            for (int i = 0; i < got; i++)
+            {
+                bitmap_release(&block_bitmap, block_num + i);
+            }
+            return -1;
+        }
+        first += got;
+        count -= got;
+        goal = block_num + got;
+    }
+    return 0;
+}
+
+static int map_new_blocks(struct inode *in, int first, int count)
+{
+    if (first < 0 || count < 0 || first + count > INODE_MAX_BLOCKS || (in->flags & INLINE_FLAG))
+    {
+        return -1;
+    }
+    idirty(in);
+
+    int goal = first > 0 ? bmap(in, first - 1) + 1 : -1;
+    if (goal == 0)
+    {
+        goal = -1;
+    }
+
+    if (in->flags & EXTENTS_FLAG)
+    {
+        return extent_add_blocks(in, first, count, goal);
+    }
+
+    while (count > 0)
+    {
+        // Direct pointers, or the entries left in one pointer block
+        int ptr_block = 0;
+        int ptr_first = 0;
+        int n = count;
+        if (first < INODE_PTR_COUNT)
+        {
+            if (n > INODE_PTR_COUNT - first)
+            {
+                n = INODE_PTR_COUNT - first;
+            }
+        }
+        else
+        {
+            ptr_block = ptr_block_for(in, first, &ptr_first, 1, goal);
+            if (ptr_block == -1)
+            {
+                return -1;
+            }
+            if (n > ptr_first + PTRS_PER_BLOCK - first)
+            {
+                n = ptr_first + PTRS_PER_BLOCK - first;
+            }
+            // Data goes after a pointer block just allocated in its way
+            if (goal == -1 || ptr_block >= goal)
+            {
+                goal = ptr_block + 1;
+            }
+        }
+
+        int got;
+        int block_num = alloc_run(n, goal, &got);
+        if (block_num == -1)
+        {
+            return -1;
+        }
+
+        if (ptr_block == 0)
+        {
+            for (int i = 0; i < got; i++)
+            {
+                in->block_ptr[first + i] = block_num + i;
+            }
+        }
+        else
+        {
+            unsigned char *ptrs = bget(ptr_block);
+            if (ptrs == NULL)
+            {
+                for (int i = 0; i < got; i++)
+                {
+                    bitmap_release(&block_bitmap, block_num + i);
+                }
+                return -1;
+            }
+            for (int i = 0; i < got; i++)
+            {
+                write_u32(ptrs + (first - ptr_first + i) * 4, block_num + i);
+            }
+            bdirty(ptr_block);
+            brelse(ptr_block);
+        }
+        first += got;
+        count -= got;
+        goal = block_num + got;
+    }
+    return 0;
+}
+
+// Maps logical blocks [first, first + count) of the inode to newly
+// allocated data blocks, asking for them in runs placed right after the
+// block before first so the file stays sequential on disk. Pointer blocks
+// are allocated as they are needed, just ahead of the data they map.
+int inode_add_blocks(struct inode *in, int first, int count)
+{
+    journal_begin();
+    int result = map_new_blocks(in, first, count);
+    journal_end();
+    return result;
+}
+
+struct inode *find_incore_free(void)
+{
+    struct inode *in = NULL;
+
+    pthread_mutex_lock(&incore.lock);
+    if (incore.capacity == 0)
+    {
+        incore_init();
+    }
+    if (incore.lru.lru_next != &incore.lru)
+    {
+        in = incore.lru.lru_next;
+    }
+    pthread_mutex_unlock(&incore.lock);
+    return in;
+}
+
+struct inode *find_incore(unsigned int inode_num)
+{
+    pthread_mutex_lock(&incore.lock);
+    struct inode *in = incore_lookup(inode_num);
+    if (in != NULL && in->ref_count == 0)
+    {
+        in = NULL;
+    }
+    pthread_mutex_unlock(&incore.lock);
+    return in;
+}
+
+// Decodes the on-disk inode at raw in one pass over its 64 bytes
+void inode_decode(unsigned char *raw, struct inode *in)
+{
+    in->size = read_u32(raw + SIZE_OFFSET);
+    in->owner_id = read_u16(raw + ID_OFFSET);
+    in->permissions = raw[PERMISSIONS_OFFSET];
+    in->flags = raw[FLAGS_OFFSET];
+    in->link_count = raw[LINK_COUNT_OFFSET];
+
+    if (in->flags & INLINE_FLAG)
+    {
+        // A damaged size is never read past the inline bytes
+        if (in->size > INLINE_DATA_SIZE)
+        {
+            in->size = INLINE_DATA_SIZE;
+        }
+        // Nothing mapped, for when the flag is cleared
+        memcpy(in->inline_data, raw + INLINE_DATA_OFFSET, INLINE_DATA_SIZE);
+        memset(in->block_ptr, 0, sizeof(in->block_ptr));
+        in->indirect = 0;
+        in->double_indirect = 0;
+        in->extent_count = 0;
+        in->extent_depth = 0;
+        return;
+    }
+    if (in->flags & EXTENTS_FLAG)
+    {
+        unsigned char *rec = raw + EXTENT_OFFSET;
+        in->extent_count = raw[EXTENT_COUNT_OFFSET];
+        in->extent_depth = raw[EXTENT_DEPTH_OFFSET];
+        for (int i = 0; i < INODE_EXTENTS; i++, rec += BYTES_PER_EXTENT)
+        {
+            in->extents[i].logical = read_u32(rec);
+            in->extents[i].physical = read_u24(rec + 4);
+            in->extents[i].length = read_u16(rec + 7);
+        }
+        return;
+    }
+
+    unsigned char *low = raw + BLOCK_PTR_OFFSET;
+    unsigned char *high = raw + BLOCK_PTR_HIGH_OFFSET;
     for (int i = 0; i < INODE_PTR_COUNT; i++)
     {
-        in->block_ptr[i] = read_u16(inode_block + block_offset_bytes + BLOCK_PTR_OFFSET + (BYTES_PER_BLOCK_PTR * i));
+        in->block_ptr[i] = read_u16(low + BYTES_PER_BLOCK_PTR * i) | high[i] << 16;
     }
+    in->indirect = read_u24(raw + INDIRECT_OFFSET);
+    in->double_indirect = read_u24(raw + DOUBLE_INDIRECT_OFFSET);
+}
+
+void read_inode_block(unsigned char *inode_block, struct inode *in, int block_offset)
+{
+    inode_decode(inode_block + block_offset * INODE_SIZE, in);
 }
 
-void read_inode(struct inode *in, int inode_num)
+// Returns -1, leaving in zeroed, if the table block cannot be read or
+// fails its checksum
+int read_inode(struct inode *in, int inode_num)
 {
-    unsigned char inode_block[BLOCK_SIZE] = {0};
+    static unsigned char zero_block[BLOCK_SIZE];
 
-    int block_num = inode_num / INODE_SIZE + INODE_FIRST_BLOCK;
-    int block_offset = inode_num % INODE_SIZE;
+    int block_num = sb.inode_table_start + inode_num / INODES_PER_BLOCK;
+    int block_offset = inode_num % INODES_PER_BLOCK;
 
-    bread(block_num, inode_block);
-    read_inode_block(inode_block, in, block_offset);
+    // Decoded straight from the cached table block, without a copy
+    unsigned char *inode_block = bget(block_num);
+    read_inode_block(inode_block != NULL ? inode_block : zero_block, in, block_offset);
+    if (inode_block != NULL)
+    {
+        brelse(block_num);
+    }
+    in->dirty = 0;
+    return inode_block != NULL ? 0 : -1;
 }
 
-void write_inode_block(unsigned char *inode_block, struct inode *in, int block_offset)
+void inode_encode(unsigned char *raw, struct inode *in)
 {
-    int block_offset_bytes = block_offset * INODE_SIZE;
+    write_u32(raw + SIZE_OFFSET, in->size);
+    write_u16(raw + ID_OFFSET, in->owner_id);
+    raw[PERMISSIONS_OFFSET] = in->permissions;
+    raw[FLAGS_OFFSET] = in->flags;
+    raw[LINK_COUNT_OFFSET] = in->link_count;
 
-    write_u32(inode_block + block_offset_bytes + SIZE_OFFSET, in->size);
-    write_u16(inode_block + block_offset_bytes + ID_OFFSET, in->owner_id);
-    write_u8(inode_block + block_offset_bytes + PERMISSIONS_OFFSET, in->permissions);
-    write_u8(inode_block + block_offset_bytes + FLAGS_OFFSET, in->flags);
-    write_u8(inode_block + block_offset_bytes + LINK_COUNT_OFFSET, in->link_count);
+    if (in->flags & INLINE_FLAG)
+    {
+        memcpy(raw + INLINE_DATA_OFFSET, in->inline_data, INLINE_DATA_SIZE);
+        return;
+    }
+    if (in->flags & EXTENTS_FLAG)
+    {
+        unsigned char *rec = raw + EXTENT_OFFSET;
+        raw[EXTENT_COUNT_OFFSET] = in->extent_count;
+        raw[EXTENT_DEPTH_OFFSET] = in->extent_depth;
+        for (int i = 0; i < INODE_EXTENTS; i++, rec += BYTES_PER_EXTENT)
+        {
+            write_u32(rec, in->extents[i].logical);
+            write_u24(rec + 4, in->extents[i].physical);
+            write_u16(rec + 7, in->extents[i].length);
+        }
+        return;
+    }
 
+    unsigned char *low = raw + BLOCK_PTR_OFFSET;
+    unsigned char *high = raw + BLOCK_PTR_HIGH_OFFSET;
     for (int i = 0; i < INODE_PTR_COUNT; i++)
     {
-        write_u16(inode_block + block_offset_bytes + BLOCK_PTR_OFFSET + (BYTES_PER_BLOCK_PTR * i), in->block_ptr[i]);
+        write_u16(low + BYTES_PER_BLOCK_PTR * i, in->block_ptr[i]);
+        high[i] = in->block_ptr[i] >> 16;
     }
+    write_u24(raw + INDIRECT_OFFSET, in->indirect);
+    write_u24(raw + DOUBLE_INDIRECT_OFFSET, in->double_indirect);
 }
 
-void write_inode(struct inode *in)
+void write_inode_block(unsigned char *inode_block, struct inode *in, int block_offset)
 {
-    unsigned char inode_block[BLOCK_SIZE] = {0};
+    inode_encode(inode_block + block_offset * INODE_SIZE, in);
+}
 
+void write_inode(struct inode *in)
+{
     int inode_num = in->inode_num;
-    int block_num = inode_num / INODE_SIZE + INODE_FIRST_BLOCK;
-    int block_offset = inode_num % INODE_SIZE;
+    int block_num = sb.inode_table_start + inode_num / INODES_PER_BLOCK;
+    int block_offset = inode_num % INODES_PER_BLOCK;
 
-    bread(block_num, inode_block);
+    unsigned char *inode_block = bget(block_num);
+    if (inode_block == NULL)
+    {
+        return;
+    }
     write_inode_block(inode_block, in, block_offset);
-    bwrite(block_num, inode_block);
+    bdirty(block_num);
+    brelse(block_num);
+    in->dirty = 0;
+}
+
+// Marks an in-core inode as changed, so it is written back before its
+// slot is reused or by the next inode_sync
+void idirty(struct inode *in)
+{
+    // Read without the inode's lock by inode_sync, to find what to flush
+    __atomic_store_n(&in->dirty, 1, __ATOMIC_RELAXED);
+}
+
+// Writes every dirty in-core inode in inode table block table_index
+// with one update of the block. Inodes another thread has locked are in
+// the middle of changing and are left dirty for next time; ones iget is
+// still reading in are not dirty yet. Returns how many were left dirty,
+// or -1 if the block could not be had. The table lock is held.
+static int flush_table_block(int table_index)
+{
+    int skipped = 0;
+    int block_num = sb.inode_table_start + table_index;
+    int first = table_index * INODES_PER_BLOCK;
+
+    unsigned char *inode_block = bget(block_num);
+    if (inode_block == NULL)
+    {
+        return -1;
+    }
+    for (int i = 0; i < INODES_PER_BLOCK; i++)
+    {
+        struct inode *in = incore_lookup(first + i);
+        if (in != NULL && !in->loading && pthread_mutex_trylock(&in->lock) == 0)
+        {
+            if (in->dirty)
+            {
+                write_inode_block(inode_block, in, i);
+                in->dirty = 0;
+            }
+            iunlock(in);
+        }
+        else if (in != NULL && !in->loading)
+        {
+            skipped += __atomic_load_n(&in->dirty, __ATOMIC_RELAXED) != 0;
+        }
+    }
+    bdirty(block_num);
+    brelse(block_num);
+    return skipped;
+}
+
+// Writes back every dirty in-core inode, one table block at a time
+int inode_sync(void)
+{
+    int result = 0;
+
+    pthread_mutex_lock(&incore.lock);
+    for (int c = 0; c < incore.chunk_count; c++)
+    {
+        for (int i = 0; i < incore.chunk_sizes[c]; i++)
+        {
+            struct inode *in = &incore.chunks[c][i];
+            if (in->cached && __atomic_load_n(&in->dirty, __ATOMIC_RELAXED) && flush_table_block(in->inode_num / INODES_PER_BLOCK) == -1)
+            {
+                result = -1;
+            }
+        }
+    }
+    pthread_mutex_unlock(&incore.lock);
+    return result;
+}
+
+// Loads every inode in the table block holding inode_num that is not
+// in-core yet into free slots, for scans that will want them all. Stops
+// rather than evict a dirty inode. Returns how many were loaded.
+int iprefetch(int inode_num)
+{
+    if (inode_num < 0 || inode_num >= (int)sb.inode_count)
+    {
+        return -1;
+    }
+
+    int table_index = inode_num / INODES_PER_BLOCK;
+    int block_num = sb.inode_table_start + table_index;
+    int first = table_index * INODES_PER_BLOCK;
+    int loaded = 0;
+
+    unsigned char *inode_block = bget(block_num);
+    if (inode_block == NULL)
+    {
+        return -1;
+    }
+    pthread_mutex_lock(&incore.lock);
+    for (int i = 0; i < INODES_PER_BLOCK && first + i < (int)sb.inode_count; i++)
+    {
+        if (incore_lookup(first + i) != NULL)
+        {
+            continue;
+        }
+        struct inode *slot = find_incore_free();
+        if (slot == NULL || slot->dirty)
+        {
+            break;
+        }
+
+        // Stays on the LRU list, as if it had been released
+        if (slot->cached)
+        {
+            incore_hash_remove(slot);
+        }
+        read_inode_block(inode_block, slot, i);
+        slot->dirty = 0;
+        slot->ref_count = 0;
+        slot->inode_num = first + i;
+        slot->cached = 1;
+        incore_hash_insert(slot);
+        incore_lru_unlink(slot);
+        incore_lru_append(slot);
+        loaded++;
+    }
+    pthread_mutex_unlock(&incore.lock);
+    brelse(block_num);
+    return loaded;
+}
+
+// Takes the least recently used unreferenced slot for reuse. A dirty
+// inode goes out, with its neighbours, first; one that cannot, because the
+// write failed or another thread holds it, keeps its slot and the next is
+// tried. Returns NULL if none can be had. The table lock is held.
+static struct inode *incore_claim(void)
+{
+    for (int tries = 0; tries < incore.capacity; tries++)
+    {
+        struct inode *in = find_incore_free();
+        if (in == NULL || !in->cached || !in->dirty)
+        {
+            return in;
+        }
+        if (flush_table_block(in->inode_num / INODES_PER_BLOCK) != -1 && !in->dirty)
+        {
+            return in;
+        }
+        incore_lru_unlink(in);
+        incore_lru_append(in);
+    }
+    return NULL;
+}
+
+// Written back later, and only if something changed (see idirty). The
+// table lock is held.
+static void iput_locked(struct inode *in)
+{
+    if (in->ref_count > 0)
+    {
+        in->ref_count--;
+        if (in->ref_count == 0)
+        {
+            incore_lru_append(in);
+        }
+    }
 }
 
 struct inode *iget(int inode_num)
 {
-    struct inode *incore_node = find_incore(inode_num);
+    if (inode_num < 0 || inode_num >= (int)sb.inode_count)
+    {
+        return NULL;
+    }
+
+    // Still cached, referenced or not: no I/O needed
+    pthread_mutex_lock(&incore.lock);
+    struct inode *incore_node = incore_lookup(inode_num);
     if (incore_node != NULL)
     {
+        if (incore_node->ref_count == 0)
+        {
+            incore_lru_unlink(incore_node);
+        }
         incore_node->ref_count++;
+        // Another thread may still be reading it in
+        while (incore_node->loading)
+        {
+            pthread_cond_wait(&incore.loaded, &incore.lock);
+        }
+        // and may have failed to
+        if (!incore_node->cached)
+        {
+            iput_locked(incore_node);
+            incore_node = NULL;
+        }
+        pthread_mutex_unlock(&incore.lock);
         return incore_node;
     }
 
-    struct inode *free_node = find_incore_free();
+    struct inode *free_node = incore_claim();
     if (free_node == NULL)
     {
+        pthread_mutex_unlock(&incore.lock);
         return NULL;
     }
-
-    read_inode(free_node, inode_num);
+    incore_lru_unlink(free_node);
+    if (free_node->cached)
+    {
+        incore_hash_remove(free_node);
+    }
     free_node->ref_count = 1;
     free_node->inode_num = inode_num;
+    free_node->cached = 1;
+    free_node->loading = 1;
+    incore_hash_insert(free_node);
+
+    // The slot is claimed, so the read can go on without the table lock
+    pthread_mutex_unlock(&incore.lock);
+    int result = read_inode(free_node, inode_num);
+    pthread_mutex_lock(&incore.lock);
+    free_node->loading = 0;
+    if (result == -1)
+    {
+        // Gives the slot back; threads waiting for it see it is not cached
+        incore_hash_remove(free_node);
+        free_node->cached = 0;
+        iput_locked(free_node);
+        free_node = NULL;
+    }
+    pthread_cond_broadcast(&incore.loaded);
+    pthread_mutex_unlock(&incore.lock);
     return free_node;
 }
 
 void iput(struct inode *in)
 {
-    if (in->ref_count == 0)
+    pthread_mutex_lock(&incore.lock);
+    iput_locked(in);
+    pthread_mutex_unlock(&incore.lock);
+}
+
+// Serializes changes to an in-core inode and to the blocks it maps:
+// file and directory operations hold it for their whole duration. It is
+// recursive, so an operation may call others on the same inode. Taken
+// before the table lock, never while holding it, except by inode_sync,
+// which only tries. Holding one inode's lock, a thread may take another's
+// only if ialloc just handed it out, when no one else can hold it.
+void ilock(struct inode *in)
+{
+    pthread_mutex_lock(&in->lock);
+}
+
+void iunlock(struct inode *in)
+{
+    pthread_mutex_unlock(&in->lock);
+}
+
+// Forgets every unreferenced inode, e.g. when a different image is opened.
+void incore_drop_cached(void)
+{
+    pthread_mutex_lock(&incore.lock);
+    for (struct inode *in = incore.lru.lru_next; incore.capacity != 0 && in != &incore.lru; in = in->lru_next)
     {
-        return;
+        if (in->cached)
+        {
+            incore_hash_remove(in);
+            in->cached = 0;
+            in->dirty = 0;
+        }
     }
+    pthread_mutex_unlock(&incore.lock);
+}
 
-    in->ref_count--;
-    if (in->ref_count == 0)
+// Frees the whole table, dirty inodes and all. The next use starts an
+// empty one.
+void incore_release(void)
+{
+    pthread_mutex_lock(&incore.lock);
+    for (int c = 0; c < incore.chunk_count; c++)
     {
-        write_inode(in);
+        for (int i = 0; i < incore.chunk_sizes[c]; i++)
+        {
+            pthread_mutex_destroy(&incore.chunks[c][i].lock);
+        }
+        free(incore.chunks[c]);
     }
+    free(incore.hash);
+    incore.hash = NULL;
+    incore.chunk_count = 0;
+    incore.capacity = 0;
+    pthread_mutex_unlock(&incore.lock);
 }
 
 void clear_incore(void)
 {
-    memset(incore, 0, sizeof(incore));
+    inode_sync();
+    pthread_mutex_lock(&incore.lock);
+    incore_release();
+    incore_init();
+    pthread_mutex_unlock(&incore.lock);
 }
@@ -2,23 +2,42 @@
 #define INODE_H
 
 #include "block.h"
+#include <pthread.h>
 
-#define FREE_INODE_BLOCK_NUM 1
+struct bmap_cursor;
 
 struct inode *ialloc(void);
 struct inode *iget(int inode_num);
 void iput(struct inode *in);
+void ilock(struct inode *in);
+void iunlock(struct inode *in);
 void write_inode(struct inode *in);
-void read_inode(struct inode *in, int inode_num);
+int read_inode(struct inode *in, int inode_num);
+void inode_decode(unsigned char *raw, struct inode *in);
+void inode_encode(unsigned char *raw, struct inode *in);
+void idirty(struct inode *in);
+int inode_sync(void);
+int iprefetch(int inode_num);
+int bmap(struct inode *in, int index);
+int bmap_cached(struct inode *in, int index, struct bmap_cursor *cursor);
+void bmap_release(struct bmap_cursor *cursor);
+int inode_add_blocks(struct inode *in, int first, int count);
 struct inode *find_incore_free(void);
 struct inode *find_incore(unsigned int inode_num);
 void clear_incore(void);
+void incore_release(void);
+void incore_drop_cached(void);
+int incore_resize(int capacity);
+int incore_size(void);
 
 #define INODE_PTR_COUNT 16
+#define PTRS_PER_BLOCK (BLOCK_SIZE / 4)
+#define INODE_MAX_BLOCKS (INODE_PTR_COUNT + PTRS_PER_BLOCK + PTRS_PER_BLOCK * PTRS_PER_BLOCK)
 #define MAX_SYS_OPEN_FILES 64
+#define MAX_INCORE_CHUNKS 32
 
 #define INODE_SIZE 64
-#define INODE_FIRST_BLOCK 3
+#define INODES_PER_BLOCK (BLOCK_SIZE / INODE_SIZE)
 
 #define SIZE_OFFSET 0
 #define ID_OFFSET (SIZE_OFFSET + 4)
@@ -27,6 +46,42 @@ void clear_incore(void);
 #define LINK_COUNT_OFFSET (FLAGS_OFFSET + 1)
 #define BLOCK_PTR_OFFSET (LINK_COUNT_OFFSET + 1)
 #define BYTES_PER_BLOCK_PTR 2
+// Block pointers are 24 bits: the high bytes follow the low halves
+#define BLOCK_PTR_HIGH_OFFSET (BLOCK_PTR_OFFSET + BYTES_PER_BLOCK_PTR * INODE_PTR_COUNT)
+#define INDIRECT_OFFSET (BLOCK_PTR_HIGH_OFFSET + INODE_PTR_COUNT)
+#define DOUBLE_INDIRECT_OFFSET (INDIRECT_OFFSET + 3)
+
+// Inodes with EXTENTS_FLAG keep extent records where the block pointers
+// would be: a count, the tree depth, then 9-byte records. At depth 0 the
+// records map data; at depth 1 each one points at a leaf block holding
+// up to EXTENTS_PER_BLOCK records, and only its logical start is used.
+#define EXTENTS_FLAG 8
+#define INODE_EXTENTS 5
+#define MAX_EXTENT_LENGTH 0xffff
+#define EXTENT_COUNT_OFFSET BLOCK_PTR_OFFSET
+#define EXTENT_DEPTH_OFFSET (EXTENT_COUNT_OFFSET + 1)
+#define EXTENT_OFFSET (EXTENT_DEPTH_OFFSET + 1)
+#define BYTES_PER_EXTENT 9
+
+// Leaf blocks: a 32-bit count, then records of three 32-bit fields
+#define LEAF_COUNT_OFFSET 0
+#define LEAF_EXTENT_OFFSET 4
+#define BYTES_PER_LEAF_EXTENT 12
+#define EXTENTS_PER_BLOCK ((BLOCK_SIZE - LEAF_EXTENT_OFFSET) / BYTES_PER_LEAF_EXTENT)
+
+// Inodes with INLINE_FLAG have no blocks: up to INLINE_DATA_SIZE bytes
+// of data sit where the block pointers would be. Blocks are only added
+// once the flag is cleared, which is up to whoever outgrows the space
+// (file.c for files, mkfs.c for directories).
+#define INLINE_FLAG 32
+#define INLINE_DATA_OFFSET BLOCK_PTR_OFFSET
+#define INLINE_DATA_SIZE (INODE_SIZE - INLINE_DATA_OFFSET)
+
+struct extent {
+    unsigned int logical;   // first logical block
+    unsigned int physical;  // first data block, or the leaf block at depth 1
+    unsigned int length;
+};
 
 struct inode {
     unsigned int size;
@@ -34,10 +89,58 @@ struct inode {
     unsigned char permissions;
     unsigned char flags;
     unsigned char link_count;
-    unsigned short block_ptr[INODE_PTR_COUNT];
+    unsigned int block_ptr[INODE_PTR_COUNT];
+    unsigned int indirect;         // block of PTRS_PER_BLOCK 32-bit pointers
+    unsigned int double_indirect;  // block of pointers to indirect blocks
+    struct extent extents[INODE_EXTENTS];  // instead of the above with EXTENTS_FLAG
+    unsigned char extent_count;
+    unsigned char extent_depth;
+    unsigned char inline_data[INLINE_DATA_SIZE];  // instead of all the above with INLINE_FLAG
 
     unsigned int ref_count;  // in-core only
     unsigned int inode_num;
+    int cached;              // in-core only: holds inode_num's contents
+    int dirty;               // in-core only: changed since it was read or written
+    struct inode *hash_next;
+    struct inode *lru_prev;  // unreferenced inodes, least recently used first
+    struct inode *lru_next;
+    unsigned int map_version; // in-core only: bumped when extents move between blocks
+    unsigned int data_version; // in-core only: bumped when data blocks are written
+    int loading;             // in-core only: still being read in by iget
+    pthread_mutex_t lock;    // in-core only: see ilock
+};
+
+// One filesystem's in-core inode table (see simfs.h). It grows in chunks
+// so inode pointers handed out by iget stay valid. Slots are indexed by a
+// hash on inode_num; the ones with no references sit on an LRU list,
+// least recently used first, and keep their contents until the slot is
+// reused.
+struct incore_table {
+    struct inode *chunks[MAX_INCORE_CHUNKS];
+    int chunk_sizes[MAX_INCORE_CHUNKS];
+    int chunk_count;
+    int capacity;
+    struct inode **hash;
+    unsigned int hash_mask;
+    struct inode lru;  // sentinel: lru_next is the least recently used
+
+    // Guards the table itself: the hash, the LRU list, reference counts
+    // and which inode each slot holds. An inode's contents are guarded by
+    // its own lock instead (see ilock). iget reads an inode in without
+    // holding it; others after the same inode wait until it is no longer
+    // loading. Recursive.
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;  // signalled when an inode being read in by iget is ready
+};
+
+// The pointer block bmap_cached looked at last, held in the block cache
+// so walking a file in order looks each pointer block up once
+struct bmap_cursor {
+    int block_num;       // 0 when empty
+    int first;           // logical blocks [first, end) are mapped through it
+    int end;
+    unsigned int version;
+    unsigned char *data;
 };
 
 #endif
@@ -0,0 +1,344 @@
+#define _GNU_SOURCE
+#include "journal.h"
+#include "block.h"
+#include "bcache.h"
+#include "disk.h"
+#include "image.h"
+#include "inode.h"
+#include "super.h"
+#include "checksum.h"
+#include "pack.h"
+#include "simfs.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// This thread's filesystem's journal
+#define journal (simfs_current->journal)
+
+// FNV-1a over 32-bit words; only has to catch a commit record that made
+// it to disk without the blocks before it
+static unsigned int checksum(unsigned int hash, unsigned char *data, int nbytes)
+{
+    for (int i = 0; i < nbytes; i += 4)
+    {
+        unsigned int word;
+        memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word) * 16777619u;
+    }
+    return hash;
+}
+
+static int write_header(unsigned int header_seq, int start)
+{
+    unsigned char block[BLOCK_SIZE] = { 0 };
+
+    write_u32(block + JH_MAGIC_OFFSET, JOURNAL_MAGIC);
+    write_u32(block + JH_SEQ_OFFSET, header_seq);
+    write_u32(block + JH_START_OFFSET, start);
+    if (disk_write(sb.journal_start, block) == -1 || fdatasync(image_fd) == -1)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+static void set_record(unsigned char *block, unsigned int magic, unsigned int record_seq, int count)
+{
+    memset(block, 0, BLOCK_SIZE);
+    write_u32(block + JD_MAGIC_OFFSET, magic);
+    write_u32(block + JD_SEQ_OFFSET, record_seq);
+    write_u32(block + JD_COUNT_OFFSET, count);
+}
+
+// Replays the transaction at journal block pos if it is the one expected
+// and committed in full. Returns its length in blocks, or 0.
+static int replay_one(int pos, unsigned int expect_seq)
+{
+    unsigned char desc[BLOCK_SIZE];
+    unsigned char commit[BLOCK_SIZE];
+
+    if (pos + 2 > (int)sb.journal_blocks || disk_read(sb.journal_start + pos, desc) == -1)
+    {
+        return 0;
+    }
+    int count = read_u32(desc + JD_COUNT_OFFSET);
+    if (read_u32(desc + JD_MAGIC_OFFSET) != JOURNAL_DESC_MAGIC || read_u32(desc + JD_SEQ_OFFSET) != expect_seq ||
+        count <= 0 || count > JD_MAX_BLOCKS || pos + count + 2 > (int)sb.journal_blocks)
+    {
+        return 0;
+    }
+
+    unsigned char *copies = malloc((size_t)count * BLOCK_SIZE);
+    for (int i = 0; i <= count; i++)
+    {
+        unsigned char *dest = i < count ? copies + (size_t)i * BLOCK_SIZE : commit;
+        if (disk_read(sb.journal_start + pos + 1 + i, dest) == -1)
+        {
+            free(copies);
+            return 0;
+        }
+    }
+    unsigned int sum = checksum(checksum(2166136261u, desc, BLOCK_SIZE), copies, count * BLOCK_SIZE);
+    if (read_u32(commit + JD_MAGIC_OFFSET) != JOURNAL_COMMIT_MAGIC || read_u32(commit + JD_SEQ_OFFSET) != expect_seq ||
+        (int)read_u32(commit + JD_COUNT_OFFSET) != count || read_u32(commit + JD_CHECKSUM_OFFSET) != sum)
+    {
+        free(copies);
+        return 0;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        if (disk_write(read_u32(desc + JD_BLOCKS_OFFSET + i * 4), copies + (size_t)i * BLOCK_SIZE) == -1)
+        {
+            free(copies);
+            return 0;
+        }
+    }
+    free(copies);
+    return count + 2;
+}
+
+// Sets up the journal of a freshly formatted image
+int journal_format(void)
+{
+    journal_unload();
+    if (!(sb.features & FEATURE_JOURNAL))
+    {
+        return 0;
+    }
+    journal.seq = 1;
+    journal.head = 1;
+    if (write_header(journal.seq, journal.head) == -1)
+    {
+        return -1;
+    }
+    journal.active = 1;
+    return 0;
+}
+
+// Replays whatever the journal of the image just opened holds, straight
+// to the image, and starts a fresh log. Called before anything of the
+// image is cached.
+int journal_load(void)
+{
+    unsigned char header[BLOCK_SIZE];
+
+    journal_unload();
+    if (!(sb.features & FEATURE_JOURNAL))
+    {
+        return 0;
+    }
+    if (disk_read(sb.journal_start, header) == -1 || read_u32(header + JH_MAGIC_OFFSET) != JOURNAL_MAGIC)
+    {
+        return -1;
+    }
+
+    journal.seq = read_u32(header + JH_SEQ_OFFSET);
+    int pos = read_u32(header + JH_START_OFFSET);
+    int replayed = 0;
+    for (int len; (len = replay_one(pos, journal.seq)) > 0; pos += len)
+    {
+        journal.seq++;
+        replayed++;
+    }
+    journal.stats.replayed += replayed;
+
+    // The replayed blocks, and their checksums, have to be home before the
+    // log is reused
+    if (replayed > 0 && (checksum_flush() == -1 || fdatasync(image_fd) == -1))
+    {
+        return -1;
+    }
+    journal.head = 1;
+    if (write_header(journal.seq, journal.head) == -1)
+    {
+        return -1;
+    }
+    journal.active = 1;
+    return 0;
+}
+
+// Forgets the running transaction, e.g. because the cache holding it was
+// thrown away
+void journal_unload(void)
+{
+    bcache_lock();
+    journal.active = 0;
+    journal.depth = 0;
+    journal.tx_count = 0;
+    bcache_unlock();
+}
+
+int journal_active(void)
+{
+    return journal.active;
+}
+
+// Brackets one operation: a transaction that grew past
+// JOURNAL_COMMIT_BLOCKS commits once no operation is in progress on any
+// thread, so every operation lands in a single commit. Calls nest.
+void journal_begin(void)
+{
+    bcache_lock();
+    journal.depth++;
+    bcache_unlock();
+}
+
+void journal_end(void)
+{
+    bcache_lock();
+    if (journal.depth > 0)
+    {
+        journal.depth--;
+    }
+    int commit = journal.depth == 0 && journal.tx_count >= JOURNAL_COMMIT_BLOCKS && !journal.committing;
+    if (commit)
+    {
+        journal.committing = 1;
+    }
+    bcache_unlock();
+
+    if (commit)
+    {
+        // Inodes changed by the operation join the transaction too
+        inode_sync();
+        journal_commit();
+        bcache_lock();
+        journal.committing = 0;
+        bcache_unlock();
+    }
+}
+
+// Adds a dirty cached block to the running transaction
+void journal_add(int block_num)
+{
+    if (!journal.active || image_map != NULL)
+    {
+        return;
+    }
+    bcache_lock();
+    if (bcache_journal(block_num) == 1)
+    {
+        journal.tx_blocks[journal.tx_count++] = block_num;
+    }
+    bcache_unlock();
+}
+
+int journal_pending(void)
+{
+    bcache_lock();
+    int count = journal.tx_count;
+    bcache_unlock();
+    return count;
+}
+
+// Everything committed so far goes home, with its checksums, before the
+// log is overwritten
+static int checkpoint(void)
+{
+    if (bcache_flush() == -1 || checksum_flush() == -1 || fdatasync(image_fd) == -1)
+    {
+        return -1;
+    }
+    journal.head = 1;
+    if (write_header(journal.seq, journal.head) == -1)
+    {
+        return -1;
+    }
+    journal.stats.checkpoints++;
+    return 0;
+}
+
+static int commit_locked(void)
+{
+    unsigned char desc[BLOCK_SIZE];
+    unsigned char commit[BLOCK_SIZE];
+    struct iovec iov[BCACHE_BLOCKS + 2];
+
+    if (!journal.active || journal.tx_count == 0)
+    {
+        return 0;
+    }
+    if (journal.head + journal.tx_count + 2 > (int)sb.journal_blocks && checkpoint() == -1)
+    {
+        return -1;
+    }
+
+    set_record(desc, JOURNAL_DESC_MAGIC, journal.seq, journal.tx_count);
+    iov[0].iov_base = desc;
+    iov[0].iov_len = BLOCK_SIZE;
+    for (int i = 0; i < journal.tx_count; i++)
+    {
+        unsigned char *data = bcache_peek(journal.tx_blocks[i]);
+        if (data == NULL)
+        {
+            return -1;
+        }
+        memcpy(journal.tx_copies[i], data, BLOCK_SIZE);
+        write_u32(desc + JD_BLOCKS_OFFSET + i * 4, journal.tx_blocks[i]);
+        iov[1 + i].iov_base = journal.tx_copies[i];
+        iov[1 + i].iov_len = BLOCK_SIZE;
+    }
+    unsigned int sum = checksum(2166136261u, desc, BLOCK_SIZE);
+    for (int i = 0; i < journal.tx_count; i++)
+    {
+        sum = checksum(sum, iov[1 + i].iov_base, BLOCK_SIZE);
+    }
+    set_record(commit, JOURNAL_COMMIT_MAGIC, journal.seq, journal.tx_count);
+    write_u32(commit + JD_CHECKSUM_OFFSET, sum);
+    iov[1 + journal.tx_count].iov_base = commit;
+    iov[1 + journal.tx_count].iov_len = BLOCK_SIZE;
+
+    if (disk_writev(sb.journal_start + journal.head, iov, journal.tx_count + 2) == -1 || fdatasync(image_fd) == -1)
+    {
+        return -1;
+    }
+
+    for (int i = 0; i < journal.tx_count; i++)
+    {
+        bcache_unjournal(journal.tx_blocks[i]);
+    }
+    int count = journal.tx_count;
+    journal.head += journal.tx_count + 2;
+    journal.seq++;
+    journal.tx_count = 0;
+    journal.stats.commits++;
+    journal.stats.blocks += count;
+    return count;
+}
+
+// Writes the running transaction to the log with one write and one
+// fsync, after which its blocks may go home. Returns the number of blocks
+// committed or -1 on error.
+int journal_commit(void)
+{
+    bcache_lock();
+    int result = commit_locked();
+    bcache_unlock();
+    return result;
+}
+
+// journal_commit for the background flusher, which must not split an
+// operation across commits: does nothing while one is in progress
+int journal_commit_idle(void)
+{
+    bcache_lock();
+    int result = journal.depth > 0 || journal.committing ? 0 : commit_locked();
+    bcache_unlock();
+    return result;
+}
+
+void journal_get_stats(struct journal_stats *s)
+{
+    bcache_lock();
+    *s = journal.stats;
+    bcache_unlock();
+}
+
+void journal_reset_stats(void)
+{
+    bcache_lock();
+    memset(&journal.stats, 0, sizeof(journal.stats));
+    bcache_unlock();
+}
@@ -0,0 +1,78 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+// Write-ahead journal for metadata, on images formatted with
+// FEATURE_JOURNAL. Blocks dirtied through bdirty or bwrite_meta join the
+// running transaction and stay in the block cache until it commits: a
+// descriptor listing their home blocks, copies of them and a commit
+// record are appended to the journal area with one write and one fsync.
+// Only then may the cache write them home. image_open replays every
+// committed transaction, so an operation is either all there or not at
+// all. Data blocks are not journaled, and neither are mmap images, whose
+// pages the kernel writes back on its own schedule.
+//
+// Journal block 0 is a header giving where the live log starts and the
+// sequence number expected there; the log follows it and is reused from
+// the start once full, after everything in it is home.
+
+#include "bcache.h"
+
+#define JOURNAL_MAGIC 0x4a524e4c         // "JRNL"
+#define JOURNAL_DESC_MAGIC 0x4a444553    // "JDES"
+#define JOURNAL_COMMIT_MAGIC 0x4a434d54  // "JCMT"
+
+#define JOURNAL_BLOCKS_DEFAULT 1024
+#define JOURNAL_MIN_BLOCKS 160
+#define JOURNAL_COMMIT_BLOCKS 64  // a transaction this large commits at the next operation boundary
+
+// Header block
+#define JH_MAGIC_OFFSET 0
+#define JH_SEQ_OFFSET 4
+#define JH_START_OFFSET 8
+
+// Descriptor and commit blocks
+#define JD_MAGIC_OFFSET 0
+#define JD_SEQ_OFFSET 4
+#define JD_COUNT_OFFSET 8
+#define JD_BLOCKS_OFFSET 12  // descriptor: home block numbers, 32 bits each
+#define JD_CHECKSUM_OFFSET 12  // commit: checksum of the descriptor and copies
+#define JD_MAX_BLOCKS ((BLOCK_SIZE - JD_BLOCKS_OFFSET) / 4)
+
+struct journal_stats {
+    unsigned long commits;
+    unsigned long blocks;      // block copies written to the log
+    unsigned long checkpoints; // times the log filled and was reused
+    unsigned long replayed;    // transactions replayed by image_open
+};
+
+// One filesystem's journal (see simfs.h), guarded by its cache's lock,
+// which is also what keeps journaled buffers in place
+struct journal_state {
+    int active;
+    int depth;                    // journal_begin calls not yet ended
+    int committing;
+    unsigned int seq;             // sequence number of the next commit
+    int head;                     // journal block the next commit goes in
+    int tx_blocks[BCACHE_BLOCKS]; // home blocks in the running transaction
+    int tx_count;
+    struct journal_stats stats;
+
+    // What is committed, copied out of the cache so blocks changed in
+    // place by other threads cannot tear the record
+    unsigned char tx_copies[BCACHE_BLOCKS][BLOCK_SIZE];
+};
+
+int journal_format(void);
+int journal_load(void);
+void journal_unload(void);
+int journal_active(void);
+void journal_begin(void);
+void journal_end(void);
+void journal_add(int block_num);
+int journal_commit(void);
+int journal_commit_idle(void);
+int journal_pending(void);
+void journal_get_stats(struct journal_stats *stats);
+void journal_reset_stats(void);
+
+#endif
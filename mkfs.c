@@ -3,45 +3,147 @@
 #include "image.h"
 #include "inode.h"
 #include "pack.h"
+#include "free.h"
+#include "super.h"
+#include "bitmap.h"
 #include "ls.h"
+#include "namei.h"
+#include "journal.h"
+#include "checksum.h"
+#include "simfs.h"
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
 
-void initialize_blocks(void)
+int initialize_blocks(void)
 {
-    unsigned char zero_block[BLOCK_SIZE * NUMBER_OF_BLOCKS] = { 0 };
-    write(image_fd, zero_block, BLOCK_SIZE * NUMBER_OF_BLOCKS);
+    int map_blocks = (sb.data_start + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+    unsigned char *block_map = calloc(map_blocks, BLOCK_SIZE);
 
-    for (int i = 0; i < 7; i++)
+    // Every block starts out as a sparse zero block
+    if (image_zero(sb.block_count) == -1 || super_write() == -1)
     {
-        alloc();
+        free(block_map);
+        return -1;
     }
+
+    // Mark the reserved blocks used with one write instead of an alloc() each
+    set_free_range(block_map, 0, sb.data_start, 1);
+    int result = bwrite_many(sb.block_map_start, map_blocks, block_map);
+    free(block_map);
+    return result;
 }
 
-struct inode *create_root_directory(void)
+// Allocates a directory holding just "." and "..". parent_num is the
+// directory it goes in, or -1 for the root, which is its own parent. With
+// FEATURE_INLINE_DATA it starts out inline, without a block.
+struct inode *create_directory(int parent_num)
 {
-    struct inode *root_inode = ialloc();
-    int root_block_num = alloc();
-    root_inode->flags = DIR_FLAG;
-    root_inode->size = DIR_START_SIZE;
-    root_inode->block_ptr[0] = root_block_num;
-
+    struct inode *dir_inode = ialloc();
+    if (dir_inode == NULL)
+    {
+        return NULL;
+    }
+    if (parent_num == -1)
+    {
+        parent_num = dir_inode->inode_num;
+    }
+    if (sb.features & FEATURE_INLINE_DATA)
+    {
+        ilock(dir_inode);
+        dir_inode->flags = DIR_FLAG | INLINE_FLAG;
+        dir_inode->size = DIR_INLINE_START_SIZE;
+        write_u16(dir_inode->inline_data + DIR_INLINE_PARENT_OFFSET, parent_num);
+        idirty(dir_inode);
+        iunlock(dir_inode);
+        return dir_inode;
+    }
     unsigned char block[BLOCK_SIZE] = { 0 };
-    write_u16(block, root_inode->inode_num);
-    strcpy((char *)(block + FILENAME_OFFSET), ".");
-    write_u16(block + DIR_ENTRY_SIZE, root_inode->inode_num);
-    strcpy((char *)(block + DIR_ENTRY_SIZE + FILENAME_OFFSET), "..");
-    bwrite(root_block_num, block);
+    struct directory_entry self = { dir_inode->inode_num, "." };
+    struct directory_entry parent = { parent_num, ".." };
+    dirent_encode(block, &self);
+    dirent_encode(block + DIR_ENTRY_SIZE, &parent);
 
-    return root_inode;
+    // Neither the inode nor the block is kept unless both can be had
+    int block_num = alloc();
+    if (block_num == -1 || bwrite_meta(block_num, block) == -1)
+    {
+        if (block_num != -1)
+        {
+            bitmap_release(&block_bitmap, block_num);
+        }
+        int inode_num = dir_inode->inode_num;
+        iput(dir_inode);
+        bitmap_release(&inode_bitmap, inode_num);
+        return NULL;
+    }
+    ilock(dir_inode);
+    dir_inode->flags = DIR_FLAG;
+    dir_inode->size = DIR_START_SIZE;
+    dir_inode->block_ptr[0] = block_num;
+    idirty(dir_inode);
+    iunlock(dir_inode);
+    return dir_inode;
 }
 
-void mkfs(void)
+// Formats the open image with the geometry in params. A zero field takes
+// its default. Returns -1 if the geometry does not fit.
+int mkfs_format(const struct mkfs_params *params)
 {
-    initialize_blocks();
-    struct inode *root_inode = create_root_directory();
+    struct superblock layout;
+    int block_count = params->block_count ? params->block_count : NUMBER_OF_BLOCKS;
+
+    if (super_layout(&layout, block_count, params->inode_count, params->features) == -1)
+    {
+        return -1;
+    }
+    // Whatever the old filesystem had pending is about to be zeroed
+    journal_unload();
+    sb = layout;
+    bitmap_reset();
+    if (checksum_format() == -1 || initialize_blocks() == -1)
+    {
+        return -1;
+    }
+    // A journal only helps once the format it describes is on disk
+    if ((sb.features & FEATURE_JOURNAL) && bsync() == -1)
+    {
+        return -1;
+    }
+    if (journal_format() == -1)
+    {
+        return -1;
+    }
+
+    dcache_clear();
+    struct inode *root_inode = create_directory(-1);
+    if (root_inode == NULL)
+    {
+        return -1;
+    }
     iput(root_inode);
+    return 0;
+}
+
+void mkfs(void)
+{
+    struct mkfs_params params = { 0 };
+    mkfs_format(&params);
+}
+
+// Decodes the 32-byte entry at raw in one pass
+void dirent_decode(unsigned char *raw, struct directory_entry *ent)
+{
+    ent->inode_num = read_u16(raw);
+    memcpy(ent->name, raw + FILENAME_OFFSET, DIR_NAME_MAX);
+    ent->name[DIR_NAME_MAX] = '\0';
+}
+
+void dirent_encode(unsigned char *raw, const struct directory_entry *ent)
+{
+    memset(raw, 0, DIR_ENTRY_SIZE);
+    write_u16(raw, ent->inode_num);
+    memcpy(raw + FILENAME_OFFSET, ent->name, strnlen(ent->name, DIR_NAME_MAX));
 }
 
 struct directory *directory_open(int inode_num)
@@ -53,36 +155,574 @@ struct directory *directory_open(int inode_num)
     }
 
     struct directory *dir = malloc(sizeof(struct directory));
+    if (dir == NULL)
+    {
+        iput(dir_inode);
+        return NULL;
+    }
     dir->inode = dir_inode;
     dir->offset = 0;
+    dir->cursor.block_num = 0;
+    readahead_init(&dir->ra);
     return dir;
 }
 
-int directory_get(struct directory *dir, struct directory_entry *ent)
+// Decodes the packed entry at offset in an inline directory and returns
+// the offset of the next one
+int dirent_inline_decode(struct inode *dir_inode, unsigned int offset, struct directory_entry *ent)
+{
+    unsigned char *raw = dir_inode->inline_data + offset;
+    int len = offset + DIR_INLINE_HEADER <= dir_inode->size ? raw[2] : 0;
+
+    // A damaged length ends the directory rather than run past it
+    if (len > DIR_NAME_MAX || offset + DIR_INLINE_HEADER + len > dir_inode->size)
+    {
+        ent->inode_num = 0;
+        ent->name[0] = '\0';
+        return dir_inode->size;
+    }
+    ent->inode_num = read_u16(raw);
+    memcpy(ent->name, raw + DIR_INLINE_HEADER, len);
+    ent->name[len] = '\0';
+    return offset + DIR_INLINE_HEADER + len;
+}
+
+static int inline_parent(struct inode *dir_inode)
 {
-    unsigned char block[BLOCK_SIZE];
+    return read_u16(dir_inode->inline_data + DIR_INLINE_PARENT_OFFSET);
+}
+
+static int get_inline(struct directory *dir, struct directory_entry *ent)
+{
+    struct inode *dir_inode = dir->inode;
 
+    do
+    {
+        if (dir->offset >= dir_inode->size)
+        {
+            return -1;
+        }
+        if (dir->offset < DIR_INLINE_START_SIZE)
+        {
+            ent->inode_num = dir->offset == 0 ? (int)dir_inode->inode_num : inline_parent(dir_inode);
+            strcpy(ent->name, dir->offset == 0 ? "." : "..");
+            dir->offset++;
+            return 1;
+        }
+        dir->offset = dirent_inline_decode(dir_inode, dir->offset, ent);
+    } while (ent->name[0] == '\0');
+    return 1;
+}
+
+static int get_locked(struct directory *dir, struct directory_entry *ent)
+{
     struct inode *dir_inode = dir->inode;
     int dir_size = dir_inode->size;
-    if ((int)dir->offset >= dir_size)
+
+    if (dir_inode->flags & INLINE_FLAG)
     {
-        return -1;
+        return get_inline(dir, ent);
     }
 
-    int data_block_index = dir->offset / BLOCK_SIZE;
-    int data_block_num = dir_inode->block_ptr[data_block_index];
-    bread(data_block_num, block);
+    // Slots with no name are free space in a hashed directory
+    do
+    {
+        if ((int)dir->offset >= dir_size)
+        {
+            return -1;
+        }
+
+        // Entries come out of the readahead window, not a bread each
+        int data_block_index = dir->offset / BLOCK_SIZE;
+        unsigned char *block = readahead_block(&dir->ra, dir_inode, &dir->cursor, data_block_index);
+        if (block == NULL)
+        {
+            return -1;
+        }
 
-    int offset_in_block = dir->offset % BLOCK_SIZE;
-    ent->inode_num = read_u16(block + offset_in_block);
-    strcpy(ent->name, (char *)(block + offset_in_block + FILENAME_OFFSET));
+        dirent_decode(block + dir->offset % BLOCK_SIZE, ent);
 
-    dir->offset += DIR_ENTRY_SIZE;
+        dir->offset += DIR_ENTRY_SIZE;
+    } while (ent->name[0] == '\0');
     return 1;
 }
 
+// Directories are read and changed under their inode's lock, like files
+int directory_get(struct directory *dir, struct directory_entry *ent)
+{
+    ilock(dir->inode);
+    int result = get_locked(dir, ent);
+    iunlock(dir->inode);
+    return result;
+}
+
+// FNV-1a
+static unsigned int dir_hash(const char *name)
+{
+    unsigned int hash = 2166136261u;
+    for (; *name != '\0'; name++)
+    {
+        hash = (hash ^ (unsigned char)*name) * 16777619u;
+    }
+    return hash;
+}
+
+static int dir_buckets(struct inode *dir_inode)
+{
+    return dir_inode->size / BLOCK_SIZE - 1;
+}
+
+static void dir_put_entry(unsigned char *slot, const char *name, int inode_num)
+{
+    struct directory_entry ent;
+    ent.inode_num = inode_num;
+    strcpy(ent.name, name);
+    dirent_encode(slot, &ent);
+}
+
+// Looks for name among the entries of one block. Returns its inode
+// number, or -1 with *has_free set if the block has an empty slot.
+static int block_lookup(unsigned char *block, int entries, const char *name, int *has_free)
+{
+    *has_free = 0;
+    for (int i = 0; i < entries; i++)
+    {
+        unsigned char *slot = block + i * DIR_ENTRY_SIZE;
+        char *slot_name = (char *)(slot + FILENAME_OFFSET);
+        if (slot_name[0] == '\0')
+        {
+            *has_free = 1;
+        }
+        else if (strcmp(slot_name, name) == 0)
+        {
+            return read_u16(slot);
+        }
+    }
+    return -1;
+}
+
+// Places name in the first bucket of its probe sequence with room, in
+// buckets held in memory. Returns -1 if they are all full.
+static int buckets_insert(unsigned char *buckets, int bucket_count, const char *name, int inode_num)
+{
+    unsigned int hash = dir_hash(name);
+    for (int p = 0; p < DIR_MAX_PROBE && p < bucket_count; p++)
+    {
+        unsigned char *block = buckets + (size_t)((hash + p) & (bucket_count - 1)) * BLOCK_SIZE;
+        for (int i = 0; i < DIR_ENTRIES_PER_BLOCK; i++)
+        {
+            unsigned char *slot = block + i * DIR_ENTRY_SIZE;
+            if (slot[FILENAME_OFFSET] == '\0')
+            {
+                dir_put_entry(slot, name, inode_num);
+                return 0;
+            }
+        }
+    }
+    return -1;
+}
+
+// Spreads the entries of old (all but "." and "..") over at least
+// *bucket_count buckets, doubling until every entry finds a place
+static unsigned char *build_buckets(unsigned char *old, int old_blocks, int hashed, int *bucket_count)
+{
+    for (;;)
+    {
+        unsigned char *buckets = calloc(*bucket_count, BLOCK_SIZE);
+        int placed = 1;
+
+        for (int e = hashed ? DIR_ENTRIES_PER_BLOCK : 2; e < old_blocks * DIR_ENTRIES_PER_BLOCK && placed; e++)
+        {
+            unsigned char *slot = old + (size_t)e * DIR_ENTRY_SIZE;
+            char *name = (char *)(slot + FILENAME_OFFSET);
+            if (name[0] != '\0')
+            {
+                placed = buckets_insert(buckets, *bucket_count, name, read_u16(slot)) == 0;
+            }
+        }
+        if (placed)
+        {
+            return buckets;
+        }
+        free(buckets);
+        *bucket_count *= 2;
+    }
+}
+
+// Writes block 0, now holding only "." and "..", and the buckets
+static int write_buckets(struct inode *dir_inode, unsigned char *first_block, int old_blocks, unsigned char *buckets, int bucket_count)
+{
+    memset(first_block + 2 * DIR_ENTRY_SIZE, 0, BLOCK_SIZE - 2 * DIR_ENTRY_SIZE);
+    if (1 + bucket_count > old_blocks && inode_add_blocks(dir_inode, old_blocks, 1 + bucket_count - old_blocks) == -1)
+    {
+        return -1;
+    }
+    if (bwrite_meta(bmap(dir_inode, 0), first_block) == -1)
+    {
+        return -1;
+    }
+    for (int b = 0; b < bucket_count; b++)
+    {
+        if (bwrite_meta(bmap(dir_inode, 1 + b), buckets + (size_t)b * BLOCK_SIZE) == -1)
+        {
+            return -1;
+        }
+    }
+
+    dir_inode->flags |= DIR_HASHED_FLAG;
+    dir_inode->size = (1 + bucket_count) * BLOCK_SIZE;
+    idirty(dir_inode);
+    dir_inode->data_version++;
+    return 0;
+}
+
+// Rebuilds a full linear directory, or a hashed one with an overflowing
+// probe sequence, as a hashed directory of at least bucket_count buckets
+static int dir_rehash(struct inode *dir_inode, int bucket_count)
+{
+    int old_blocks = dir_inode->size / BLOCK_SIZE;
+    unsigned char *old = malloc((size_t)old_blocks * BLOCK_SIZE);
+    int result = 0;
+
+    for (int b = 0; b < old_blocks && result == 0; b++)
+    {
+        if (bread(bmap(dir_inode, b), old + (size_t)b * BLOCK_SIZE) == NULL)
+        {
+            result = -1;
+        }
+    }
+    if (result == 0)
+    {
+        unsigned char *buckets = build_buckets(old, old_blocks, dir_inode->flags & DIR_HASHED_FLAG, &bucket_count);
+        result = write_buckets(dir_inode, old, old_blocks, buckets, bucket_count);
+        free(buckets);
+    }
+    free(old);
+    return result;
+}
+
+// Rebuilds the buckets of hashed directory inode_num in place, e.g. once
+// fsck has emptied slots an insert may have probed past
+int directory_rehash(int inode_num)
+{
+    struct inode *dir_inode = iget(inode_num);
+    if (dir_inode == NULL)
+    {
+        return -1;
+    }
+    ilock(dir_inode);
+    int result = 0;
+    if (dir_inode->flags & DIR_HASHED_FLAG)
+    {
+        journal_begin();
+        result = dir_rehash(dir_inode, dir_buckets(dir_inode));
+        journal_end();
+    }
+    iunlock(dir_inode);
+    iput(dir_inode);
+    return result;
+}
+
+static int hashed_lookup(struct directory *dir, const char *name)
+{
+    struct inode *dir_inode = dir->inode;
+    int bucket_count = dir_buckets(dir_inode);
+    unsigned int hash = dir_hash(name);
+
+    for (int p = 0; p < DIR_MAX_PROBE && p < bucket_count; p++)
+    {
+        int block_num = bmap_cached(dir_inode, 1 + ((hash + p) & (bucket_count - 1)), &dir->cursor);
+        unsigned char *block = bget(block_num);
+        if (block == NULL)
+        {
+            return -1;
+        }
+        int has_free;
+        int inode_num = block_lookup(block, DIR_ENTRIES_PER_BLOCK, name, &has_free);
+        brelse(block_num);
+
+        // Inserts stop at the first bucket with room, so name is not further on
+        if (inode_num != -1 || has_free)
+        {
+            return inode_num;
+        }
+    }
+    return -1;
+}
+
+static int inline_lookup(struct inode *dir_inode, const char *name)
+{
+    struct directory_entry ent;
+
+    if (strcmp(name, ".") == 0)
+    {
+        return dir_inode->inode_num;
+    }
+    if (strcmp(name, "..") == 0)
+    {
+        return inline_parent(dir_inode);
+    }
+    for (unsigned int offset = DIR_INLINE_START_SIZE; offset < dir_inode->size;)
+    {
+        offset = dirent_inline_decode(dir_inode, offset, &ent);
+        if (strcmp(ent.name, name) == 0)
+        {
+            return ent.inode_num;
+        }
+    }
+    return -1;
+}
+
+static int lookup_locked(struct directory *dir, const char *name)
+{
+    struct inode *dir_inode = dir->inode;
+
+    if (dir_inode->flags & INLINE_FLAG)
+    {
+        return inline_lookup(dir_inode, name);
+    }
+
+    if (dir_inode->flags & DIR_HASHED_FLAG)
+    {
+        // "." and ".." are the only entries outside the buckets
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        {
+            unsigned char *block = readahead_block(&dir->ra, dir_inode, &dir->cursor, 0);
+            int has_free;
+            return block == NULL ? -1 : block_lookup(block, 2, name, &has_free);
+        }
+        return hashed_lookup(dir, name);
+    }
+
+    int blocks = (dir_inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    for (int b = 0; b < blocks; b++)
+    {
+        unsigned char *block = readahead_block(&dir->ra, dir_inode, &dir->cursor, b);
+        if (block == NULL)
+        {
+            return -1;
+        }
+        int entries = dir_inode->size - b * BLOCK_SIZE < BLOCK_SIZE ? (int)(dir_inode->size - b * BLOCK_SIZE) / DIR_ENTRY_SIZE : DIR_ENTRIES_PER_BLOCK;
+        int has_free;
+        int inode_num = block_lookup(block, entries, name, &has_free);
+        if (inode_num != -1)
+        {
+            return inode_num;
+        }
+    }
+    return -1;
+}
+
+// Returns the inode number name refers to in dir, or -1 if there is none
+int directory_lookup(struct directory *dir, const char *name)
+{
+    ilock(dir->inode);
+    int result = lookup_locked(dir, name);
+    iunlock(dir->inode);
+    return result;
+}
+
+static int hashed_add(struct directory *dir, const char *name, int inode_num)
+{
+    struct inode *dir_inode = dir->inode;
+    int bucket_count = dir_buckets(dir_inode);
+    unsigned int hash = dir_hash(name);
+
+    for (int p = 0; p < DIR_MAX_PROBE && p < bucket_count; p++)
+    {
+        int block_num = bmap_cached(dir_inode, 1 + ((hash + p) & (bucket_count - 1)), &dir->cursor);
+        unsigned char *block = bget(block_num);
+        if (block == NULL)
+        {
+            return -1;
+        }
+        for (int i = 0; i < DIR_ENTRIES_PER_BLOCK; i++)
+        {
+            unsigned char *slot = block + i * DIR_ENTRY_SIZE;
+            if (slot[FILENAME_OFFSET] == '\0')
+            {
+                dir_put_entry(slot, name, inode_num);
+                bdirty(block_num);
+                brelse(block_num);
+                dir_inode->data_version++;
+                return 0;
+            }
+        }
+        brelse(block_num);
+    }
+
+    // Every bucket it may go in is full
+    if (dir_rehash(dir_inode, bucket_count * 2) == -1)
+    {
+        return -1;
+    }
+    return hashed_add(dir, name, inode_num);
+}
+
+// Appends to an inline directory. Returns 1, changing nothing, if the
+// entry does not fit.
+static int inline_add(struct inode *dir_inode, const char *name, int inode_num)
+{
+    int len = strlen(name);
+    if (dir_inode->size + DIR_INLINE_HEADER + len > INLINE_DATA_SIZE)
+    {
+        return 1;
+    }
+
+    unsigned char *raw = dir_inode->inline_data + dir_inode->size;
+    write_u16(raw, inode_num);
+    raw[2] = len;
+    memcpy(raw + DIR_INLINE_HEADER, name, len);
+    dir_inode->size += DIR_INLINE_HEADER + len;
+    idirty(dir_inode);
+    dir_inode->data_version++;
+    return 0;
+}
+
+// Moves an inline directory's entries out to a block of ordinary ones
+static int dir_uninline(struct inode *dir_inode)
+{
+    unsigned char block[BLOCK_SIZE] = { 0 };
+    struct directory_entry ent;
+    int entries = 2;
+
+    dir_put_entry(block, ".", dir_inode->inode_num);
+    dir_put_entry(block + DIR_ENTRY_SIZE, "..", inline_parent(dir_inode));
+    for (unsigned int offset = DIR_INLINE_START_SIZE; offset < dir_inode->size;)
+    {
+        offset = dirent_inline_decode(dir_inode, offset, &ent);
+        if (ent.name[0] != '\0')
+        {
+            dirent_encode(block + entries++ * DIR_ENTRY_SIZE, &ent);
+        }
+    }
+
+    dir_inode->flags &= ~INLINE_FLAG;
+    if (inode_add_blocks(dir_inode, 0, 1) == -1)
+    {
+        dir_inode->flags |= INLINE_FLAG;
+        return -1;
+    }
+    int block_num = bmap(dir_inode, 0);
+    if (bwrite_meta(block_num, block) == -1)
+    {
+        // Back inline, its entries untouched, without the block
+        bitmap_release(&block_bitmap, block_num);
+        memset(dir_inode->block_ptr, 0, sizeof(dir_inode->block_ptr));
+        dir_inode->extent_count = 0;
+        dir_inode->flags |= INLINE_FLAG;
+        return -1;
+    }
+    dir_inode->size = entries * DIR_ENTRY_SIZE;
+    idirty(dir_inode);
+    dir_inode->data_version++;
+    return 0;
+}
+
+// A linear directory appends, switching to hashed rather than growing
+// past its first block when the filesystem allows. An inline one appends
+// in its inode until it is full, then moves to a block.
+static int linear_add(struct directory *dir, const char *name, int inode_num)
+{
+    struct inode *dir_inode = dir->inode;
+
+    if (dir_inode->flags & INLINE_FLAG)
+    {
+        int result = inline_add(dir_inode, name, inode_num);
+        if (result != 1)
+        {
+            return result;
+        }
+        if (dir_uninline(dir_inode) == -1)
+        {
+            return -1;
+        }
+    }
+
+    if (dir_inode->size % BLOCK_SIZE == 0)
+    {
+        if (sb.features & FEATURE_DIR_INDEX)
+        {
+            if (dir_rehash(dir_inode, DIR_MIN_BUCKETS) == -1)
+            {
+                return -1;
+            }
+            return hashed_add(dir, name, inode_num);
+        }
+        if (inode_add_blocks(dir_inode, dir_inode->size / BLOCK_SIZE, 1) == -1)
+        {
+            return -1;
+        }
+    }
+
+    int block_num = bmap(dir_inode, dir_inode->size / BLOCK_SIZE);
+    unsigned char *block = bget(block_num);
+    if (block == NULL)
+    {
+        return -1;
+    }
+    dir_put_entry(block + dir_inode->size % BLOCK_SIZE, name, inode_num);
+    bdirty(block_num);
+    brelse(block_num);
+    dir_inode->size += DIR_ENTRY_SIZE;
+    idirty(dir_inode);
+    dir_inode->data_version++;
+    return 0;
+}
+
+// Counts a new entry naming inode_num in its link_count, which counts
+// the entries naming an inode other than "." and "..". The directory is
+// locked; it is always taken before the inodes it names.
+static void count_link(int inode_num)
+{
+    struct inode *in = iget(inode_num);
+    if (in == NULL)
+    {
+        return;
+    }
+    ilock(in);
+    if (in->link_count < 0xff)
+    {
+        in->link_count++;
+        idirty(in);
+    }
+    iunlock(in);
+    iput(in);
+}
+
+// Adds an entry for name, which must not be in dir already
+int directory_add(struct directory *dir, const char *name, int inode_num)
+{
+    if (name[0] == '\0' || strlen(name) > DIR_NAME_MAX)
+    {
+        return -1;
+    }
+
+    ilock(dir->inode);
+    int result = -1;
+    if (lookup_locked(dir, name) == -1)
+    {
+        journal_begin();
+        result = (dir->inode->flags & DIR_HASHED_FLAG) ? hashed_add(dir, name, inode_num) : linear_add(dir, name, inode_num);
+        if (result == 0)
+        {
+            count_link(inode_num);
+        }
+        journal_end();
+    }
+    if (result == 0)
+    {
+        // Replaces a cached negative lookup of the name
+        dcache_insert(dir->inode->inode_num, name, inode_num);
+    }
+    iunlock(dir->inode);
+    return result;
+}
+
 void directory_close(struct directory *dir)
 {
+    readahead_free(&dir->ra);
+    bmap_release(&dir->cursor);
     iput(dir->inode);
     free(dir);
 }
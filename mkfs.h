@@ -1,6 +1,9 @@
 #ifndef MKFS_H
 #define MKFS_H
 
+#include "inode.h"
+#include "readahead.h"
+
 #define FILENAME_OFFSET 2
 #define DIR_FLAG 2
 #define DIR_ENTRY_SIZE 32
@@ -8,10 +11,36 @@
 #define NUMBER_OF_BLOCKS 1024
 #define DIR_START_SIZE (DIR_ENTRY_SIZE * 2)
 #define FILE_FLAG 1
+#define DIR_NAME_MAX 15
+
+// A hashed directory keeps "." and ".." in block 0 and its other entries
+// in the 2^n bucket blocks after it, starting at the bucket a hash of the
+// name picks and probing up to DIR_MAX_PROBE buckets. The entries are
+// ordinary ones, so directory_get lists it like any other directory.
+#define DIR_HASHED_FLAG 16
+#define DIR_ENTRIES_PER_BLOCK (BLOCK_SIZE / DIR_ENTRY_SIZE)
+#define DIR_MIN_BUCKETS 2
+#define DIR_MAX_PROBE 4
+
+// An inline directory (INLINE_FLAG) packs its entries into the inode: the
+// parent's inode number, then for each entry its inode number, the length
+// of its name and the name. "." is implied and size counts the bytes in
+// use. directory_get still lists "." and ".." first, at offsets 0 and 1.
+#define DIR_INLINE_PARENT_OFFSET 0
+#define DIR_INLINE_START_SIZE 2
+#define DIR_INLINE_HEADER 3
+
+struct mkfs_params {
+    int block_count;    // 0 for NUMBER_OF_BLOCKS
+    int inode_count;    // 0 for one inode per BYTES_PER_INODE_DEFAULT bytes
+    unsigned int features;  // FEATURE_* flags from super.h
+};
 
 struct directory {
     struct inode *inode;
     unsigned int offset;
+    struct bmap_cursor cursor;
+    struct readahead ra;
 };
 
 struct directory_entry {
@@ -19,9 +48,19 @@ struct directory_entry {
     char name[16];
 };
 
+#define ROOT_INODE_NUM 0
+
 void mkfs(void);
+int mkfs_format(const struct mkfs_params *params);
+struct inode *create_directory(int parent_num);
+void dirent_decode(unsigned char *raw, struct directory_entry *ent);
+void dirent_encode(unsigned char *raw, const struct directory_entry *ent);
+int dirent_inline_decode(struct inode *dir_inode, unsigned int offset, struct directory_entry *ent);
 struct directory *directory_open(int inode_num);
 int directory_get(struct directory *dir, struct directory_entry *ent);
+int directory_lookup(struct directory *dir, const char *name);
+int directory_add(struct directory *dir, const char *name, int inode_num);
+int directory_rehash(int inode_num);
 void directory_close(struct directory *dir);
 
 #endif
@@ -0,0 +1,315 @@
+#include "namei.h"
+#include "bitmap.h"
+#include "mkfs.h"
+#include "inode.h"
+#include "file.h"
+#include "journal.h"
+#include "simfs.h"
+#include <pthread.h>
+#include <string.h>
+
+// This thread's filesystem's dentry cache
+#define dcache (simfs_current->dcache)
+
+static unsigned int dentry_hash(int parent_num, const char *name)
+{
+    unsigned int hash = 2166136261u ^ parent_num;
+    for (; *name != '\0'; name++)
+    {
+        hash = (hash ^ (unsigned char)*name) * 16777619u;
+    }
+    return hash % DCACHE_HASH_SIZE;
+}
+
+static void dentry_lru_unlink(struct dentry *d)
+{
+    d->lru_prev->lru_next = d->lru_next;
+    d->lru_next->lru_prev = d->lru_prev;
+}
+
+static void dentry_lru_append(struct dentry *d)
+{
+    d->lru_prev = dcache.lru.lru_prev;
+    d->lru_next = &dcache.lru;
+    dcache.lru.lru_prev->lru_next = d;
+    dcache.lru.lru_prev = d;
+}
+
+static void clear_locked(void)
+{
+    memset(dcache.hash, 0, sizeof(dcache.hash));
+    dcache.lru.lru_prev = dcache.lru.lru_next = &dcache.lru;
+    for (int i = 0; i < DCACHE_SIZE; i++)
+    {
+        dcache.dentries[i].used = 0;
+        dentry_lru_append(&dcache.dentries[i]);
+    }
+    dcache.initialized = 1;
+}
+
+void dcache_clear(void)
+{
+    pthread_mutex_lock(&dcache.lock);
+    clear_locked();
+    pthread_mutex_unlock(&dcache.lock);
+}
+
+static struct dentry *dentry_find(int parent_num, const char *name)
+{
+    if (!dcache.initialized)
+    {
+        clear_locked();
+    }
+    for (struct dentry *d = dcache.hash[dentry_hash(parent_num, name)]; d != NULL; d = d->hash_next)
+    {
+        if (d->parent_num == parent_num && strcmp(d->name, name) == 0)
+        {
+            return d;
+        }
+    }
+    return NULL;
+}
+
+// Returns the cached inode number for name in parent_num, -1 if it is
+// cached as missing, or DCACHE_MISS if nothing is cached
+int dcache_lookup(int parent_num, const char *name)
+{
+    pthread_mutex_lock(&dcache.lock);
+    struct dentry *d = dentry_find(parent_num, name);
+    int inode_num = DCACHE_MISS;
+    if (d != NULL)
+    {
+        dentry_lru_unlink(d);
+        dentry_lru_append(d);
+        inode_num = d->inode_num;
+    }
+    pthread_mutex_unlock(&dcache.lock);
+    return inode_num;
+}
+
+void dcache_insert(int parent_num, const char *name, int inode_num)
+{
+    if (strlen(name) > DIR_NAME_MAX)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&dcache.lock);
+    struct dentry *d = dentry_find(parent_num, name);
+    if (d == NULL)
+    {
+        // Take the least recently used entry, unhashing what it held
+        d = dcache.lru.lru_next;
+        if (d->used)
+        {
+            struct dentry **link = &dcache.hash[dentry_hash(d->parent_num, d->name)];
+            while (*link != d)
+            {
+                link = &(*link)->hash_next;
+            }
+            *link = d->hash_next;
+        }
+
+        unsigned int bucket = dentry_hash(parent_num, name);
+        d->parent_num = parent_num;
+        strcpy(d->name, name);
+        d->used = 1;
+        d->hash_next = dcache.hash[bucket];
+        dcache.hash[bucket] = d;
+    }
+    d->inode_num = inode_num;
+    dentry_lru_unlink(d);
+    dentry_lru_append(d);
+    pthread_mutex_unlock(&dcache.lock);
+}
+
+// Copies the path component starting at path (past any slashes) into
+// name. Returns where the next one starts, or NULL if there is no
+// component or it is too long.
+static const char *next_component(const char *path, char *name)
+{
+    while (*path == '/')
+    {
+        path++;
+    }
+    int len = strcspn(path, "/");
+    if (len == 0 || len > DIR_NAME_MAX)
+    {
+        return NULL;
+    }
+    memcpy(name, path, len);
+    name[len] = '\0';
+    return path + len;
+}
+
+// Looks name up in directory parent_num, through the dentry cache
+static int lookup(int parent_num, const char *name)
+{
+    int inode_num = dcache_lookup(parent_num, name);
+    if (inode_num != DCACHE_MISS)
+    {
+        return inode_num;
+    }
+
+    struct directory *dir = directory_open(parent_num);
+    if (dir == NULL)
+    {
+        return -1;
+    }
+    // Cached under the directory's lock, so a name added meanwhile is
+    // never cached as missing
+    ilock(dir->inode);
+    inode_num = -1;
+    if (dir->inode->flags & DIR_FLAG)
+    {
+        inode_num = directory_lookup(dir, name);
+        dcache_insert(parent_num, name, inode_num);
+    }
+    iunlock(dir->inode);
+    directory_close(dir);
+    return inode_num;
+}
+
+// Returns the inode number of the file or directory at path, which is
+// taken from the root whether or not it starts with a slash. -1 if
+// there is nothing there.
+int namei(const char *path)
+{
+    char name[DIR_NAME_MAX + 1];
+    int inode_num = ROOT_INODE_NUM;
+
+    path += strspn(path, "/");
+    while (*path != '\0')
+    {
+        path = next_component(path, name);
+        if (path == NULL)
+        {
+            return -1;
+        }
+        inode_num = lookup(inode_num, name);
+        if (inode_num == -1)
+        {
+            return -1;
+        }
+        path += strspn(path, "/");
+    }
+    return inode_num;
+}
+
+// Finds the directory path's last component goes in, copying that
+// component to name. Returns the directory's inode number, or -1.
+static int namei_parent(const char *path, char *name)
+{
+    int len = strlen(path);
+    while (len > 0 && path[len - 1] == '/')
+    {
+        len--;
+    }
+    int start = len;
+    while (start > 0 && path[start - 1] != '/')
+    {
+        start--;
+    }
+    if (len == start || len - start > DIR_NAME_MAX)
+    {
+        return -1;
+    }
+    memcpy(name, path + start, len - start);
+    name[len - start] = '\0';
+
+    char parent_path[start + 1];
+    memcpy(parent_path, path, start);
+    parent_path[start] = '\0';
+    return namei(parent_path);
+}
+
+// Gives back an inode create_at made but could not name: its bit and, for
+// a directory, its first block
+static void release_new(int inode_num)
+{
+    struct inode *in = iget(inode_num);
+    if (in == NULL)
+    {
+        return;
+    }
+    ilock(in);
+    if (!(in->flags & INLINE_FLAG) && in->block_ptr[0] != 0)
+    {
+        bitmap_release(&block_bitmap, in->block_ptr[0]);
+        in->block_ptr[0] = 0;
+    }
+    in->flags = 0;
+    in->size = 0;
+    idirty(in);
+    iunlock(in);
+    iput(in);
+    bitmap_release(&inode_bitmap, inode_num);
+}
+
+// Creates the directory or file at path, whose parent has to exist and
+// must not have an entry by that name yet
+static int create_at(const char *path, int is_dir)
+{
+    char name[DIR_NAME_MAX + 1];
+
+    int parent_num = namei_parent(path, name);
+    if (parent_num == -1)
+    {
+        return -1;
+    }
+    struct directory *dir = directory_open(parent_num);
+    if (dir == NULL)
+    {
+        return -1;
+    }
+    // Held until the entry is in, so two threads cannot both create name
+    ilock(dir->inode);
+    if (!(dir->inode->flags & DIR_FLAG) || directory_lookup(dir, name) != -1)
+    {
+        iunlock(dir->inode);
+        directory_close(dir);
+        return -1;
+    }
+
+    int inode_num;
+    if (is_dir)
+    {
+        struct inode *in = create_directory(parent_num);
+        inode_num = in == NULL ? -1 : (int)in->inode_num;
+        if (in != NULL)
+        {
+            iput(in);
+        }
+    }
+    else
+    {
+        inode_num = file_create();
+    }
+
+    if (inode_num != -1 && directory_add(dir, name, inode_num) == -1)
+    {
+        release_new(inode_num);
+        inode_num = -1;
+    }
+    iunlock(dir->inode);
+    directory_close(dir);
+    return inode_num;
+}
+
+// mkdir: returns the new directory's inode number, or -1
+int directory_create(const char *path)
+{
+    journal_begin();
+    int inode_num = create_at(path, 1);
+    journal_end();
+    return inode_num;
+}
+
+// Returns the new file's inode number, or -1
+int file_create_path(const char *path)
+{
+    journal_begin();
+    int inode_num = create_at(path, 0);
+    journal_end();
+    return inode_num;
+}
@@ -0,0 +1,42 @@
+#ifndef NAMEI_H
+#define NAMEI_H
+
+#include "mkfs.h"
+#include <pthread.h>
+
+#define DCACHE_SIZE 1024
+#define DCACHE_HASH_SIZE 2048
+#define DCACHE_MISS -2
+
+// The dentry cache remembers what looking a name up in a directory gave,
+// including that it was not there (inode_num -1). It holds DCACHE_SIZE
+// entries, hashed on (parent, name), and reuses the least recently used.
+struct dentry {
+    int parent_num;
+    int inode_num;
+    char name[DIR_NAME_MAX + 1];
+    int used;
+    struct dentry *hash_next;
+    struct dentry *lru_prev;  // least recently used first
+    struct dentry *lru_next;
+};
+
+// One filesystem's dentry cache (see simfs.h). lock guards all of it and
+// is taken last: nothing else is locked under it.
+struct dentry_cache {
+    struct dentry dentries[DCACHE_SIZE];
+    struct dentry *hash[DCACHE_HASH_SIZE];
+    struct dentry lru;
+    int initialized;
+    pthread_mutex_t lock;
+};
+
+int namei(const char *path);
+int directory_create(const char *path);
+int file_create_path(const char *path);
+
+int dcache_lookup(int parent_num, const char *name);
+void dcache_insert(int parent_num, const char *name, int inode_num);
+void dcache_clear(void);
+
+#endif
@@ -1,10 +1,69 @@
-
 #ifndef PACK_H
 #define PACK_H
-unsigned int read_u32(void *addr);
-unsigned short read_u16(void *addr);
-unsigned char read_u8(void *addr);
-void write_u32(void *addr, unsigned long value);
-void write_u16(void *addr, unsigned int value);
-void write_u8(void *addr, unsigned char value);
+
+#include <stdint.h>
+#include <string.h>
+
+// On-disk fields are big-endian. Each access is one memcpy load or store,
+// which compiles to a single move, plus a byte swap on little-endian
+// hosts. The definitions are inline so callers decoding a whole inode or
+// directory block get straight-line code; pack.c holds the out-of-line
+// copies.
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define PACK_BE16(x) __builtin_bswap16(x)
+#define PACK_BE32(x) __builtin_bswap32(x)
+#else
+#define PACK_BE16(x) (x)
+#define PACK_BE32(x) (x)
+#endif
+
+inline unsigned int read_u32(void *addr)
+{
+    uint32_t value;
+    memcpy(&value, addr, sizeof(value));
+    return PACK_BE32(value);
+}
+
+inline unsigned short read_u16(void *addr)
+{
+    uint16_t value;
+    memcpy(&value, addr, sizeof(value));
+    return PACK_BE16(value);
+}
+
+inline unsigned char read_u8(void *addr)
+{
+    return *(unsigned char *)addr;
+}
+
+inline unsigned int read_u24(void *addr)
+{
+    unsigned char *bytes = addr;
+    return (read_u16(bytes) << 8) | bytes[2];
+}
+
+inline void write_u32(void *addr, unsigned long value)
+{
+    uint32_t stored = PACK_BE32((uint32_t)value);
+    memcpy(addr, &stored, sizeof(stored));
+}
+
+inline void write_u16(void *addr, unsigned int value)
+{
+    uint16_t stored = PACK_BE16((uint16_t)value);
+    memcpy(addr, &stored, sizeof(stored));
+}
+
+inline void write_u8(void *addr, unsigned char value)
+{
+    *(unsigned char *)addr = value;
+}
+
+inline void write_u24(void *addr, unsigned int value)
+{
+    unsigned char *bytes = addr;
+    write_u16(bytes, value >> 8);
+    bytes[2] = value & 0xff;
+}
+
 #endif
@@ -0,0 +1,150 @@
+#include "readahead.h"
+#include "async.h"
+#include "block.h"
+#include <stdlib.h>
+#include <string.h>
+
+void readahead_init(struct readahead *ra)
+{
+    ra->start = 0;
+    ra->count = 0;
+    ra->window = RA_MIN_BLOCKS;
+    ra->capacity = 0;
+    ra->version = 0;
+    ra->data = NULL;
+}
+
+void readahead_free(struct readahead *ra)
+{
+    free(ra->data);
+    readahead_init(ra);
+}
+
+static void run_done(struct async_io *io)
+{
+    __atomic_sub_fetch((int *)io->arg, 1, __ATOMIC_RELEASE);
+}
+
+// Fills the window with count blocks starting at logical block index,
+// reading each physically contiguous run with one request. A fragmented
+// window has all its runs in flight at once. Holes read as zeros.
+// Returns the number of blocks read, or -1 if none could be.
+static int readahead_fill(struct readahead *ra, struct inode *in, struct bmap_cursor *cursor, int index, int count)
+{
+    struct async_io ios[RA_MAX_BLOCKS];
+    int run_start[RA_MAX_BLOCKS];
+    int run_block[RA_MAX_BLOCKS];
+    int run_count[RA_MAX_BLOCKS];
+    int runs = 0;
+    int i = 0;
+
+    while (i < count)
+    {
+        int block_num = bmap_cached(in, index + i, cursor);
+        if (block_num == -1)
+        {
+            break;
+        }
+        if (block_num == 0)
+        {
+            memset(ra->data + (size_t)i * BLOCK_SIZE, 0, BLOCK_SIZE);
+            i++;
+            continue;
+        }
+
+        int run = 1;
+        while (i + run < count && bmap_cached(in, index + i + run, cursor) == block_num + run)
+        {
+            run++;
+        }
+        run_start[runs] = i;
+        run_block[runs] = block_num;
+        run_count[runs] = run;
+        runs++;
+        i += run;
+    }
+
+    if (runs == 1)
+    {
+        ios[0].result = bread_many(run_block[0], run_count[0], ra->data + (size_t)run_start[0] * BLOCK_SIZE);
+    }
+    else if (runs > 1)
+    {
+        int outstanding = runs;
+        for (int r = 0; r < runs; r++)
+        {
+            bread_async(&ios[r], run_block[r], run_count[r], ra->data + (size_t)run_start[r] * BLOCK_SIZE,
+                        run_done, &outstanding);
+        }
+        async_submit();
+        while (__atomic_load_n(&outstanding, __ATOMIC_ACQUIRE) > 0)
+        {
+            async_wait(1);
+        }
+    }
+
+    // Only what precedes the first failed run counts
+    for (int r = 0; r < runs; r++)
+    {
+        if (ios[r].result == -1)
+        {
+            i = run_start[r];
+            break;
+        }
+    }
+    return i == 0 ? -1 : i;
+}
+
+// Returns logical block index of the inode, from the window if it is
+// there and otherwise after reading a new window starting at it. The
+// pointer is good until the next call. NULL on error.
+unsigned char *readahead_block(struct readahead *ra, struct inode *in, struct bmap_cursor *cursor, int index)
+{
+    // A write to the inode since the window was read makes it stale
+    if (ra->version != in->data_version)
+    {
+        ra->count = 0;
+    }
+    if (index >= ra->start && index < ra->start + ra->count)
+    {
+        return ra->data + (size_t)(index - ra->start) * BLOCK_SIZE;
+    }
+
+    if (ra->count > 0 && index == ra->start + ra->count)
+    {
+        ra->window = ra->window * 2 < RA_MAX_BLOCKS ? ra->window * 2 : RA_MAX_BLOCKS;
+    }
+    else
+    {
+        ra->window = RA_MIN_BLOCKS;
+    }
+    if (ra->capacity < ra->window)
+    {
+        unsigned char *data = realloc(ra->data, (size_t)ra->window * BLOCK_SIZE);
+        if (data == NULL)
+        {
+            return NULL;
+        }
+        ra->data = data;
+        ra->capacity = ra->window;
+    }
+
+    // Nothing past the end of the file is worth reading
+    int file_blocks = (in->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int count = index + ra->window <= file_blocks ? ra->window : file_blocks - index;
+    if (count < 1)
+    {
+        count = 1;
+    }
+
+    ra->count = 0;
+    int got = readahead_fill(ra, in, cursor, index, count);
+    if (got == -1)
+    {
+        return NULL;
+    }
+    ra->start = index;
+    ra->count = got;
+    ra->version = in->data_version;
+    return ra->data;
+}
@@ -0,0 +1,27 @@
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include "inode.h"
+
+#define RA_MIN_BLOCKS 2
+#define RA_MAX_BLOCKS 32
+
+// Sequential readahead for an open file or directory. Holds logical
+// blocks [start, start + count) of the inode, read in as few I/Os as the
+// layout allows. Each time a scan runs off the end of the window the next
+// one is twice as large, up to RA_MAX_BLOCKS; any other access starts
+// over at RA_MIN_BLOCKS.
+struct readahead {
+    int start;
+    int count;
+    int window;             // blocks to read next time
+    int capacity;           // blocks data has room for
+    unsigned int version;   // inode's data_version when filled
+    unsigned char *data;
+};
+
+void readahead_init(struct readahead *ra);
+void readahead_free(struct readahead *ra);
+unsigned char *readahead_block(struct readahead *ra, struct inode *in, struct bmap_cursor *cursor, int index);
+
+#endif
@@ -0,0 +1,126 @@
+#define _GNU_SOURCE
+#include "simfs.h"
+#include <stdlib.h>
+#include <unistd.h>
+
+// Where every thread starts, statically set up like the globals it replaces
+static struct simfs simfs_default = {
+    .file = { .fd = -1, .dirty_lo = -1, .dirty_hi = -1 },
+    .inode_map = { .lock = PTHREAD_RWLOCK_INITIALIZER },
+    .block_map = { .lock = PTHREAD_RWLOCK_INITIALIZER },
+    .cache = { .lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP, .load_done = PTHREAD_COND_INITIALIZER },
+    .incore = { .lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP, .loaded = PTHREAD_COND_INITIALIZER },
+    .dcache = { .lock = PTHREAD_MUTEX_INITIALIZER },
+    .async = { .lock = PTHREAD_MUTEX_INITIALIZER, .changed = PTHREAD_COND_INITIALIZER, .work_ready = PTHREAD_COND_INITIALIZER },
+    .writeback = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER },
+};
+
+__thread struct simfs *simfs_current = &simfs_default;
+
+static struct simfs *simfs_alloc(void)
+{
+    struct simfs *fs = calloc(1, sizeof(struct simfs));
+    if (fs == NULL)
+    {
+        return NULL;
+    }
+    fs->file.fd = -1;
+    fs->file.dirty_lo = fs->file.dirty_hi = -1;
+
+    pthread_mutexattr_t recursive;
+    pthread_mutexattr_init(&recursive);
+    pthread_mutexattr_settype(&recursive, PTHREAD_MUTEX_RECURSIVE);
+    pthread_rwlock_init(&fs->inode_map.lock, NULL);
+    pthread_rwlock_init(&fs->block_map.lock, NULL);
+    pthread_mutex_init(&fs->cache.lock, &recursive);
+    pthread_cond_init(&fs->cache.load_done, NULL);
+    pthread_mutex_init(&fs->incore.lock, &recursive);
+    pthread_cond_init(&fs->incore.loaded, NULL);
+    pthread_mutex_init(&fs->dcache.lock, NULL);
+    pthread_mutex_init(&fs->async.lock, NULL);
+    pthread_cond_init(&fs->async.changed, NULL);
+    pthread_cond_init(&fs->async.work_ready, NULL);
+    pthread_mutex_init(&fs->writeback.lock, NULL);
+    pthread_cond_init(&fs->writeback.wake, NULL);
+    pthread_mutexattr_destroy(&recursive);
+    return fs;
+}
+
+static void simfs_free(struct simfs *fs)
+{
+    pthread_rwlock_destroy(&fs->inode_map.lock);
+    pthread_rwlock_destroy(&fs->block_map.lock);
+    pthread_mutex_destroy(&fs->cache.lock);
+    pthread_cond_destroy(&fs->cache.load_done);
+    pthread_mutex_destroy(&fs->incore.lock);
+    pthread_cond_destroy(&fs->incore.loaded);
+    pthread_mutex_destroy(&fs->dcache.lock);
+    pthread_mutex_destroy(&fs->async.lock);
+    pthread_cond_destroy(&fs->async.changed);
+    pthread_cond_destroy(&fs->async.work_ready);
+    pthread_mutex_destroy(&fs->writeback.lock);
+    pthread_cond_destroy(&fs->writeback.wake);
+    free(fs);
+}
+
+// Makes fs the calling thread's current filesystem, or the default one
+// if fs is NULL. Returns the one it replaces.
+struct simfs *simfs_use(struct simfs *fs)
+{
+    struct simfs *old = simfs_current;
+    simfs_current = fs == NULL ? &simfs_default : fs;
+    return old;
+}
+
+// Opens filename as image_open would, in a filesystem of its own.
+// Returns it, or NULL on error; the caller's current one is unchanged.
+struct simfs *simfs_open(char *filename, int flags)
+{
+    struct simfs *fs = simfs_alloc();
+    if (fs == NULL)
+    {
+        return NULL;
+    }
+
+    struct simfs *old = simfs_use(fs);
+    int fd = image_open(filename, flags);
+    simfs_use(old);
+    if (fd == -1)
+    {
+        simfs_free(fs);
+        return NULL;
+    }
+    return fs;
+}
+
+// Closes the image opened by simfs_open, writing back what it has
+// cached, and frees fs. No thread may be using it.
+int simfs_close(struct simfs *fs)
+{
+    struct simfs *old = simfs_use(fs);
+    int result = image_close();
+    incore_release();
+    free(inode_bitmap.free_counts);
+    free(block_bitmap.free_counts);
+    simfs_use(old == fs ? NULL : old);
+    simfs_free(fs);
+    return result;
+}
+
+// Makes everything the current filesystem has been told so far durable:
+// dirty inodes go to their blocks, the journal commits, dirty blocks are
+// written back and the image is synced. The barrier for callers of
+// writeback_start, but fine without it.
+int simfs_sync(void)
+{
+    if (inode_sync() == -1 || bsync() == -1)
+    {
+        return -1;
+    }
+    // bsync's msync of a mapped image already waits for the disk
+    if (image_map != NULL)
+    {
+        return 0;
+    }
+    return fdatasync(image_fd);
+}
@@ -0,0 +1,51 @@
+#ifndef SIMFS_H
+#define SIMFS_H
+
+#include "image.h"
+#include "super.h"
+#include "bitmap.h"
+#include "bcache.h"
+#include "inode.h"
+#include "namei.h"
+#include "journal.h"
+#include "async.h"
+#include "writeback.h"
+#include "checksum.h"
+
+// Everything that belongs to one open image: the file, its geometry and
+// bitmaps, the block, inode and dentry caches, the checksum table, the
+// asynchronous I/O in flight and the flusher. Each thread works on one filesystem at a time,
+// its current one, which every other function uses; threads start out on
+// a default one, so a program with a single image never needs to know. A
+// process can keep as many open as it likes, and threads bound to
+// different ones share no locks.
+struct simfs {
+    struct image_state file;
+    struct superblock super;
+    struct bitmap inode_map;
+    struct bitmap block_map;
+    struct bcache cache;
+    struct incore_table incore;
+    struct dentry_cache dcache;
+    struct journal_state journal;
+    struct checksum_state checksums;
+    struct async_state async;
+    struct writeback_state writeback;
+};
+
+extern __thread struct simfs *simfs_current;
+
+// The current filesystem's state, under the names it had as globals
+#define image_fd (simfs_current->file.fd)
+#define image_map (simfs_current->file.map)
+#define image_map_blocks (simfs_current->file.map_blocks)
+#define sb (simfs_current->super)
+#define inode_bitmap (simfs_current->inode_map)
+#define block_bitmap (simfs_current->block_map)
+
+struct simfs *simfs_open(char *filename, int flags);
+int simfs_close(struct simfs *fs);
+struct simfs *simfs_use(struct simfs *fs);
+int simfs_sync(void);
+
+#endif
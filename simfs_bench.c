@@ -0,0 +1,900 @@
+#include "image.h"
+#include "block.h"
+#include "inode.h"
+#include "mkfs.h"
+#include "free.h"
+#include "file.h"
+#include "super.h"
+#include "pack.h"
+#include "namei.h"
+#include "journal.h"
+#include "simfs.h"
+#include "async.h"
+#include "writeback.h"
+#include "checksum.h"
+#include "fsck.h"
+#include "bitmap.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_IMAGE "bench_image"
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// Times mkfs from the default 4 MiB up to 4 GiB, including the flush of
+// everything it dirtied
+static void bench_mkfs(void)
+{
+    int sizes[] = { NUMBER_OF_BLOCKS, 16384, 262144, 1048576 };
+    int modes[] = { 0, IMAGE_PREALLOCATE };
+    const char *mode_names[] = { "sparse", "preallocated" };
+
+    for (unsigned int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        for (int m = 0; m < 2; m++)
+        {
+            struct mkfs_params params = { sizes[s], 0, 0 };
+
+            image_open(BENCH_IMAGE, IMAGE_TRUNCATE | modes[m]);
+            clear_incore();
+
+            double start = now_ms();
+            int result = mkfs_format(&params);
+            bsync();
+            double elapsed = now_ms() - start;
+
+            printf("mkfs %10d blocks %9.1f MiB %-13s %10.3f ms%s\n",
+                   sizes[s], sizes[s] * (BLOCK_SIZE / 1048576.0), mode_names[m], elapsed,
+                   result == -1 ? " (failed)" : "");
+
+            image_close();
+            remove(BENCH_IMAGE);
+        }
+    }
+}
+
+// find_free as it used to be: one byte per iteration
+static int find_free_bytewise(unsigned char *block)
+{
+    for (int i = 0; i < BLOCK_SIZE; i++)
+    {
+        if (block[i] != 0xff)
+        {
+            return (i * 8) + __builtin_ctz(~block[i]);
+        }
+    }
+    return -1;
+}
+
+static volatile int sink;
+
+// Compares the bitmap kernels with the byte loop on one 4 KiB bitmap
+// block that is empty, half full or full but for its last bit
+static void bench_bitmap(void)
+{
+    const char *kernel_names[] = { "word", "sse2", "avx2" };
+    const char *fill_names[] = { "empty", "half-full", "nearly-full" };
+    int fills[] = { 0, BLOCK_SIZE * 4, BLOCK_SIZE * 8 - 1 };
+    int iterations = 200000;
+    unsigned char block[BLOCK_SIZE];
+
+    for (int f = 0; f < 3; f++)
+    {
+        memset(block, 0, BLOCK_SIZE);
+        set_free_range(block, 0, fills[f], 1);
+
+        double start = now_ms();
+        for (int i = 0; i < iterations; i++)
+        {
+            sink = find_free_bytewise(block);
+        }
+        double elapsed = now_ms() - start;
+        printf("find_free     %-12s %-6s %8.1f ns\n", fill_names[f], "byte", elapsed * 1e6 / iterations);
+
+        for (int k = 0; k < 3; k++)
+        {
+            if (free_use_kernel(kernel_names[k]) == -1)
+            {
+                continue;
+            }
+
+            start = now_ms();
+            for (int i = 0; i < iterations; i++)
+            {
+                sink = find_free(block);
+            }
+            elapsed = now_ms() - start;
+            printf("find_free     %-12s %-6s %8.1f ns\n", fill_names[f], kernel_names[k], elapsed * 1e6 / iterations);
+
+            start = now_ms();
+            for (int i = 0; i < iterations; i++)
+            {
+                sink = count_free(block, BLOCK_SIZE * 8);
+            }
+            elapsed = now_ms() - start;
+            printf("count_free    %-12s %-6s %8.1f ns\n", fill_names[f], kernel_names[k], elapsed * 1e6 / iterations);
+
+            start = now_ms();
+            for (int i = 0; i < iterations; i++)
+            {
+                sink = find_free_run(block, 0, BLOCK_SIZE * 8, 16);
+            }
+            elapsed = now_ms() - start;
+            printf("find_free_run %-12s %-6s %8.1f ns\n", fill_names[f], kernel_names[k], elapsed * 1e6 / iterations);
+        }
+    }
+}
+
+// The file benchmark streams an 8 MiB file on a 32 MiB image
+#define BENCH_FILE_SIZE (8 * 1048576)
+#define BENCH_FILE_IMAGE_BLOCKS 8192
+
+// Write and read throughput through the file API with small, unaligned
+// and whole-block requests, for block pointer and extent mapped files
+static void bench_file(void)
+{
+    int chunks[] = { 16, 1000, BLOCK_SIZE, BENCH_FILE_SIZE };
+    const char *format_names[] = { "pointers", "extents" };
+    int passes = 256 * 1048576 / BENCH_FILE_SIZE;
+    unsigned char *data = calloc(1, BENCH_FILE_SIZE);
+
+    for (int fmt = 0; fmt < 2; fmt++)
+    {
+        for (unsigned int c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++)
+        {
+            struct mkfs_params params = { BENCH_FILE_IMAGE_BLOCKS, 0, fmt ? FEATURE_EXTENTS : 0 };
+
+            image_open(BENCH_IMAGE, IMAGE_TRUNCATE);
+            clear_incore();
+            mkfs_format(&params);
+
+            struct file *f = file_open(file_create());
+            double start = now_ms();
+            for (int p = 0; p < passes; p++)
+            {
+                file_seek(f, 0, SEEK_SET);
+                for (int done = 0; done < BENCH_FILE_SIZE; done += chunks[c])
+                {
+                    int n = BENCH_FILE_SIZE - done < chunks[c] ? BENCH_FILE_SIZE - done : chunks[c];
+                    file_write(f, data + done, n);
+                }
+            }
+            double write_ms = now_ms() - start;
+
+            start = now_ms();
+            for (int p = 0; p < passes; p++)
+            {
+                file_seek(f, 0, SEEK_SET);
+                for (int done = 0; done < BENCH_FILE_SIZE; done += chunks[c])
+                {
+                    file_read(f, data + done, chunks[c]);
+                }
+            }
+            double read_ms = now_ms() - start;
+
+            double mib = (double)passes * BENCH_FILE_SIZE / 1048576.0;
+            printf("file %-8s %8d byte requests  write %8.1f MiB/s  read %8.1f MiB/s\n",
+                   format_names[fmt], chunks[c], mib / (write_ms / 1000.0), mib / (read_ms / 1000.0));
+
+            file_close(f);
+            image_close();
+            remove(BENCH_IMAGE);
+        }
+    }
+    free(data);
+}
+
+// Lookup latency against directory size, linear and hashed
+static void bench_dir(void)
+{
+    int sizes[] = { 100, 1000, 10000, 60000 };
+    unsigned int features[] = { 0, FEATURE_DIR_INDEX };
+    const char *format_names[] = { "linear", "hashed" };
+    char name[16];
+
+    for (int fmt = 0; fmt < 2; fmt++)
+    {
+        for (unsigned int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+        {
+            struct mkfs_params params = { 65536, 0, features[fmt] };
+
+            image_open(BENCH_IMAGE, IMAGE_TRUNCATE);
+            clear_incore();
+            mkfs_format(&params);
+
+            struct directory *dir = directory_open(0);
+            double start = now_ms();
+            for (int i = 0; i < sizes[s]; i++)
+            {
+                sprintf(name, "entry%d", i);
+                directory_add(dir, name, i % 65536);
+            }
+            double add_ms = now_ms() - start;
+
+            // Linear lookups are slow enough that fewer of them will do
+            int lookups = fmt == 0 && sizes[s] > 1000 ? 200 : 20000;
+            start = now_ms();
+            for (int i = 0; i < lookups; i++)
+            {
+                sprintf(name, "entry%d", (i * 7919) % sizes[s]);
+                sink = directory_lookup(dir, name);
+            }
+            double lookup_ms = now_ms() - start;
+
+            printf("dir %-6s %6d entries  add %8.2f us  lookup %9.2f us\n",
+                   format_names[fmt], sizes[s], add_ms * 1000.0 / sizes[s], lookup_ms * 1000.0 / lookups);
+
+            directory_close(dir);
+            image_close();
+            remove(BENCH_IMAGE);
+        }
+    }
+}
+
+#define BENCH_JOURNAL_OPS 2000
+
+// Metadata operations per second when every one is made durable on its
+// own (written home and fsynced, or committed to the journal) against
+// journal group commit, where one fsync covers many operations
+static void bench_journal(void)
+{
+    const char *mode_names[] = { "sync each op", "commit each op", "group commit" };
+    char path[32];
+
+    for (int mode = 0; mode < 3; mode++)
+    {
+        struct mkfs_params params = { 16384, 0, mode == 0 ? 0 : FEATURE_JOURNAL };
+        struct journal_stats stats;
+
+        image_open(BENCH_IMAGE, IMAGE_TRUNCATE);
+        clear_incore();
+        mkfs_format(&params);
+        bsync();
+        journal_reset_stats();
+
+        int fsyncs = 0;
+        double start = now_ms();
+        for (int i = 0; i < BENCH_JOURNAL_OPS; i++)
+        {
+            if (i % 100 == 0)
+            {
+                sprintf(path, "/d%d", i / 100);
+                directory_create(path);
+            }
+            sprintf(path, "/d%d/f%d", i / 100, i % 100);
+            file_create_path(path);
+
+            if (mode == 0)
+            {
+                inode_sync();
+                bsync();
+                fdatasync(image_fd);
+                fsyncs++;
+            }
+            else if (mode == 1)
+            {
+                inode_sync();
+                journal_commit();
+            }
+        }
+        inode_sync();
+        bsync();
+        fdatasync(image_fd);
+        double elapsed = now_ms() - start;
+
+        journal_get_stats(&stats);
+        fsyncs += stats.commits + stats.checkpoints + 1;
+        printf("journal %-15s %8.0f ops/s %6d fsyncs\n", mode_names[mode], BENCH_JOURNAL_OPS * 1000.0 / elapsed, fsyncs);
+
+        image_close();
+        remove(BENCH_IMAGE);
+    }
+}
+
+#define BENCH_THREAD_OPS 6400
+#define BENCH_THREADS_MAX 32
+
+struct thread_arg {
+    int id;
+    int ops;
+    struct simfs *fs;  // NULL for the default filesystem
+};
+
+// Each op creates a file in the thread's own directory, writes a block
+// to it and reads it back
+static void *thread_ops(void *arg)
+{
+    struct thread_arg *t = arg;
+    unsigned char block[BLOCK_SIZE];
+    char path[32];
+
+    simfs_use(t->fs);
+    memset(block, t->id, BLOCK_SIZE);
+    sprintf(path, "/t%d", t->id);
+    directory_create(path);
+    for (int i = 0; i < t->ops; i++)
+    {
+        sprintf(path, "/t%d/f%d", t->id, i);
+        int inode_num = file_create_path(path);
+        if (inode_num == -1)
+        {
+            continue;
+        }
+        struct file *f = file_open(inode_num);
+        file_write(f, block, BLOCK_SIZE);
+        file_seek(f, 0, SEEK_SET);
+        file_read(f, block, BLOCK_SIZE);
+        file_close(f);
+    }
+    return NULL;
+}
+
+static void bench_threads(void)
+{
+    struct mkfs_params params = { 65536, 0, FEATURE_EXTENTS | FEATURE_DIR_INDEX | FEATURE_JOURNAL };
+    pthread_t threads[BENCH_THREADS_MAX];
+    struct thread_arg args[BENCH_THREADS_MAX];
+    double base = 0;
+
+    for (int n = 1; n <= BENCH_THREADS_MAX; n *= 2)
+    {
+        image_open(BENCH_IMAGE, IMAGE_TRUNCATE);
+        clear_incore();
+        mkfs_format(&params);
+        bsync();
+
+        double start = now_ms();
+        for (int t = 0; t < n; t++)
+        {
+            args[t].id = t;
+            args[t].ops = BENCH_THREAD_OPS / n;
+            args[t].fs = NULL;
+            pthread_create(&threads[t], NULL, thread_ops, &args[t]);
+        }
+        for (int t = 0; t < n; t++)
+        {
+            pthread_join(threads[t], NULL);
+        }
+        inode_sync();
+        bsync();
+        double rate = BENCH_THREAD_OPS * 1000.0 / (now_ms() - start);
+        if (n == 1)
+        {
+            base = rate;
+        }
+        printf("threads %2d %10.0f ops/s %6.2fx\n", n, rate, rate / base);
+
+        image_close();
+        remove(BENCH_IMAGE);
+    }
+}
+
+// The same work as bench_threads, with every thread on one filesystem or
+// each on one of its own
+static void bench_shards(void)
+{
+    struct mkfs_params params = { 16384, 0, FEATURE_EXTENTS | FEATURE_DIR_INDEX | FEATURE_JOURNAL };
+    pthread_t threads[BENCH_THREADS_MAX];
+    struct thread_arg args[BENCH_THREADS_MAX];
+    char name[32];
+
+    for (int n = 2; n <= 8; n *= 2)
+    {
+        for (int sharded = 0; sharded <= 1; sharded++)
+        {
+            for (int t = 0; t < n; t++)
+            {
+                args[t].id = t;
+                args[t].ops = BENCH_THREAD_OPS / n;
+                args[t].fs = NULL;
+                if (sharded || t == 0)
+                {
+                    sprintf(name, "%s%d", BENCH_IMAGE, t);
+                    args[t].fs = simfs_open(name, IMAGE_TRUNCATE);
+                    simfs_use(args[t].fs);
+                    mkfs_format(&params);
+                    bsync();
+                }
+                else
+                {
+                    args[t].fs = args[0].fs;
+                }
+            }
+
+            double start = now_ms();
+            for (int t = 0; t < n; t++)
+            {
+                pthread_create(&threads[t], NULL, thread_ops, &args[t]);
+            }
+            for (int t = 0; t < n; t++)
+            {
+                pthread_join(threads[t], NULL);
+            }
+            for (int t = 0; t < (sharded ? n : 1); t++)
+            {
+                simfs_use(args[t].fs);
+                inode_sync();
+                bsync();
+            }
+            double rate = BENCH_THREAD_OPS * 1000.0 / (now_ms() - start);
+            printf("shards %d threads %-14s %10.0f ops/s\n", n, sharded ? "own images" : "one image", rate);
+
+            for (int t = 0; t < (sharded ? n : 1); t++)
+            {
+                simfs_close(args[t].fs);
+                sprintf(name, "%s%d", BENCH_IMAGE, t);
+                remove(name);
+            }
+        }
+    }
+    simfs_use(NULL);
+}
+
+#define BENCH_ASYNC_BLOCKS 16384  // 64 MiB
+#define BENCH_ASYNC_READS 16384
+
+struct async_slot {
+    struct async_io io;
+    int busy;
+    int *in_flight;
+    unsigned char data[BLOCK_SIZE];
+};
+
+static void async_slot_done(struct async_io *io)
+{
+    struct async_slot *slot = io->arg;
+    slot->busy = 0;
+    (*slot->in_flight)--;
+}
+
+// Random 4 KiB reads from a 64 MiB image with up to depth of them in
+// flight, on each engine. The image is fresh, so it is the page cache
+// rather than a disk behind it; what shows is the per-request overhead
+// each engine hides by keeping the queue full.
+static void bench_async(void)
+{
+    const char *engines[] = { "threads", "uring" };
+    struct mkfs_params params = { BENCH_ASYNC_BLOCKS, 0, 0 };
+    struct async_slot *slots = calloc(ASYNC_DEPTH, sizeof(struct async_slot));
+    unsigned char *fill = malloc((size_t)256 * BLOCK_SIZE);
+
+    image_open(BENCH_IMAGE, IMAGE_TRUNCATE);
+    mkfs_format(&params);
+    memset(fill, 0xa5, (size_t)256 * BLOCK_SIZE);
+    for (int b = sb.data_start; b + 256 <= BENCH_ASYNC_BLOCKS; b += 256)
+    {
+        bwrite_many(b, 256, fill);
+    }
+    bsync();
+    int data_blocks = BENCH_ASYNC_BLOCKS - sb.data_start;
+
+    for (int e = 0; e < 2; e++)
+    {
+        if (async_use_engine(engines[e]) == -1)
+        {
+            printf("async %-8s unsupported\n", engines[e]);
+            continue;
+        }
+        for (int depth = 1; depth <= ASYNC_DEPTH; depth *= 2)
+        {
+            int in_flight = 0;
+            int issued = 0;
+            unsigned int seed = 12345;
+            double start = now_ms();
+            while (issued < BENCH_ASYNC_READS || in_flight > 0)
+            {
+                // Refill the slots freed since the last wait
+                for (int i = 0; i < depth && issued < BENCH_ASYNC_READS; i++)
+                {
+                    struct async_slot *slot = &slots[i];
+                    if (slot->busy)
+                    {
+                        continue;
+                    }
+                    seed = seed * 1103515245 + 12345;
+                    slot->busy = 1;
+                    slot->in_flight = &in_flight;
+                    in_flight++;
+                    issued++;
+                    bread_async(&slot->io, sb.data_start + (seed >> 8) % data_blocks, 1, slot->data, async_slot_done, slot);
+                }
+                async_wait(1);
+            }
+            double ms = now_ms() - start;
+            printf("async %-8s depth %2d %10.0f reads/s %8.1f MiB/s\n", engines[e], depth,
+                   BENCH_ASYNC_READS * 1000.0 / ms, BENCH_ASYNC_READS * (BLOCK_SIZE / 1048576.0) * 1000.0 / ms);
+        }
+    }
+
+    image_close();
+    remove(BENCH_IMAGE);
+    free(slots);
+    free(fill);
+}
+
+// Field access as it used to be: one byte at a time
+static unsigned int bytewise_u32(unsigned char *bytes)
+{
+    return (bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 8) | (bytes[3] << 0);
+}
+
+static unsigned short bytewise_u16(unsigned char *bytes)
+{
+    return (bytes[0] << 8) | (bytes[1] << 0);
+}
+
+static void bytewise_inode(unsigned char *raw, struct inode *in)
+{
+    in->size = bytewise_u32(raw + SIZE_OFFSET);
+    in->owner_id = bytewise_u16(raw + ID_OFFSET);
+    in->permissions = raw[PERMISSIONS_OFFSET];
+    in->flags = raw[FLAGS_OFFSET];
+    in->link_count = raw[LINK_COUNT_OFFSET];
+    for (int i = 0; i < INODE_PTR_COUNT; i++)
+    {
+        in->block_ptr[i] = bytewise_u16(raw + BLOCK_PTR_OFFSET + BYTES_PER_BLOCK_PTR * i) |
+                           raw[BLOCK_PTR_HIGH_OFFSET + i] << 16;
+    }
+    in->indirect = (raw[INDIRECT_OFFSET] << 16) | bytewise_u16(raw + INDIRECT_OFFSET + 1);
+    in->double_indirect = (raw[DOUBLE_INDIRECT_OFFSET] << 16) | bytewise_u16(raw + DOUBLE_INDIRECT_OFFSET + 1);
+}
+
+static void bytewise_dirent(unsigned char *raw, struct directory_entry *ent)
+{
+    ent->inode_num = bytewise_u16(raw);
+    strcpy(ent->name, (char *)(raw + FILENAME_OFFSET));
+}
+
+static struct inode decoded_inodes[INODES_PER_BLOCK];
+static struct directory_entry decoded_entries[DIR_ENTRIES_PER_BLOCK];
+
+// Decode throughput for a full inode table block and a full directory
+// block, byte at a time against the memcpy and byte swap fast path
+static void bench_decode(void)
+{
+    unsigned char table[BLOCK_SIZE];
+    unsigned char dir_block[BLOCK_SIZE];
+    int iterations = 100000;
+
+    for (int i = 0; i < INODES_PER_BLOCK; i++)
+    {
+        struct inode in = { 0 };
+        in.size = i * 4096;
+        in.flags = FILE_FLAG;
+        for (int p = 0; p < INODE_PTR_COUNT; p++)
+        {
+            in.block_ptr[p] = i * INODE_PTR_COUNT + p;
+        }
+        inode_encode(table + i * INODE_SIZE, &in);
+    }
+    for (int i = 0; i < DIR_ENTRIES_PER_BLOCK; i++)
+    {
+        struct directory_entry ent;
+        ent.inode_num = i;
+        sprintf(ent.name, "entry%d", i);
+        dirent_encode(dir_block + i * DIR_ENTRY_SIZE, &ent);
+    }
+
+    // Both sides are called through a pointer so neither is inlined into
+    // the loop and the comparison is per call
+    void (*decode_inode[2])(unsigned char *, struct inode *) = { bytewise_inode, inode_decode };
+    void (*decode_dirent[2])(unsigned char *, struct directory_entry *) = { bytewise_dirent, dirent_decode };
+    const char *names[2] = { "bytewise", "fast" };
+
+    for (int v = 0; v < 2; v++)
+    {
+        void (*volatile inode_fn)(unsigned char *, struct inode *) = decode_inode[v];
+        void (*volatile dirent_fn)(unsigned char *, struct directory_entry *) = decode_dirent[v];
+
+        double start = now_ms();
+        for (int n = 0; n < iterations; n++)
+        {
+            for (int i = 0; i < INODES_PER_BLOCK; i++)
+            {
+                inode_fn(table + i * INODE_SIZE, &decoded_inodes[i]);
+            }
+        }
+        double elapsed = now_ms() - start;
+        printf("decode inode table block %-9s %8.1f ns/block %8.1f MiB/s\n", names[v],
+               elapsed * 1e6 / iterations, iterations * (BLOCK_SIZE / 1048576.0) / (elapsed / 1000.0));
+
+        start = now_ms();
+        for (int n = 0; n < iterations; n++)
+        {
+            for (int i = 0; i < DIR_ENTRIES_PER_BLOCK; i++)
+            {
+                dirent_fn(dir_block + i * DIR_ENTRY_SIZE, &decoded_entries[i]);
+            }
+        }
+        elapsed = now_ms() - start;
+        printf("decode directory block   %-9s %8.1f ns/block %8.1f MiB/s\n", names[v],
+               elapsed * 1e6 / iterations, iterations * (BLOCK_SIZE / 1048576.0) / (elapsed / 1000.0));
+    }
+}
+
+#define BENCH_WRITEBACK_OPS 4000
+
+// Creates files and writes a block to each, with writes made in the
+// foreground when the cache evicts and with the flusher making them, and
+// reports throughput, the slowest operation and the final simfs_sync
+static void bench_writeback(void)
+{
+    const char *mode_names[] = { "foreground", "flusher" };
+    unsigned char data[BLOCK_SIZE] = { 0 };
+    char path[32];
+
+    for (int mode = 0; mode < 2; mode++)
+    {
+        struct mkfs_params params = { 65536, 0, 0 };
+        struct writeback_stats stats = { 0 };
+
+        image_open(BENCH_IMAGE, IMAGE_TRUNCATE);
+        clear_incore();
+        mkfs_format(&params);
+        simfs_sync();
+        if (mode == 1)
+        {
+            writeback_start(NULL);
+        }
+
+        double slowest = 0;
+        double start = now_ms();
+        for (int i = 0; i < BENCH_WRITEBACK_OPS; i++)
+        {
+            double op_start = now_ms();
+            if (i % 100 == 0)
+            {
+                sprintf(path, "/d%d", i / 100);
+                directory_create(path);
+            }
+            sprintf(path, "/d%d/f%d", i / 100, i % 100);
+            struct file *f = file_open(file_create_path(path));
+            file_write(f, data, BLOCK_SIZE);
+            file_close(f);
+            double op_ms = now_ms() - op_start;
+            slowest = op_ms > slowest ? op_ms : slowest;
+        }
+        double ops_ms = now_ms() - start;
+        double sync_start = now_ms();
+        simfs_sync();
+        double sync_ms = now_ms() - sync_start;
+
+        if (mode == 1)
+        {
+            writeback_get_stats(&stats);
+            writeback_stop();
+        }
+        printf("writeback %-10s %8.0f ops/s  slowest %6.2f ms  sync %7.2f ms  %6lu flushed\n", mode_names[mode],
+               BENCH_WRITEBACK_OPS * 1000.0 / ops_ms, slowest, sync_ms, stats.blocks);
+
+        image_close();
+        remove(BENCH_IMAGE);
+    }
+}
+
+#define BENCH_CHECKSUM_BLOCKS 16384
+
+// CRC32C cost per 4 KiB block on each kernel, over blocks already in the
+// CPU cache as they are just after a read, against the cheapest I/O a
+// block can take, a pread served from the page cache, and the end-to-end
+// cost on file creation with and without FEATURE_CHECKSUMS
+static void bench_checksum(void)
+{
+    const char *kernels[] = { "table", "sse4.2" };
+    const char *best = checksum_kernel_name();
+    unsigned char *data = malloc((size_t)BENCH_CHECKSUM_BLOCKS * BLOCK_SIZE);
+    char path[32];
+
+    for (size_t i = 0; i < (size_t)BENCH_CHECKSUM_BLOCKS * BLOCK_SIZE; i++)
+    {
+        data[i] = i * 2654435761u >> 24;
+    }
+    for (int k = 0; k < 2; k++)
+    {
+        if (checksum_use_kernel(kernels[k]) == -1)
+        {
+            continue;
+        }
+        unsigned int sum = 0;
+        double start = now_ms();
+        for (int b = 0; b < 4 * BENCH_CHECKSUM_BLOCKS; b++)
+        {
+            sum ^= crc32c(0, data + (size_t)(b % 16) * BLOCK_SIZE, BLOCK_SIZE);
+        }
+        double elapsed = now_ms() - start;
+        sink = sum;
+        printf("checksum %-7s %8.0f ns/block %8.1f MiB/s\n", kernels[k], elapsed * 1e6 / (4.0 * BENCH_CHECKSUM_BLOCKS),
+               4.0 * BENCH_CHECKSUM_BLOCKS * BLOCK_SIZE / 1048576.0 / (elapsed / 1000.0));
+    }
+    checksum_use_kernel(best);
+
+    image_open(BENCH_IMAGE, IMAGE_TRUNCATE);
+    pwrite(image_fd, data, (size_t)BENCH_CHECKSUM_BLOCKS * BLOCK_SIZE, 0);
+    double start = now_ms();
+    for (int b = 0; b < BENCH_CHECKSUM_BLOCKS; b++)
+    {
+        pread(image_fd, data + (size_t)b * BLOCK_SIZE, BLOCK_SIZE, (off_t)b * BLOCK_SIZE);
+    }
+    printf("checksum %-7s %8.0f ns/block (page cache)\n", "pread", (now_ms() - start) * 1e6 / BENCH_CHECKSUM_BLOCKS);
+    image_close();
+    remove(BENCH_IMAGE);
+    free(data);
+
+    for (int with = 0; with < 2; with++)
+    {
+        struct mkfs_params params = { 16384, 0, with ? FEATURE_CHECKSUMS : 0 };
+
+        image_open(BENCH_IMAGE, IMAGE_TRUNCATE);
+        clear_incore();
+        mkfs_format(&params);
+        simfs_sync();
+        start = now_ms();
+        for (int i = 0; i < BENCH_JOURNAL_OPS; i++)
+        {
+            if (i % 100 == 0)
+            {
+                sprintf(path, "/d%d", i / 100);
+                directory_create(path);
+            }
+            sprintf(path, "/d%d/f%d", i / 100, i % 100);
+            file_create_path(path);
+        }
+        simfs_sync();
+        double elapsed = now_ms() - start;
+        printf("checksum %-7s %8.0f creates/s\n", with ? "on" : "off", BENCH_JOURNAL_OPS * 1000.0 / elapsed);
+        image_close();
+        remove(BENCH_IMAGE);
+    }
+}
+
+#define BENCH_FSCK_BLOCKS 1048576
+#define BENCH_FSCK_FILES 8000
+
+// fsck over a 4 GiB image with most of its blocks mapped by files of 96
+// blocks, reached through indirect blocks, in directories of 100, with 1
+// to 8 workers. The image is in the page cache throughout.
+static void bench_fsck(void)
+{
+    struct mkfs_params params = { BENCH_FSCK_BLOCKS, 0, 0 };
+    char path[32];
+
+    image_open(BENCH_IMAGE, IMAGE_TRUNCATE);
+    clear_incore();
+    mkfs_format(&params);
+    for (int i = 0; i < BENCH_FSCK_FILES; i++)
+    {
+        if (i % 100 == 0)
+        {
+            sprintf(path, "/d%d", i / 100);
+            directory_create(path);
+        }
+        sprintf(path, "/d%d/f%d", i / 100, i % 100);
+        struct inode *in = iget(file_create_path(path));
+        ilock(in);
+        inode_add_blocks(in, 0, 96);
+        in->size = 96 * BLOCK_SIZE;
+        idirty(in);
+        iunlock(in);
+        iput(in);
+    }
+    simfs_sync();
+
+    for (int threads = 1; threads <= 8; threads *= 2)
+    {
+        struct fsck_report report;
+        double start = now_ms();
+        int problems = fsck(threads, 0, &report);
+        double elapsed = now_ms() - start;
+        printf("fsck %d threads %9.2f ms  %8lu inodes %9lu blocks  %d problems\n", threads, elapsed, report.inodes,
+               report.blocks, problems);
+    }
+    image_close();
+    remove(BENCH_IMAGE);
+}
+
+#define BENCH_INLINE_FILES 4000
+
+// Space and lookup time for many tiny files, 32 bytes each in directories
+// of 10, with and without FEATURE_INLINE_DATA. Lookups are timed after
+// reopening the image, so each one has to read its directory and inode.
+static void bench_inline(void)
+{
+    unsigned char data[32] = { 0 };
+    unsigned char back[32];
+    char path[32];
+
+    for (int with = 0; with < 2; with++)
+    {
+        struct mkfs_params params = { 65536, 0, with ? FEATURE_INLINE_DATA : 0 };
+
+        image_open(BENCH_IMAGE, IMAGE_TRUNCATE);
+        clear_incore();
+        mkfs_format(&params);
+        int free_blocks = bitmap_count_free(&block_bitmap);
+        double start = now_ms();
+        for (int i = 0; i < BENCH_INLINE_FILES; i++)
+        {
+            if (i % 10 == 0)
+            {
+                sprintf(path, "/d%d", i / 10);
+                directory_create(path);
+            }
+            sprintf(path, "/d%d/f%d", i / 10, i % 10);
+            struct file *f = file_open(file_create_path(path));
+            file_write(f, data, sizeof(data));
+            file_close(f);
+        }
+        simfs_sync();
+        double create_ms = now_ms() - start;
+        int used = free_blocks - bitmap_count_free(&block_bitmap);
+        image_close();
+
+        image_open(BENCH_IMAGE, 0);
+        start = now_ms();
+        for (int i = 0; i < BENCH_INLINE_FILES; i++)
+        {
+            sprintf(path, "/d%d/f%d", i / 10, i % 10);
+            struct file *f = file_open(namei(path));
+            file_read(f, back, sizeof(back));
+            file_close(f);
+        }
+        double lookup_ms = now_ms() - start;
+        printf("inline %-3s %6d blocks used %9.0f creates/s %8.2f us/lookup+read\n", with ? "on" : "off", used,
+               BENCH_INLINE_FILES * 1000.0 / create_ms, lookup_ms * 1000.0 / BENCH_INLINE_FILES);
+        image_close();
+        remove(BENCH_IMAGE);
+    }
+}
+
+struct bench {
+    const char *name;
+    void (*run)(void);
+};
+
+static struct bench benches[] = {
+    { "mkfs", bench_mkfs },
+    { "bitmap", bench_bitmap },
+    { "file", bench_file },
+    { "dir", bench_dir },
+    { "decode", bench_decode },
+    { "journal", bench_journal },
+    { "threads", bench_threads },
+    { "shards", bench_shards },
+    { "async", bench_async },
+    { "writeback", bench_writeback },
+    { "checksum", bench_checksum },
+    { "fsck", bench_fsck },
+    { "inline", bench_inline },
+};
+
+// simfs_bench [name...] runs the named benchmarks, or all of them
+int main(int argc, char **argv)
+{
+    int count = sizeof(benches) / sizeof(benches[0]);
+
+    for (int i = 0; i < count; i++)
+    {
+        int selected = argc == 1;
+        for (int a = 1; a < argc; a++)
+        {
+            if (strcmp(argv[a], benches[i].name) == 0)
+            {
+                selected = 1;
+            }
+        }
+        if (selected)
+        {
+            benches[i].run();
+        }
+    }
+    return 0;
+}
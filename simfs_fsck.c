@@ -0,0 +1,66 @@
+#include "fsck.h"
+#include "image.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// fsck [-r] [-j threads] image checks an image, repairing it with -r.
+// Exits 0 if it was clean, 1 if everything found was repaired, 4 if
+// problems are left and 8 if it could not be checked.
+int main(int argc, char **argv)
+{
+    struct fsck_report report;
+    int repair = 0;
+    int threads = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "rj:")) != -1)
+    {
+        if (opt == 'r')
+        {
+            repair = 1;
+        }
+        else if (opt == 'j')
+        {
+            threads = atoi(optarg);
+        }
+        else
+        {
+            optind = argc + 1;
+        }
+    }
+    if (optind != argc - 1)
+    {
+        fprintf(stderr, "usage: %s [-r] [-j threads] image\n", argv[0]);
+        return 8;
+    }
+    if (image_open(argv[optind], IMAGE_EXISTING) == -1)
+    {
+        perror(argv[optind]);
+        return 8;
+    }
+
+    int problems = fsck(threads, repair, &report);
+    image_close();
+    if (problems == -1)
+    {
+        fprintf(stderr, "%s: could not be checked\n", argv[optind]);
+        return 8;
+    }
+    printf("%lu inodes, %lu directories, %lu blocks in use\n", report.inodes, report.directories, report.blocks);
+    printf("%lu orphaned inodes\n", report.orphans);
+    printf("%lu leaked blocks, %lu missing blocks, %lu shared blocks, %lu bad pointers\n", report.leaked_blocks,
+           report.missing_blocks, report.shared_blocks, report.bad_pointers);
+    printf("%lu bad link counts, %lu dangling entries, %lu unreadable blocks\n", report.bad_links, report.dangling,
+           report.unreadable);
+    if (repair)
+    {
+        printf("%lu checksums rebuilt, %lu repaired\n", report.bad_checksums, report.repaired);
+    }
+    if (problems == 0)
+    {
+        return 0;
+    }
+    // Shared blocks, bad pointers and unreadable blocks are never repaired
+    return repair && problems == (int)report.repaired ? 1 : 4;
+}
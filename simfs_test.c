@@ -6,7 +6,23 @@
 #include "mkfs.h"
 #include "pack.h"
 #include "ls.h"
+#include "bcache.h"
+#include "super.h"
+#include "bitmap.h"
+#include "file.h"
+#include "namei.h"
+#include "journal.h"
+#include "simfs.h"
+#include "async.h"
+#include "writeback.h"
+#include "checksum.h"
+#include "fsck.h"
+#include <fcntl.h>
 #include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 void setup() {
     // Open the test image with write access
@@ -26,11 +42,21 @@ void test_image() {
     // Test opening and closing a valid image file
     CTEST_ASSERT(image_open("test_image", 0) != -1, "expected to open image file");
     CTEST_ASSERT(image_close() != -1, "expected to close image file");
+    CTEST_ASSERT(image_close() == -1, "expected to not close an image file twice");
+
+    // Test that opening over an open image closes its descriptor
+    int fd = image_open("test_image", 0);
+    CTEST_ASSERT(image_open("test_image", 0) == fd, "expected the previous descriptor to be closed and reused");
+    CTEST_ASSERT(image_close() != -1 && fcntl(fd, F_GETFD) == -1, "expected no descriptor to be left open");
 
     // Test not being able to open and close an invalid image file
     CTEST_ASSERT(image_open("/test_image", 0) == -1, "expected to not open invalid image file");
     CTEST_ASSERT(image_close() == -1, "expected to not close invalid image file");
 
+    // Test that an image expected to exist is not created
+    CTEST_ASSERT(image_open("missing_image", IMAGE_EXISTING) == -1 && access("missing_image", F_OK) == -1,
+                 "expected to not create a missing image file");
+
     // Tear down the test environment
     teardown();
 }
@@ -56,6 +82,161 @@ void test_read_write() {
     teardown();
 }
 
+void test_bsync() {
+    // Set up the test environment
+    setup();
+
+    unsigned char data_to_write[BLOCK_SIZE] = { "Write me back" };
+    unsigned char on_disk[BLOCK_SIZE] = { 0 };
+
+    // Write the block; it should only be dirty in the cache
+    bwrite(5, data_to_write);
+    pread(image_fd, on_disk, BLOCK_SIZE, 5 * BLOCK_SIZE);
+    CTEST_ASSERT(memcmp(on_disk, data_to_write, BLOCK_SIZE) != 0, "Expected bwrite to leave the block dirty in the cache");
+
+    // Flush the cache and read the image directly
+    CTEST_ASSERT(bsync() == 1, "Expected bsync to write back the one dirty block");
+    pread(image_fd, on_disk, BLOCK_SIZE, 5 * BLOCK_SIZE);
+    CTEST_ASSERT(memcmp(on_disk, data_to_write, BLOCK_SIZE) == 0, "Expected bsync to write the dirty block to the image");
+    CTEST_ASSERT(bsync() == 0, "Expected a second bsync to find nothing dirty");
+
+    // Clean up after the test
+    teardown();
+}
+
+void test_bcache_stats() {
+    // Set up the test environment
+    setup();
+
+    unsigned char block[BLOCK_SIZE] = { 0 };
+    struct bcache_stats stats;
+
+    bcache_reset_stats();
+
+    // The first read of a block misses, the second hits
+    bread(4, block);
+    bread(4, block);
+    bcache_get_stats(&stats);
+    CTEST_ASSERT(stats.misses == 1, "Expected the first read of a block to miss the cache");
+    CTEST_ASSERT(stats.hits == 1, "Expected the second read of a block to hit the cache");
+
+    // Touching more blocks than the cache holds evicts the first one
+    for (int i = 0; i < BCACHE_BLOCKS; i++) {
+        bread(10 + i, block);
+    }
+    bcache_reset_stats();
+    bread(4, block);
+    bcache_get_stats(&stats);
+    CTEST_ASSERT(stats.misses == 1, "Expected the least recently used block to have been evicted");
+
+    // A buffer claimed to be overwritten is not served until it is filled
+    struct buf *b = bcache_get(5, 0);
+    CTEST_ASSERT(b != NULL && !b->valid, "Expected an unfilled buffer not to hold a valid block");
+    memset(b->data, 5, BLOCK_SIZE);
+    bcache_filled(b);
+    bcache_put(b);
+    bread(5, block);
+    CTEST_ASSERT(b->valid && block[0] == 5, "Expected the filled buffer to be served");
+
+    // Clean up after the test
+    teardown();
+}
+
+void test_bread_many() {
+    // Set up the test environment
+    setup();
+
+    unsigned char blocks[BLOCK_SIZE * 3] = { 0 };
+    unsigned char read_back[BLOCK_SIZE * 3] = { 0 };
+    unsigned char block[BLOCK_SIZE] = { 0 };
+
+    // Write blocks 20-22 as a batch, with the middle one already cached
+    strcpy((char *)blocks, "first");
+    strcpy((char *)blocks + BLOCK_SIZE, "second");
+    strcpy((char *)blocks + 2 * BLOCK_SIZE, "third");
+    bread(21, block);
+    CTEST_ASSERT(bwrite_many(20, 3, blocks) == 0, "Expected bwrite_many to succeed");
+
+    // Read them back as a batch
+    CTEST_ASSERT(bread_many(20, 3, read_back) == 0, "Expected bread_many to succeed");
+    CTEST_ASSERT(memcmp(blocks, read_back, sizeof(blocks)) == 0, "Expected bread_many to return the blocks written by bwrite_many");
+
+    // Blocks past the end of the image read back as zeros
+    memset(read_back, 0xaa, sizeof(read_back));
+    bread_many(500, 3, read_back);
+    memset(blocks, 0, sizeof(blocks));
+    CTEST_ASSERT(memcmp(blocks, read_back, sizeof(blocks)) == 0, "Expected blocks past the end of the image to read as zeros");
+
+    // Clean up after the test
+    teardown();
+}
+
+void test_bwrite_many() {
+    // Set up the test environment
+    setup();
+
+    int count = BCACHE_BLOCKS;
+    unsigned char *blocks = calloc(count, BLOCK_SIZE);
+    unsigned char on_disk[BLOCK_SIZE] = { 0 };
+    unsigned char block[BLOCK_SIZE] = { 0 };
+
+    // A batch larger than the cache is written straight through
+    bread(40, block);
+    for (int i = 0; i < count; i++) {
+        blocks[(size_t)i * BLOCK_SIZE] = i + 1;
+    }
+    CTEST_ASSERT(bwrite_many(30, count, blocks) == 0, "Expected a large bwrite_many to succeed");
+    pread(image_fd, on_disk, BLOCK_SIZE, (off_t)(30 + count - 1) * BLOCK_SIZE);
+    CTEST_ASSERT(on_disk[0] == (unsigned char)count, "Expected a large bwrite_many to reach the image without bsync");
+
+    // The cached copy of a block in the batch is refreshed too
+    bread(40, block);
+    CTEST_ASSERT(block[0] == 11, "Expected bwrite_many to refresh blocks that were already cached");
+
+    // I/O errors are reported instead of ignored
+    close(image_fd);
+    CTEST_ASSERT(bread(600, block) == NULL, "Expected bread to return NULL when the image cannot be read");
+    CTEST_ASSERT(bread_many(600, 2, blocks) == -1, "Expected bread_many to return -1 when the image cannot be read");
+    free(blocks);
+
+    // Clean up after the test
+    teardown();
+}
+
+void test_bget() {
+    // Set up the test environment
+    setup();
+
+    unsigned char block[BLOCK_SIZE] = { 0 };
+    unsigned char on_disk[BLOCK_SIZE] = { 0 };
+
+    // Modify a block in place through the pointer bget returns
+    unsigned char *data = bget(12);
+    CTEST_ASSERT(data != NULL, "Expected bget to return a pointer to the block");
+    if (image_map != NULL) {
+        CTEST_ASSERT(data == image_map + 12 * BLOCK_SIZE, "Expected bget to point straight into the mapping in mmap mode");
+    }
+    strcpy((char *)data, "in place");
+    bdirty(12);
+
+    // A second bget of the same block sees the same memory
+    CTEST_ASSERT(bget(12) == data, "Expected bget to return the same block memory while it is held");
+    brelse(12);
+    brelse(12);
+
+    // The copy-based API sees the change
+    bread(12, block);
+    CTEST_ASSERT(strcmp((char *)block, "in place") == 0, "Expected bread to see a change made through bget");
+
+    // bsync makes it reach the image
+    bsync();
+    pread(image_fd, on_disk, BLOCK_SIZE, 12 * BLOCK_SIZE);
+    CTEST_ASSERT(strcmp((char *)on_disk, "in place") == 0, "Expected bsync to flush a block modified through bget");
+
+    // Clean up after the test
+    teardown();
+}
+
 void test_find_and_set_free() {
     // Set up the test environment
     setup();
@@ -86,6 +267,40 @@ void test_find_and_set_free() {
     teardown();
 }
 
+void test_free_ranges() {
+    const char *kernel_names[] = { "word", "sse2", "avx2" };
+    unsigned char block[BLOCK_SIZE] = { 0 };
+
+    // Every kernel the CPU supports has to agree
+    for (int k = 0; k < 3; k++) {
+        if (free_use_kernel(kernel_names[k]) == -1) {
+            continue;
+        }
+
+        memset(block, 0, BLOCK_SIZE);
+        set_free_range(block, 3, 4000, 1);
+        CTEST_ASSERT(find_free(block) == 0, "Expected the bits before a set range to stay free");
+        CTEST_ASSERT(find_free_from(block, 3, BLOCK_SIZE * 8) == 4003, "Expected set_free_range to set every bit in the range");
+        CTEST_ASSERT(count_free(block, BLOCK_SIZE * 8) == BLOCK_SIZE * 8 - 4000, "Expected count_free to count the clear bits");
+        CTEST_ASSERT(count_free(block, 10) == 3, "Expected count_free to only look at the first nbits bits");
+
+        // Punch a few holes of different sizes into the set range
+        set_free_range(block, 100, 5, 0);
+        set_free_range(block, 1000, 64, 0);
+        set_free_range(block, 3000, 200, 0);
+        CTEST_ASSERT(find_free_run(block, 3, BLOCK_SIZE * 8, 5) == 100, "Expected find_free_run to find the first run that is long enough");
+        CTEST_ASSERT(find_free_run(block, 3, BLOCK_SIZE * 8, 6) == 1000, "Expected find_free_run to skip runs that are too short");
+        CTEST_ASSERT(find_free_run(block, 1001, BLOCK_SIZE * 8, 64) == 3000, "Expected find_free_run to start at the given bit");
+        CTEST_ASSERT(find_free_run(block, 3, 3100, 150) == -1, "Expected find_free_run to stay inside the given range");
+
+        // A full block has no free bits
+        memset(block, 0xff, BLOCK_SIZE);
+        CTEST_ASSERT(find_free(block) == -1 && count_free(block, BLOCK_SIZE * 8) == 0, "Expected a full block to have no free bits");
+        set_free(block, BLOCK_SIZE * 8 - 1, 0);
+        CTEST_ASSERT(find_free(block) == BLOCK_SIZE * 8 - 1, "Expected find_free to find the very last bit");
+    }
+}
+
 void test_ialloc() {
     // Set up the test environment
     setup();
@@ -194,6 +409,488 @@ void test_alloc() {
 
 
 
+void test_bitmap_alloc() {
+    image_open("test_image", 1);
+    clear_incore();
+    mkfs();
+    bsync();
+
+    unsigned char on_disk[BLOCK_SIZE] = { 0 };
+    int free_count = bitmap_count_free(&block_bitmap);
+    CTEST_ASSERT(free_count == NUMBER_OF_BLOCKS - 8, "Expected every block but the reserved ones and the root directory to be free");
+
+    // Allocation is next-fit: a released block is not reused right away
+    int first = alloc();
+    int second = alloc();
+    CTEST_ASSERT(second == first + 1, "Expected consecutive allocations to be adjacent");
+    bitmap_release(&block_bitmap, first);
+    CTEST_ASSERT(alloc() == second + 1, "Expected alloc to continue from where the last search ended");
+    CTEST_ASSERT(bitmap_count_free(&block_bitmap) == free_count - 2, "Expected the free count to track allocations and releases");
+
+    // The bitmap block is only changed in memory until it is flushed
+    if (image_map == NULL) {
+        pread(image_fd, on_disk, BLOCK_SIZE, (off_t)sb.block_map_start * BLOCK_SIZE);
+        CTEST_ASSERT(on_disk[1] == 0, "Expected alloc not to write the bitmap block right away");
+    }
+    bsync();
+    pread(image_fd, on_disk, BLOCK_SIZE, (off_t)sb.block_map_start * BLOCK_SIZE);
+    CTEST_ASSERT(on_disk[1] == 0x06, "Expected bsync to write the bitmap block back");
+
+    // Once the end is reached the search wraps around to the released block
+    int allocated = 0;
+    int last = -1;
+    while ((last = alloc()) != -1 && last != first) {
+        allocated++;
+    }
+    CTEST_ASSERT(last == first, "Expected alloc to wrap around to a released block");
+    CTEST_ASSERT(allocated == free_count - 3, "Expected alloc to hand out every other free block first");
+    CTEST_ASSERT(alloc() == -1 && bitmap_count_free(&block_bitmap) == 0, "Expected alloc to fail once the bitmap is full");
+
+    image_close();
+    remove("test_image");
+}
+
+void test_alloc_run() {
+    image_open("test_image", 1);
+    clear_incore();
+    mkfs();
+
+    int count;
+
+    // A free goal block starts the run
+    int first = alloc_run(4, -1, &count);
+    CTEST_ASSERT(first == 8 && count == 4, "Expected alloc_run to allocate a run of contiguous blocks");
+
+    // A used goal block moves the run to the next place it fits
+    alloc_run(1, 20, &count);
+    CTEST_ASSERT(alloc_run(10, 11, &count) == 21 && count == 10, "Expected alloc_run to skip gaps too small for the run");
+
+    // A free goal block is extended as far as it goes
+    CTEST_ASSERT(alloc_run(10, 12, &count) == 12 && count == 8, "Expected alloc_run to prefer continuing at the goal block");
+
+    // With no run long enough anywhere, the first free block is extended
+    int rest = alloc_run(2 * NUMBER_OF_BLOCKS, 0, &count);
+    CTEST_ASSERT(rest == 31 && count == NUMBER_OF_BLOCKS - 31, "Expected alloc_run to hand out the longest run it can when none is long enough");
+    CTEST_ASSERT(alloc_run(1, 0, &count) == -1, "Expected alloc_run to fail when every block is used");
+
+    image_close();
+    remove("test_image");
+}
+
+void test_inode_add_blocks() {
+    image_open("test_image", 1);
+    clear_incore();
+    mkfs();
+
+    struct inode *in = ialloc();
+
+    // New blocks are laid out in one run
+    CTEST_ASSERT(inode_add_blocks(in, 0, 3) == 0, "Expected inode_add_blocks to succeed");
+    CTEST_ASSERT(in->block_ptr[1] == in->block_ptr[0] + 1 && in->block_ptr[2] == in->block_ptr[0] + 2, "Expected the new blocks to be contiguous");
+
+    // Growing the file later continues as close after its last block as it can
+    int taken = alloc();
+    CTEST_ASSERT(inode_add_blocks(in, 3, 2) == 0, "Expected inode_add_blocks to grow the inode");
+    CTEST_ASSERT(in->block_ptr[3] == (unsigned int)taken + 1 && in->block_ptr[4] == (unsigned int)taken + 2, "Expected growth to continue right after the blocks in use");
+
+    // Past the direct pointers, blocks are mapped through pointer blocks
+    CTEST_ASSERT(inode_add_blocks(in, 5, INODE_PTR_COUNT) == 0, "Expected inode_add_blocks to map blocks through the indirect block");
+    CTEST_ASSERT(in->indirect != 0, "Expected an indirect block to be allocated");
+    CTEST_ASSERT(bmap(in, INODE_PTR_COUNT) == bmap(in, INODE_PTR_COUNT - 1) + 2, "Expected data to continue right after the indirect block");
+    CTEST_ASSERT(inode_add_blocks(in, INODE_PTR_COUNT + PTRS_PER_BLOCK + 3, 1) == 0, "Expected inode_add_blocks to map a block through the double indirect block");
+    CTEST_ASSERT(in->double_indirect != 0 && bmap(in, INODE_PTR_COUNT + PTRS_PER_BLOCK + 3) > 0, "Expected the block to be reachable through the double indirect block");
+    CTEST_ASSERT(bmap(in, INODE_PTR_COUNT + PTRS_PER_BLOCK + 2) == 0, "Expected unmapped blocks to read as holes");
+    CTEST_ASSERT(inode_add_blocks(in, INODE_MAX_BLOCKS - 1, 2) == -1, "Expected inode_add_blocks to refuse to map past the last block pointer");
+    CTEST_ASSERT(bmap(in, INODE_MAX_BLOCKS) == -1, "Expected bmap to refuse blocks past the last block pointer");
+
+    iput(in);
+    image_close();
+    remove("test_image");
+}
+
+void test_file_read_write() {
+    image_open("test_image", 1);
+    clear_incore();
+    mkfs();
+
+    unsigned char data[3 * BLOCK_SIZE + 100];
+    unsigned char back[sizeof(data)];
+    for (unsigned int i = 0; i < sizeof(data); i++) {
+        data[i] = i * 7;
+    }
+
+    int inode_num = file_create();
+    CTEST_ASSERT(inode_num > 0, "Expected file_create to return a new inode number");
+
+    struct file *f = file_open(inode_num);
+    CTEST_ASSERT(f != NULL, "Expected file_open to open the new file");
+
+    // Write in odd sized pieces that straddle block boundaries
+    CTEST_ASSERT(file_write(f, data, 10) == 10, "Expected a small write to succeed");
+    CTEST_ASSERT(file_write(f, data + 10, BLOCK_SIZE) == BLOCK_SIZE, "Expected an unaligned block sized write to succeed");
+    CTEST_ASSERT(file_write(f, data + 10 + BLOCK_SIZE, sizeof(data) - 10 - BLOCK_SIZE) == (int)sizeof(data) - 10 - BLOCK_SIZE, "Expected the rest of the data to be written");
+    CTEST_ASSERT(f->inode->size == sizeof(data), "Expected the file size to follow the writes");
+
+    CTEST_ASSERT(file_seek(f, 0, SEEK_SET) == 0, "Expected to seek back to the start");
+    CTEST_ASSERT(file_read(f, back, sizeof(back)) == (int)sizeof(back), "Expected to read the whole file back");
+    CTEST_ASSERT(memcmp(data, back, sizeof(data)) == 0, "Expected to read back what was written");
+    CTEST_ASSERT(file_read(f, back, 1) == 0, "Expected a read at the end of the file to return 0");
+    CTEST_ASSERT(file_close(f) == 0, "Expected file_close to succeed");
+
+    // The data and size survive closing and reopening
+    clear_incore();
+    f = file_open(inode_num);
+    CTEST_ASSERT(f->inode->size == sizeof(data), "Expected the size to be written back on close");
+    CTEST_ASSERT(file_seek(f, BLOCK_SIZE - 5, SEEK_SET) == BLOCK_SIZE - 5, "Expected to seek into the middle of the file");
+    CTEST_ASSERT(file_read(f, back, 10) == 10 && memcmp(back, data + BLOCK_SIZE - 5, 10) == 0, "Expected a read across a block boundary to return the right bytes");
+    CTEST_ASSERT(file_read(f, back, sizeof(back)) == (int)sizeof(data) - BLOCK_SIZE - 5, "Expected reads to stop at the end of the file");
+    file_close(f);
+
+    image_close();
+    remove("test_image");
+}
+
+void test_file_seek() {
+    image_open("test_image", 1);
+    clear_incore();
+    mkfs();
+
+    struct file *f = file_open(file_create());
+    unsigned char byte = 42;
+    unsigned char back[BLOCK_SIZE];
+
+    CTEST_ASSERT(file_seek(f, -1, SEEK_SET) == -1, "Expected to refuse seeking before the start");
+    CTEST_ASSERT(file_seek(f, 0, 99) == -1, "Expected to refuse an unknown whence");
+
+    // Writing past the end leaves a hole that reads back as zeros
+    CTEST_ASSERT(file_seek(f, 2 * BLOCK_SIZE, SEEK_SET) == 2 * BLOCK_SIZE, "Expected to seek past the end of the file");
+    CTEST_ASSERT(file_write(f, &byte, 1) == 1, "Expected a write past the end to succeed");
+    CTEST_ASSERT(f->inode->size == 2 * BLOCK_SIZE + 1, "Expected the write to extend the file");
+    CTEST_ASSERT(file_seek(f, -1, SEEK_END) == 2 * BLOCK_SIZE, "Expected SEEK_END to be relative to the size");
+    CTEST_ASSERT(file_seek(f, -BLOCK_SIZE, SEEK_CUR) == BLOCK_SIZE, "Expected SEEK_CUR to be relative to the offset");
+
+    memset(back, 1, sizeof(back));
+    CTEST_ASSERT(file_read(f, back, BLOCK_SIZE) == BLOCK_SIZE, "Expected to read the hole");
+    CTEST_ASSERT(back[0] == 0 && back[BLOCK_SIZE - 1] == 0, "Expected the hole to read back as zeros");
+
+    // Sizes are 32 bits, so that is as far as a file can grow
+    CTEST_ASSERT(file_seek(f, FILE_MAX_SIZE, SEEK_SET) == FILE_MAX_SIZE, "Expected to seek to the largest file size");
+    CTEST_ASSERT(file_seek(f, 1, SEEK_CUR) == -1, "Expected to refuse seeking past the largest file size");
+    CTEST_ASSERT(file_write(f, &byte, 1) == -1, "Expected a write past the largest file size to fail");
+    CTEST_ASSERT(file_seek(f, -1, SEEK_CUR) == FILE_MAX_SIZE - 1, "Expected to seek to the last byte a file can hold");
+    CTEST_ASSERT(file_write(f, &byte, 2) == 1, "Expected a write up to the largest file size to be cut short");
+    CTEST_ASSERT(f->inode->size == FILE_MAX_SIZE, "Expected the file to reach the largest size");
+
+    file_close(f);
+    image_close();
+    remove("test_image");
+}
+
+void test_file_large() {
+    image_open("test_image", 1);
+    clear_incore();
+    struct mkfs_params params = { 4096, 0, 0 };
+    mkfs_format(&params);
+
+    // Large enough to need the double indirect block
+    int blocks = INODE_PTR_COUNT + PTRS_PER_BLOCK + 100;
+    unsigned char *data = malloc((size_t)blocks * BLOCK_SIZE);
+    unsigned char *back = malloc((size_t)blocks * BLOCK_SIZE);
+    for (int i = 0; i < blocks * BLOCK_SIZE; i++) {
+        data[i] = i % 251;
+    }
+
+    int inode_num = file_create();
+    struct file *f = file_open(inode_num);
+    CTEST_ASSERT(file_write(f, data, blocks * BLOCK_SIZE) == blocks * BLOCK_SIZE, "Expected a write past the direct blocks to succeed");
+    CTEST_ASSERT(f->inode->indirect != 0 && f->inode->double_indirect != 0, "Expected the file to use both pointer blocks");
+    file_close(f);
+
+    // Read it back one block at a time
+    clear_incore();
+    f = file_open(inode_num);
+    int ok = 1;
+    for (int i = 0; i < blocks; i++) {
+        ok &= file_read(f, back + (size_t)i * BLOCK_SIZE, BLOCK_SIZE) == BLOCK_SIZE;
+    }
+    CTEST_ASSERT(ok && memcmp(data, back, (size_t)blocks * BLOCK_SIZE) == 0, "Expected to read the large file back");
+    file_close(f);
+
+    free(data);
+    free(back);
+    image_close();
+    remove("test_image");
+}
+
+void test_file_ptr_cache() {
+    image_open("test_image", 1);
+    clear_incore();
+    mkfs();
+
+    int blocks = INODE_PTR_COUNT + 200;
+    unsigned char *data = calloc(blocks, BLOCK_SIZE);
+    int inode_num = file_create();
+    struct file *f = file_open(inode_num);
+    file_write(f, data, blocks * BLOCK_SIZE);
+    file_close(f);
+
+    // Reading the blocks behind the indirect block in order looks the
+    // indirect block up once, not once per data block
+    struct bcache_stats stats;
+    f = file_open(inode_num);
+    file_seek(f, INODE_PTR_COUNT * BLOCK_SIZE, SEEK_SET);
+    bcache_reset_stats();
+    for (int i = INODE_PTR_COUNT; i < blocks; i++) {
+        file_read(f, data, BLOCK_SIZE);
+    }
+    bcache_get_stats(&stats);
+    CTEST_ASSERT(stats.hits + stats.misses == 200 + 1, "Expected one pointer block lookup for the whole sequential read");
+
+    file_close(f);
+    free(data);
+    image_close();
+    remove("test_image");
+}
+
+void test_file_readahead() {
+    image_open("test_image", 1);
+    clear_incore();
+    mkfs();
+
+    int blocks = 64;
+    unsigned char *data = malloc(blocks * BLOCK_SIZE);
+    for (int i = 0; i < blocks * BLOCK_SIZE; i++) {
+        data[i] = i % 253;
+    }
+    int inode_num = file_create();
+    struct file *f = file_open(inode_num);
+    file_write(f, data, blocks * BLOCK_SIZE);
+    file_close(f);
+
+    // Small sequential reads touch each block once, and the window grows
+    struct bcache_stats stats;
+    unsigned char back[100];
+    int ok = 1;
+    f = file_open(inode_num);
+    bcache_reset_stats();
+    for (int pos = 0; pos < blocks * BLOCK_SIZE; pos += sizeof(back)) {
+        int n = file_read(f, back, sizeof(back));
+        ok &= n > 0 && memcmp(back, data + pos, n) == 0;
+    }
+    bcache_get_stats(&stats);
+    CTEST_ASSERT(ok, "Expected small sequential reads to return the file's data");
+    CTEST_ASSERT(stats.hits + stats.misses == (unsigned long)blocks + 1, "Expected a sequential scan to look up each block and the indirect block once");
+    CTEST_ASSERT(f->ra.window == RA_MAX_BLOCKS, "Expected the readahead window to grow on sequential access");
+
+    // A jump starts over with a small window
+    file_seek(f, 0, SEEK_SET);
+    file_read(f, back, sizeof(back));
+    CTEST_ASSERT(f->ra.window == RA_MIN_BLOCKS, "Expected random access to shrink the readahead window");
+
+    // Writes through another handle are seen, not the stale window
+    struct file *g = file_open(inode_num);
+    unsigned char marker[4] = { 1, 2, 3, 4 };
+    file_seek(g, 200, SEEK_SET);
+    file_write(g, marker, sizeof(marker));
+    file_close(g);
+    file_seek(f, 200, SEEK_SET);
+    CTEST_ASSERT(file_read(f, back, sizeof(marker)) == sizeof(marker) && memcmp(back, marker, sizeof(marker)) == 0, "Expected reads to see writes made through another handle");
+
+    file_close(f);
+    free(data);
+    image_close();
+    remove("test_image");
+}
+
+void test_directory_readahead() {
+    image_open("test_image", 1);
+    clear_incore();
+    mkfs();
+
+    // Grow the root directory to four blocks of entries
+    int entries = 4 * BLOCK_SIZE / DIR_ENTRY_SIZE;
+    unsigned char entry[DIR_ENTRY_SIZE] = { 0 };
+    struct file *f = file_open(0);
+    file_seek(f, 0, SEEK_END);
+    for (int i = 2; i < entries; i++) {
+        write_u16(entry, i);
+        sprintf((char *)entry + FILENAME_OFFSET, "f%d", i);
+        file_write(f, entry, DIR_ENTRY_SIZE);
+    }
+    file_close(f);
+
+    struct bcache_stats stats;
+    struct directory_entry ent;
+    int count = 0, ok = 1;
+    struct directory *dir = directory_open(0);
+    bcache_reset_stats();
+    while (directory_get(dir, &ent) == 1) {
+        ok &= count < 2 || (int)ent.inode_num == count;
+        count++;
+    }
+    bcache_get_stats(&stats);
+    CTEST_ASSERT(count == entries && ok, "Expected to list every entry");
+    CTEST_ASSERT(stats.hits + stats.misses <= 4, "Expected listing a directory to cost one block read per block");
+
+    directory_close(dir);
+    image_close();
+    remove("test_image");
+}
+
+void test_file_write_no_read() {
+    image_open("test_image", 1);
+    clear_incore();
+    mkfs();
+
+    struct file *f = file_open(file_create());
+    unsigned char data[4 * BLOCK_SIZE] = { 0 };
+    struct bcache_stats stats;
+
+    // Whole blocks and small appends never have to read the old contents
+    bcache_reset_stats();
+    file_write(f, data, 4 * BLOCK_SIZE);
+    for (int i = 0; i < 100; i++) {
+        file_write(f, data, 10);
+    }
+    bcache_get_stats(&stats);
+    CTEST_ASSERT(stats.reads == 0, "Expected new and fully overwritten blocks to be written without being read");
+    CTEST_ASSERT(stats.writebacks == 0, "Expected small appends to be collected in the file's buffer");
+
+    file_close(f);
+    image_close();
+    remove("test_image");
+}
+
+void test_extents() {
+    image_open("test_image", 1);
+    clear_incore();
+    struct mkfs_params params = { 32768, 0, FEATURE_EXTENTS };
+    mkfs_format(&params);
+
+    // New files on an extents filesystem map their blocks with extents
+    int inode_num = file_create();
+    struct inode *in = iget(inode_num);
+    CTEST_ASSERT(in->flags & EXTENTS_FLAG, "Expected new files to use extents");
+
+    // A contiguous 100 MiB takes one record per MAX_EXTENT_LENGTH blocks
+    int blocks = 100 * 1048576 / BLOCK_SIZE;
+    CTEST_ASSERT(inode_add_blocks(in, 0, blocks) == 0, "Expected to map 100 MiB with extents");
+    CTEST_ASSERT(in->extent_count == 1 && in->extent_depth == 0, "Expected a contiguous 100 MiB to take one extent");
+    CTEST_ASSERT(bmap(in, blocks - 1) == bmap(in, 0) + blocks - 1, "Expected extents to map logical blocks to physical ones");
+    CTEST_ASSERT(bmap(in, blocks) == 0, "Expected blocks past the last extent to be holes");
+
+    iput(in);
+    clear_incore();
+    in = iget(inode_num);
+    CTEST_ASSERT(in->extent_count == 1 && in->extents[0].length == (unsigned int)blocks, "Expected extents to be written back with the inode");
+
+    iput(in);
+    image_close();
+    remove("test_image");
+}
+
+void test_extent_tree() {
+    image_open("test_image", 1);
+    clear_incore();
+    struct mkfs_params params = { 4096, 0, FEATURE_EXTENTS };
+    mkfs_format(&params);
+
+    // Growing two files in turn leaves each with one extent per block
+    int count = 1000;
+    int a_num = file_create(), b_num = file_create();
+    struct inode *a = iget(a_num), *b = iget(b_num);
+    int a_blocks[1000], b_blocks[1000];
+    int ok = 1;
+    for (int i = 0; i < count; i++) {
+        ok &= inode_add_blocks(a, i, 1) == 0;
+        ok &= inode_add_blocks(b, i, 1) == 0;
+        a_blocks[i] = bmap(a, i);
+        b_blocks[i] = bmap(b, i);
+        ok &= a_blocks[i] > 0 && b_blocks[i] > 0 && a_blocks[i] != b_blocks[i];
+    }
+    CTEST_ASSERT(ok, "Expected every allocation to succeed");
+    CTEST_ASSERT(a->extent_depth == 1 && a->extent_count > 1, "Expected the records to move out to leaf blocks");
+
+    iput(a);
+    iput(b);
+    clear_incore();
+    a = iget(a_num);
+    b = iget(b_num);
+    for (int i = 0; i < count; i++) {
+        ok &= bmap(a, i) == a_blocks[i] && bmap(b, i) == b_blocks[i];
+    }
+    CTEST_ASSERT(ok, "Expected every block to be found through the leaf blocks");
+    CTEST_ASSERT(bmap(a, count) == 0, "Expected blocks past the last extent to be holes");
+
+    // Filling a hole lands in the right leaf
+    CTEST_ASSERT(inode_add_blocks(a, count + 10, 1) == 0 && inode_add_blocks(a, count + 5, 1) == 0, "Expected to map blocks around a hole");
+    CTEST_ASSERT(bmap(a, count + 5) > 0 && bmap(a, count + 10) > 0 && bmap(a, count + 6) == 0, "Expected the hole to stay unmapped");
+
+    iput(a);
+    iput(b);
+    image_close();
+    remove("test_image");
+}
+
+void test_pack() {
+    unsigned char bytes[8] = { 0 };
+
+    // Fields are big-endian whatever the host
+    write_u32(bytes, 0x11223344);
+    CTEST_ASSERT(bytes[0] == 0x11 && bytes[3] == 0x44, "Expected write_u32 to store the most significant byte first");
+    CTEST_ASSERT(read_u32(bytes) == 0x11223344, "Expected read_u32 to read back what write_u32 stored");
+    write_u16(bytes + 1, 0xabcd);
+    CTEST_ASSERT(bytes[1] == 0xab && bytes[2] == 0xcd && read_u16(bytes + 1) == 0xabcd, "Expected unaligned 16-bit fields to work");
+    write_u24(bytes + 3, 0x123456);
+    CTEST_ASSERT(bytes[3] == 0x12 && bytes[5] == 0x56 && read_u24(bytes + 3) == 0x123456, "Expected 24-bit fields to be big-endian too");
+    write_u8(bytes + 7, 0xfe);
+    CTEST_ASSERT(read_u8(bytes + 7) == 0xfe, "Expected read_u8 to read back what write_u8 stored");
+}
+
+void test_inode_encode() {
+    unsigned char raw[INODE_SIZE];
+    struct inode in = { 0 }, out = { 0 };
+
+    in.size = 123456;
+    in.owner_id = 7;
+    in.permissions = 6;
+    in.flags = FILE_FLAG;
+    in.link_count = 2;
+    for (int i = 0; i < INODE_PTR_COUNT; i++) {
+        in.block_ptr[i] = 0x10000 * i + i;
+    }
+    in.indirect = 0x654321;
+    in.double_indirect = 99;
+    inode_encode(raw, &in);
+    CTEST_ASSERT(read_u16(raw + BLOCK_PTR_OFFSET + BYTES_PER_BLOCK_PTR) == 1, "Expected the low half of a block pointer where it always was");
+    inode_decode(raw, &out);
+    CTEST_ASSERT(out.size == in.size && out.owner_id == in.owner_id && out.permissions == in.permissions && out.flags == in.flags && out.link_count == in.link_count, "Expected inode fields to survive encode and decode");
+    CTEST_ASSERT(memcmp(out.block_ptr, in.block_ptr, sizeof(in.block_ptr)) == 0 && out.indirect == in.indirect && out.double_indirect == in.double_indirect, "Expected block pointers to survive encode and decode");
+
+    in.flags = FILE_FLAG | EXTENTS_FLAG;
+    in.extent_count = 2;
+    in.extent_depth = 0;
+    in.extents[0] = (struct extent){ 0, 100, 5 };
+    in.extents[1] = (struct extent){ 9, 0xabcdef, 0xffff };
+    inode_encode(raw, &in);
+    inode_decode(raw, &out);
+    CTEST_ASSERT(out.extent_count == 2 && out.extents[1].logical == 9 && out.extents[1].physical == 0xabcdef && out.extents[1].length == 0xffff, "Expected extents to survive encode and decode");
+
+    // An inline size past the inode, as a damaged image may hold, is cut
+    // down to the inline bytes
+    in.flags = FILE_FLAG | INLINE_FLAG;
+    in.size = 5000;
+    inode_encode(raw, &in);
+    inode_decode(raw, &out);
+    CTEST_ASSERT(out.size == INLINE_DATA_SIZE, "Expected an inline size never to run past the inline data");
+
+    struct directory_entry ent = { 300, "name" }, back;
+    unsigned char slot[DIR_ENTRY_SIZE];
+    dirent_encode(slot, &ent);
+    dirent_decode(slot, &back);
+    CTEST_ASSERT(read_u16(slot) == 300 && back.inode_num == 300 && strcmp(back.name, "name") == 0, "Expected directory entries to survive encode and decode");
+}
+
 void test_mkfs()
 {
     image_open("test_image", 1);
@@ -240,6 +937,99 @@ void test_mkfs()
     remove("test_image");
 }
 
+void test_mkfs_sparse()
+{
+    image_open("test_image", 1);
+    clear_incore();
+
+    unsigned char block[BLOCK_SIZE] = { 0 };
+    unsigned char zero_block[BLOCK_SIZE] = { 0 };
+    struct stat st;
+
+    // Leave data behind that mkfs must wipe
+    memset(block, 0xaa, BLOCK_SIZE);
+    bwrite(100, block);
+    bsync();
+
+    mkfs();
+    bsync();
+
+    fstat(image_fd, &st);
+    CTEST_ASSERT(st.st_size >= (off_t)NUMBER_OF_BLOCKS * BLOCK_SIZE, "Expected mkfs to size the image for every block");
+    CTEST_ASSERT(st.st_blocks * 512 < (off_t)NUMBER_OF_BLOCKS * BLOCK_SIZE / 2, "Expected mkfs to leave unwritten blocks sparse");
+
+    bread(100, block);
+    CTEST_ASSERT(memcmp(block, zero_block, BLOCK_SIZE) == 0, "Expected mkfs to zero blocks left over from before");
+
+    image_close();
+    remove("test_image");
+}
+
+void test_mkfs_format()
+{
+    image_open("test_image", 1);
+    clear_incore();
+
+    struct mkfs_params params = { 100000, 1000, 0 };
+    unsigned char block[BLOCK_SIZE] = { 0 };
+
+    // Geometry that does not fit is rejected
+    struct mkfs_params too_many_inodes = { 1024, MAX_INODE_COUNT + 1, 0 };
+    CTEST_ASSERT(mkfs_format(&too_many_inodes) == -1, "Expected mkfs_format to reject more inodes than directory entries can address");
+
+    CTEST_ASSERT(mkfs_format(&params) == 0, "Expected mkfs_format to format a large image");
+    image_close();
+
+    // The geometry is read back from the superblock at open
+    image_open("test_image", 0);
+    CTEST_ASSERT(sb.block_count == 100000 && sb.inode_count == 1000, "Expected image_open to read the block and inode counts from the superblock");
+    CTEST_ASSERT(sb.block_map_blocks == 4, "Expected a block bitmap spanning several blocks");
+    CTEST_ASSERT(sb.inode_table_blocks == 1000 / INODES_PER_BLOCK + 1, "Expected the inode table to hold every inode");
+    CTEST_ASSERT(sb.data_start == sb.inode_table_start + sb.inode_table_blocks, "Expected data blocks to follow the inode table");
+
+    struct inode *root_inode = iget(0);
+    CTEST_ASSERT(root_inode->block_ptr[0] == sb.data_start, "Expected the root directory in the first data block");
+    iput(root_inode);
+
+    // Allocation continues into the next bitmap block once one is full
+    memset(block, 255, BLOCK_SIZE);
+    bwrite(sb.block_map_start, block);
+    CTEST_ASSERT(alloc() == BITS_PER_BLOCK, "Expected alloc to move on to the second bitmap block");
+
+    // Inodes past the inode count are never handed out
+    CTEST_ASSERT(iget(1000) == NULL, "Expected iget to reject inode numbers past the inode count");
+    image_close();
+
+    // An image with a different block size is refused
+    image_open("test_image", 0);
+    bread(0, block);
+    write_u32(block + SB_BLOCK_SIZE_OFFSET, 1024);
+    bwrite(0, block);
+    image_close();
+    CTEST_ASSERT(image_open("test_image", 0) == -1, "Expected image_open to refuse an image with a different block size");
+
+    // So is one whose regions overlap, are out of order, run past the image
+    // or do not match the counts
+    unsigned int bad[][2] = {
+        { INODE_TABLE_START_OFFSET, 2 },
+        { BLOCK_MAP_START_OFFSET, 40 },
+        { DATA_START_OFFSET, 100000 },
+        { BLOCK_COUNT_OFFSET, 1000000 },
+        { INODE_MAP_BLOCKS_OFFSET, 0 },
+    };
+    for (int i = 0; i < (int)(sizeof(bad) / sizeof(bad[0])); i++) {
+        image_open("test_image", IMAGE_TRUNCATE);
+        mkfs_format(&params);
+        bread(0, block);
+        write_u32(block + bad[i][0], bad[i][1]);
+        bwrite(0, block);
+        image_close();
+        CTEST_ASSERT(image_open("test_image", 0) == -1, "Expected image_open to refuse an impossible geometry");
+    }
+
+    remove("test_image");
+}
+
 void test_find_free_incore()
 {
     image_open("test_image", 1);
@@ -349,6 +1139,9 @@ void test_write_inode()
     write_node.flags = 3;
     write_node.link_count = 2;
     write_node.block_ptr[1] = 6;
+    write_node.block_ptr[2] = 0x123456;
+    write_node.indirect = 0xabcdef;
+    write_node.double_indirect = 7;
 
     // Write the inode
     write_inode(&write_node);
@@ -364,6 +1157,8 @@ void test_write_inode()
     CTEST_ASSERT(read_node.flags == write_node.flags, "Expected the correct flags attribute");
     CTEST_ASSERT(read_node.link_count == write_node.link_count, "Expected the correct link count attribute");
     CTEST_ASSERT(read_node.block_ptr[1] == write_node.block_ptr[1], "Expected the correct block pointer attribute");
+    CTEST_ASSERT(read_node.block_ptr[2] == write_node.block_ptr[2], "Expected block pointers to keep all 24 bits");
+    CTEST_ASSERT(read_node.indirect == write_node.indirect && read_node.double_indirect == write_node.double_indirect, "Expected the correct pointer block attributes");
 
     // Clean up
     image_close();
@@ -443,29 +1238,247 @@ void test_iput()
 }
 
 
-void test_directory_open()
+void test_iget_cached()
 {
     image_open("test_image", 1);
     clear_incore();
 
-    // Open directory with a new inode
-    struct inode* new_node = iget(2);
-    struct directory* dir = directory_open(2);
+    struct bcache_stats stats;
 
-    CTEST_ASSERT(dir != NULL, "Expected that directory_open returns a valid directory pointer");
-    CTEST_ASSERT(dir->inode == new_node, "Expected that the returned directory has an inode pointer corresponding to the inode number passed in");
-    CTEST_ASSERT(dir->offset == 0, "Expected that the returned directory has an offset of 0 initially");
+    // An unreferenced inode stays in-core after iput
+    struct inode* node = iget(5);
+    node->size = 123;
+    iput(node);
+    CTEST_ASSERT(find_incore(5) == NULL, "Expected find_incore to skip inodes nobody references");
 
-    // Incore array full without existing directory
+    // Getting it again costs no block I/O and returns the same slot
+    bcache_reset_stats();
+    struct inode* again = iget(5);
+    bcache_get_stats(&stats);
+    CTEST_ASSERT(again == node && again->size == 123, "Expected iget to return the cached inode");
+    CTEST_ASSERT(stats.hits == 0 && stats.misses == 0, "Expected a re-iget of a cached inode to do no block I/O");
+    iput(again);
+
+    // The least recently released slot is reused first
     clear_incore();
-    for (int i = 0; i < MAX_SYS_OPEN_FILES; i++)
+    struct inode* first = iget(1);
+    struct inode* second = iget(2);
+    iput(second);
+    iput(first);
+    for (int i = 0; i < MAX_SYS_OPEN_FILES - 2; i++)
     {
-        iget(i);
+        iget(10 + i);
     }
-    dir = directory_open(MAX_SYS_OPEN_FILES);
-    CTEST_ASSERT(dir == NULL, "Expected that NULL is returned when trying to open a directory that is not incore when the incore array is full");
+    iget(100);
+    CTEST_ASSERT(find_incore(1) == NULL && find_incore(100) == second, "Expected the least recently used free slot to be reused first");
+    iget(1);
+    CTEST_ASSERT(find_incore(1) == first, "Expected the more recently used free inode to still be cached");
 
-    // Clean up
+    image_close();
+    remove("test_image");
+}
+
+
+void test_inode_dirty()
+{
+    image_open("test_image", 1);
+    clear_incore();
+    mkfs();
+
+    struct inode disk;
+
+    // A change nobody marked is never written
+    struct inode *in = iget(3);
+    in->size = 99;
+    iput(in);
+    clear_incore();
+    read_inode(&disk, 3);
+    CTEST_ASSERT(disk.size == 0, "Expected a clean inode not to be written back");
+
+    // A dirty one is written back when it is flushed
+    in = iget(3);
+    in->size = 42;
+    idirty(in);
+    iput(in);
+    read_inode(&disk, 3);
+    CTEST_ASSERT(disk.size == 0, "Expected iput to leave the write for later");
+    CTEST_ASSERT(inode_sync() == 0, "Expected inode_sync to succeed");
+    read_inode(&disk, 3);
+    CTEST_ASSERT(disk.size == 42 && in->dirty == 0, "Expected inode_sync to write back the dirty inode");
+
+    // Reusing a dirty inode's slot writes it first
+    in = iget(1);
+    in->size = 77;
+    idirty(in);
+    iput(in);
+    for (int i = 0; i < MAX_SYS_OPEN_FILES; i++) {
+        iget(INODES_PER_BLOCK + i);
+    }
+    read_inode(&disk, 1);
+    CTEST_ASSERT(disk.size == 77, "Expected a dirty inode to be written before its slot is reused");
+
+    image_close();
+    remove("test_image");
+}
+
+void test_inode_batching()
+{
+    image_open("test_image", 1);
+    clear_incore();
+    mkfs();
+
+    struct bcache_stats stats;
+
+    // Dirty inodes that share a table block go out together
+    for (int i = 1; i <= 10; i++) {
+        struct inode *in = iget(i);
+        in->size = i;
+        idirty(in);
+        iput(in);
+    }
+    bcache_reset_stats();
+    inode_sync();
+    bcache_get_stats(&stats);
+    CTEST_ASSERT(stats.hits + stats.misses == 1, "Expected ten dirty inodes in one table block to be flushed with one block update");
+
+    // A prefetched table block serves every inode in it
+    clear_incore();
+    CTEST_ASSERT(iprefetch(5) == INODES_PER_BLOCK, "Expected iprefetch to load the whole table block");
+    bcache_reset_stats();
+    int ok = 1;
+    for (int i = 0; i < INODES_PER_BLOCK; i++) {
+        struct inode *in = iget(i);
+        ok &= in != NULL && in->size == (unsigned int)(i >= 1 && i <= 10 ? i : (i == 0 ? DIR_START_SIZE : 0));
+        iput(in);
+    }
+    bcache_get_stats(&stats);
+    CTEST_ASSERT(ok, "Expected prefetched inodes to hold what is on disk");
+    CTEST_ASSERT(stats.hits + stats.misses == 0, "Expected iget of prefetched inodes to do no block I/O");
+    CTEST_ASSERT(iprefetch(5) == 0, "Expected iprefetch to skip inodes already in-core");
+
+    image_close();
+    remove("test_image");
+}
+
+// Holds an inode's lock from another thread until state is set to 2
+struct held_inode {
+    struct inode *in;
+    int state;  // 1 once the lock is held
+};
+
+static void *hold_inode(void *arg)
+{
+    struct held_inode *held = arg;
+    ilock(held->in);
+    __atomic_store_n(&held->state, 1, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&held->state, __ATOMIC_ACQUIRE) != 2)
+    {
+        usleep(1000);
+    }
+    iunlock(held->in);
+    return NULL;
+}
+
+void test_iget_dirty_victim()
+{
+    image_open("test_image", 1);
+    clear_incore();
+
+    // The only free slot holds a dirty inode another thread is changing
+    struct held_inode held = { iget(0), 0 };
+    pthread_t thread;
+    held.in->size = 123;
+    idirty(held.in);
+    pthread_create(&thread, NULL, hold_inode, &held);
+    while (__atomic_load_n(&held.state, __ATOMIC_ACQUIRE) != 1)
+    {
+        usleep(1000);
+    }
+    iput(held.in);
+    for (int i = 1; i < MAX_SYS_OPEN_FILES; i++)
+    {
+        iget(i);
+    }
+    CTEST_ASSERT(iget(MAX_SYS_OPEN_FILES) == NULL, "Expected iget to fail rather than evict a dirty inode it could not write");
+    CTEST_ASSERT(held.in->inode_num == 0 && held.in->dirty, "Expected the dirty inode to keep its slot");
+
+    __atomic_store_n(&held.state, 2, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+    struct inode *node = iget(MAX_SYS_OPEN_FILES);
+    CTEST_ASSERT(node == held.in && node->inode_num == MAX_SYS_OPEN_FILES, "Expected the slot to be reused once written");
+    struct inode raw;
+    read_inode(&raw, 0);
+    CTEST_ASSERT(raw.size == 123, "Expected the evicted inode to reach the table");
+
+    clear_incore();
+    image_close();
+    remove("test_image");
+}
+
+void test_incore_resize()
+{
+    image_open("test_image", 1);
+    clear_incore();
+
+    // Fill the default table
+    struct inode* first = iget(0);
+    for (int i = 1; i < MAX_SYS_OPEN_FILES; i++)
+    {
+        iget(i);
+    }
+    CTEST_ASSERT(iget(MAX_SYS_OPEN_FILES) == NULL, "Expected iget to fail when the table is full");
+
+    // Growing the table makes room without moving existing inodes
+    CTEST_ASSERT(incore_resize(2 * MAX_SYS_OPEN_FILES) == 0, "Expected incore_resize to grow the table");
+    CTEST_ASSERT(incore_size() == 2 * MAX_SYS_OPEN_FILES, "Expected the table to have the new size");
+    struct inode* node = iget(MAX_SYS_OPEN_FILES);
+    CTEST_ASSERT(node != NULL && node->inode_num == MAX_SYS_OPEN_FILES, "Expected iget to succeed after growing the table");
+    CTEST_ASSERT(find_incore(0) == first, "Expected existing inodes to keep their address when the table grows");
+    CTEST_ASSERT(incore_resize(MAX_SYS_OPEN_FILES) == -1, "Expected incore_resize to refuse to shrink the table");
+
+    // clear_incore puts the table back to its default size
+    clear_incore();
+    CTEST_ASSERT(incore_size() == MAX_SYS_OPEN_FILES, "Expected clear_incore to restore the default table size");
+
+    // An inode number is given back if no slot can hold its inode
+    mkfs();
+    for (int i = 1; i <= MAX_SYS_OPEN_FILES; i++)
+    {
+        iget(sb.inode_count - i);
+    }
+    int free_inodes = bitmap_count_free(&inode_bitmap);
+    CTEST_ASSERT(ialloc() == NULL && bitmap_count_free(&inode_bitmap) == free_inodes,
+                 "Expected ialloc to give its inode number back when the table is full");
+    clear_incore();
+
+    image_close();
+    remove("test_image");
+}
+
+
+void test_directory_open()
+{
+    image_open("test_image", 1);
+    clear_incore();
+
+    // Open directory with a new inode
+    struct inode* new_node = iget(2);
+    struct directory* dir = directory_open(2);
+
+    CTEST_ASSERT(dir != NULL, "Expected that directory_open returns a valid directory pointer");
+    CTEST_ASSERT(dir->inode == new_node, "Expected that the returned directory has an inode pointer corresponding to the inode number passed in");
+    CTEST_ASSERT(dir->offset == 0, "Expected that the returned directory has an offset of 0 initially");
+
+    // Incore array full without existing directory
+    clear_incore();
+    for (int i = 0; i < MAX_SYS_OPEN_FILES; i++)
+    {
+        iget(i);
+    }
+    dir = directory_open(MAX_SYS_OPEN_FILES);
+    CTEST_ASSERT(dir == NULL, "Expected that NULL is returned when trying to open a directory that is not incore when the incore array is full");
+
+    // Clean up
     image_close();
     remove("test_image");
 }
@@ -502,6 +1515,978 @@ void test_directory_get()
 }
 
 
+void test_directory_add()
+{
+    image_open("test_image", 1);
+    clear_incore();
+    mkfs();
+
+    struct directory *dir = directory_open(0);
+    char name[16];
+
+    CTEST_ASSERT(directory_add(dir, "hello", 5) == 0, "Expected directory_add to add an entry");
+    CTEST_ASSERT(directory_lookup(dir, "hello") == 5, "Expected directory_lookup to find the new entry");
+    CTEST_ASSERT(directory_lookup(dir, "..") == 0, "Expected directory_lookup to find ..");
+    CTEST_ASSERT(directory_lookup(dir, "nope") == -1, "Expected directory_lookup to return -1 for a missing name");
+    CTEST_ASSERT(directory_add(dir, "hello", 6) == -1, "Expected directory_add to refuse a name already in the directory");
+    CTEST_ASSERT(directory_add(dir, "sixteen-letters!", 6) == -1, "Expected directory_add to refuse a name that does not fit in an entry");
+
+    // Without the index feature, directories stay linear as they grow
+    int ok = 1;
+    for (int i = 0; i < 200; i++) {
+        sprintf(name, "n%d", i);
+        ok &= directory_add(dir, name, i) == 0;
+    }
+    CTEST_ASSERT(ok && !(dir->inode->flags & DIR_HASHED_FLAG), "Expected a directory to grow linearly");
+    CTEST_ASSERT(dir->inode->size == 203 * DIR_ENTRY_SIZE, "Expected each entry to add to the directory's size");
+    CTEST_ASSERT(directory_lookup(dir, "n199") == 199, "Expected to find an entry in the second block");
+
+    directory_close(dir);
+    image_close();
+    remove("test_image");
+}
+
+void test_directory_hashed()
+{
+    image_open("test_image", 1);
+    clear_incore();
+    struct mkfs_params params = { 0, 0, FEATURE_DIR_INDEX };
+    mkfs_format(&params);
+
+    int count = 5000;
+    char name[16];
+    int ok = 1;
+    struct directory *dir = directory_open(0);
+    for (int i = 0; i < count; i++) {
+        sprintf(name, "file%d", i);
+        ok &= directory_add(dir, name, i % 256) == 0;
+    }
+    CTEST_ASSERT(ok, "Expected every entry to be added");
+    CTEST_ASSERT(dir->inode->flags & DIR_HASHED_FLAG, "Expected a directory past one block to be hashed");
+    directory_close(dir);
+
+    clear_incore();
+    dir = directory_open(0);
+    for (int i = 0; i < count; i++) {
+        sprintf(name, "file%d", i);
+        ok &= directory_lookup(dir, name) == i % 256;
+    }
+    CTEST_ASSERT(ok, "Expected every entry to be found");
+    CTEST_ASSERT(directory_lookup(dir, "file5000") == -1, "Expected a missing name not to be found");
+    CTEST_ASSERT(directory_lookup(dir, ".") == 0, "Expected . to stay in the directory");
+
+    // A lookup reads the bucket its name hashes to, not the directory
+    if (!(image_default_flags & IMAGE_MMAP)) {
+        struct bcache_stats stats;
+        bcache_reset_stats();
+        directory_lookup(dir, "file1234");
+        bcache_get_stats(&stats);
+        CTEST_ASSERT(stats.hits + stats.misses <= DIR_MAX_PROBE + 1, "Expected a lookup to read a handful of blocks");
+    }
+
+    // The linear iterator still lists every entry
+    struct directory_entry ent;
+    int listed = 0;
+    while (directory_get(dir, &ent) == 1) {
+        listed++;
+    }
+    CTEST_ASSERT(listed == count + 2, "Expected directory_get to list a hashed directory");
+
+    directory_close(dir);
+    image_close();
+    remove("test_image");
+}
+
+void test_namei()
+{
+    image_open("test_image", 1);
+    clear_incore();
+    mkfs();
+
+    CTEST_ASSERT(namei("/") == ROOT_INODE_NUM, "Expected / to be the root directory");
+    CTEST_ASSERT(namei("/.") == ROOT_INODE_NUM && namei("/..") == ROOT_INODE_NUM, "Expected . and .. in the root to be the root");
+
+    int a = directory_create("/a");
+    int b = directory_create("/a/b");
+    int c = directory_create("/a/b/c");
+    CTEST_ASSERT(a > 0 && b > 0 && c > 0, "Expected directory_create to make nested directories");
+    CTEST_ASSERT(namei("/a/b/c") == c && namei("a/b//c/") == c, "Expected namei to resolve a nested path");
+    CTEST_ASSERT(namei("/a/b/c/..") == b, "Expected .. to lead to the parent directory");
+
+    int f = file_create_path("/a/b/c/file");
+    CTEST_ASSERT(f > 0 && namei("/a/b/c/file") == f, "Expected to create a file in a subdirectory");
+    CTEST_ASSERT(namei("/a/b/c/file/x") == -1, "Expected a file not to be searched as a directory");
+    CTEST_ASSERT(namei("/a/missing/c") == -1, "Expected namei to fail on a missing component");
+    CTEST_ASSERT(namei("/a/sixteen-letters!") == -1, "Expected namei to fail on a name that is too long");
+
+    CTEST_ASSERT(directory_create("/a/b") == -1, "Expected directory_create to refuse an existing name");
+    CTEST_ASSERT(directory_create("/nope/d") == -1, "Expected directory_create to need the parent to exist");
+    CTEST_ASSERT(file_create_path("/a/b/c/file/y") == -1, "Expected file_create_path to need the parent to be a directory");
+
+    // A full directory block with no block left to grow into: the new
+    // inode, and a new directory's block, are given back
+    char name[16];
+    int d = directory_create("/d");
+    for (int i = 2; i < DIR_ENTRIES_PER_BLOCK; i++)
+    {
+        sprintf(name, "/d/%d", i);
+        file_create_path(name);
+    }
+    while (alloc() != -1)
+    {
+    }
+    int free_inodes = bitmap_count_free(&inode_bitmap);
+    CTEST_ASSERT(file_create_path("/d/file") == -1 && bitmap_count_free(&inode_bitmap) == free_inodes,
+                 "Expected a file that could not be named to be freed");
+    CTEST_ASSERT(directory_create("/d/full") == -1 && bitmap_count_free(&inode_bitmap) == free_inodes,
+                 "Expected a directory without a block to give its inode back");
+    bitmap_release(&block_bitmap, sb.block_count - 1);
+    CTEST_ASSERT(directory_create("/d/dir") == -1 && bitmap_count_free(&inode_bitmap) == free_inodes &&
+                     bitmap_count_free(&block_bitmap) == 1,
+                 "Expected a directory that could not be named to be freed with its block");
+    CTEST_ASSERT(namei("/d/dir") == -1 && namei("/d") == d, "Expected the directory to be left as it was");
+
+    image_close();
+    remove("test_image");
+}
+
+void test_dcache()
+{
+    image_open("test_image", 1);
+    clear_incore();
+    mkfs();
+
+    directory_create("/one");
+    directory_create("/one/two");
+    directory_create("/one/two/three");
+    int f = file_create_path("/one/two/three/four");
+
+    // Once resolved, a deep path costs no directory block reads
+    namei("/one/two/three/four");
+    namei("/one/two/three/missing");
+    if (!(image_default_flags & IMAGE_MMAP)) {
+        struct bcache_stats stats;
+        bcache_reset_stats();
+        int ok = 1;
+        for (int i = 0; i < 100; i++) {
+            ok &= namei("/one/two/three/four") == f && namei("/one/two/three/missing") == -1;
+        }
+        bcache_get_stats(&stats);
+        CTEST_ASSERT(ok, "Expected repeated lookups to give the same answers");
+        CTEST_ASSERT(stats.hits + stats.misses == 0, "Expected repeated lookups, found or not, to be served from the dentry cache");
+    }
+
+    // Adding the missing name replaces the cached negative entry
+    CTEST_ASSERT(dcache_lookup(namei("/one/two/three"), "missing") == -1, "Expected the failed lookup to be cached");
+    int m = file_create_path("/one/two/three/missing");
+    CTEST_ASSERT(namei("/one/two/three/missing") == m, "Expected a created file to be found after a failed lookup");
+
+    // The cache is bounded, and forgets the least recently used entries
+    char name[16];
+    for (int i = 0; i < DCACHE_SIZE; i++) {
+        sprintf(name, "x%d", i);
+        dcache_insert(ROOT_INODE_NUM, name, i);
+    }
+    CTEST_ASSERT(dcache_lookup(ROOT_INODE_NUM, "x0") == 0 && dcache_lookup(ROOT_INODE_NUM, "x1023") == 1023, "Expected recent entries to stay cached");
+    CTEST_ASSERT(dcache_lookup(ROOT_INODE_NUM, "one") == DCACHE_MISS, "Expected old entries to be evicted");
+    CTEST_ASSERT(namei("/one/two/three/four") == f, "Expected evicted entries to be looked up again");
+
+    image_close();
+    remove("test_image");
+}
+
+// Loses everything cached, as if the process had died
+static void crash_image()
+{
+    bcache_invalidate();
+    journal_unload();
+    incore_drop_cached();
+    dcache_clear();
+    close(image_fd);
+    image_fd = -1;
+}
+
+void test_journal()
+{
+    struct mkfs_params params = { 4096, 0, FEATURE_JOURNAL };
+    struct mkfs_params too_small = { NUMBER_OF_BLOCKS, 0, FEATURE_JOURNAL };
+    struct journal_stats stats;
+    char path[32];
+
+    image_open("test_image", 1);
+    clear_incore();
+    CTEST_ASSERT(mkfs_format(&too_small) == -1, "Expected no room for a journal in a 4 MiB image");
+    CTEST_ASSERT(mkfs_format(&params) == 0, "Expected mkfs to format with a journal");
+    CTEST_ASSERT(sb.journal_blocks == 512 && sb.data_start == sb.journal_start + sb.journal_blocks, "Expected the journal between the inode table and the data");
+
+    // Committed operations survive losing the cache; uncommitted ones
+    // vanish whole, without leaking the inode they allocated
+    directory_create("/kept");
+    file_create_path("/kept/file");
+    inode_sync();
+    CTEST_ASSERT(journal_commit() > 0, "Expected the operations to commit");
+    int free_inodes = bitmap_count_free(&inode_bitmap);
+    directory_create("/lost");
+    crash_image();
+
+    journal_reset_stats();
+    CTEST_ASSERT(image_open("test_image", 0) != -1, "Expected the image to open after a crash");
+    journal_get_stats(&stats);
+    CTEST_ASSERT(stats.replayed == 1, "Expected the committed transaction to be replayed");
+    CTEST_ASSERT(namei("/kept/file") != -1, "Expected committed operations to survive a crash");
+    CTEST_ASSERT(namei("/lost") == -1, "Expected an uncommitted operation to be gone after a crash");
+    CTEST_ASSERT(bitmap_count_free(&inode_bitmap) == free_inodes, "Expected no inode to leak from the lost operation");
+
+    // Many small operations share one commit
+    journal_reset_stats();
+    for (int i = 0; i < 200; i++) {
+        sprintf(path, "/kept/g%d", i);
+        file_create_path(path);
+    }
+    inode_sync();
+    bsync();
+    journal_get_stats(&stats);
+    CTEST_ASSERT(stats.commits == 1, "Expected 200 creates to be committed together");
+
+    // Committing one at a time wraps the log, which is then reused
+    journal_reset_stats();
+    for (int i = 0; i < 200; i++) {
+        sprintf(path, "/kept/c%d", i);
+        file_create_path(path);
+        inode_sync();
+        journal_commit();
+    }
+    journal_get_stats(&stats);
+    CTEST_ASSERT(stats.commits == 200 && stats.checkpoints > 0, "Expected the log to fill and be checkpointed");
+    crash_image();
+    image_open("test_image", 0);
+    int ok = 1;
+    for (int i = 0; i < 200; i++) {
+        sprintf(path, "/kept/c%d", i);
+        ok &= namei(path) != -1;
+    }
+    CTEST_ASSERT(ok, "Expected every commit to survive a crash across checkpoints");
+
+    // A commit record without the blocks before it is not replayed
+    directory_create("/torn");
+    inode_sync();
+    journal_commit();
+    unsigned char garbage[BLOCK_SIZE];
+    memset(garbage, 0xa5, BLOCK_SIZE);
+    pwrite(image_fd, garbage, BLOCK_SIZE, (off_t)(sb.journal_start + 2) * BLOCK_SIZE);
+    crash_image();
+    image_open("test_image", 0);
+    CTEST_ASSERT(namei("/torn") == -1 && namei("/kept/file") != -1, "Expected a torn transaction to be ignored");
+
+    image_close();
+    remove("test_image");
+}
+
+#define THREADS 8
+#define THREAD_FILES 40
+#define THREAD_ALLOCS 200
+
+struct thread_work {
+    int id;
+    int created;        // files made in the thread's own directory
+    int verified;       // of those, read back intact
+    int shared;         // files made in the directory all threads share
+    int same;           // 1 if this thread won the race for /shared/same
+    int blocks[THREAD_ALLOCS];
+};
+
+static void *thread_worker(void *arg)
+{
+    struct thread_work *w = arg;
+    unsigned char data[BLOCK_SIZE * 2 + 100];
+    unsigned char back[sizeof(data)];
+    char path[32];
+
+    sprintf(path, "/t%d", w->id);
+    directory_create(path);
+    for (int i = 0; i < THREAD_FILES; i++) {
+        sprintf(path, "/t%d/f%d", w->id, i);
+        int inode_num = file_create_path(path);
+        if (inode_num == -1) {
+            continue;
+        }
+        w->created++;
+
+        memset(data, w->id * THREAD_FILES + i, sizeof(data));
+        struct file *f = file_open(inode_num);
+        file_write(f, data, sizeof(data));
+        file_seek(f, 0, SEEK_SET);
+        w->verified += file_read(f, back, sizeof(back)) == sizeof(back) && memcmp(data, back, sizeof(data)) == 0;
+        file_close(f);
+
+        sprintf(path, "/shared/t%df%d", w->id, i);
+        w->shared += file_create_path(path) != -1;
+    }
+    w->same = file_create_path("/shared/same") != -1;
+    for (int i = 0; i < THREAD_ALLOCS; i++) {
+        w->blocks[i] = alloc();
+    }
+    return NULL;
+}
+
+void test_threads()
+{
+    struct mkfs_params params = { 16384, 0, FEATURE_EXTENTS | FEATURE_DIR_INDEX | FEATURE_JOURNAL };
+    struct thread_work work[THREADS] = { 0 };
+    pthread_t threads[THREADS];
+
+    image_open("test_image", 1);
+    clear_incore();
+    mkfs_format(&params);
+    directory_create("/shared");
+    int free_inodes = bitmap_count_free(&inode_bitmap);
+    int free_blocks = bitmap_count_free(&block_bitmap);
+
+    for (int t = 0; t < THREADS; t++) {
+        work[t].id = t;
+        pthread_create(&threads[t], NULL, thread_worker, &work[t]);
+    }
+    int created = 0, verified = 0, shared = 0, same = 0;
+    for (int t = 0; t < THREADS; t++) {
+        pthread_join(threads[t], NULL);
+        created += work[t].created;
+        verified += work[t].verified;
+        shared += work[t].shared;
+        same += work[t].same;
+    }
+    CTEST_ASSERT(created == THREADS * THREAD_FILES && verified == created, "Expected every thread's files to be created and read back");
+    CTEST_ASSERT(shared == THREADS * THREAD_FILES, "Expected threads to create files side by side in one directory");
+    CTEST_ASSERT(same == 1, "Expected exactly one thread to create a contested name");
+
+    // No block is handed out twice, and the free counts add up exactly
+    unsigned char *seen = calloc(sb.block_count, 1);
+    int unique = 1;
+    for (int t = 0; t < THREADS; t++) {
+        for (int i = 0; i < THREAD_ALLOCS; i++) {
+            int b = work[t].blocks[i];
+            unique &= b >= (int)sb.data_start && b < (int)sb.block_count && !seen[b];
+            seen[b] = 1;
+        }
+    }
+    free(seen);
+    CTEST_ASSERT(unique, "Expected concurrent allocations never to return the same block");
+    int inodes_used = THREADS + created + shared + same;
+    CTEST_ASSERT(bitmap_count_free(&inode_bitmap) == free_inodes - inodes_used, "Expected the free inode count to be exact");
+    CTEST_ASSERT(bitmap_count_free(&block_bitmap) < free_blocks - THREADS * THREAD_ALLOCS, "Expected the free block count to cover every allocation");
+
+    // Everything is still there once the caches are gone
+    clear_incore();
+    image_close();
+    image_open("test_image", 0);
+    int found = 1;
+    char path[32];
+    for (int t = 0; t < THREADS; t++) {
+        for (int i = 0; i < THREAD_FILES; i++) {
+            sprintf(path, "/t%d/f%d", t, i);
+            found &= namei(path) != -1;
+            sprintf(path, "/shared/t%df%d", t, i);
+            found &= namei(path) != -1;
+        }
+    }
+    CTEST_ASSERT(found, "Expected every file made by the threads to be found after reopening");
+
+    image_close();
+    remove("test_image");
+}
+
+struct shard_work {
+    struct simfs *fs;
+    int created;
+};
+
+static void *shard_worker(void *arg)
+{
+    struct shard_work *w = arg;
+    char path[32];
+
+    simfs_use(w->fs);
+    for (int i = 0; i < 100; i++) {
+        sprintf(path, "/s%d", i);
+        w->created += file_create_path(path) != -1;
+    }
+    return NULL;
+}
+
+void test_simfs()
+{
+    struct mkfs_params big = { 4096, 0, FEATURE_JOURNAL };
+    struct mkfs_params small = { 0 };
+
+    // The default filesystem is left alone by the others
+    image_open("test_image", 1);
+    mkfs();
+    int root_file = file_create_path("/default");
+
+    struct simfs *a = simfs_open("test_image_a", IMAGE_TRUNCATE);
+    struct simfs *b = simfs_open("test_image_b", IMAGE_TRUNCATE);
+    CTEST_ASSERT(a != NULL && b != NULL, "Expected simfs_open to open two images");
+    CTEST_ASSERT(simfs_open("/nonexistent/image", 0) == NULL, "Expected simfs_open to fail on a bad path");
+
+    struct simfs *old = simfs_use(a);
+    CTEST_ASSERT(old != a && old != b, "Expected simfs_use to return the default filesystem");
+    mkfs_format(&small);
+    int in_a = file_create_path("/only_a");
+    simfs_use(b);
+    mkfs_format(&big);
+    directory_create("/only_b");
+    CTEST_ASSERT(sb.block_count == 4096 && journal_active(), "Expected each filesystem to have its own geometry");
+    CTEST_ASSERT(namei("/only_a") == -1 && namei("/only_b") != -1, "Expected each filesystem to have its own files");
+    simfs_use(a);
+    CTEST_ASSERT(sb.block_count == NUMBER_OF_BLOCKS && !journal_active(), "Expected switching back to restore the geometry");
+    CTEST_ASSERT(namei("/only_a") == in_a && namei("/only_b") == -1, "Expected switching back to restore the files");
+    simfs_use(NULL);
+    CTEST_ASSERT(namei("/default") == root_file && namei("/only_a") == -1, "Expected the default filesystem to be untouched");
+
+    // Threads on different filesystems work side by side
+    struct shard_work work[2] = { { a, 0 }, { b, 0 } };
+    pthread_t threads[2];
+    for (int t = 0; t < 2; t++) {
+        pthread_create(&threads[t], NULL, shard_worker, &work[t]);
+    }
+    for (int t = 0; t < 2; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    CTEST_ASSERT(work[0].created == 100 && work[1].created == 100, "Expected threads to create files in their own filesystems");
+
+    CTEST_ASSERT(simfs_close(a) == 0 && simfs_close(b) == 0, "Expected simfs_close to close both images");
+    a = simfs_open("test_image_a", 0);
+    simfs_use(a);
+    CTEST_ASSERT(namei("/only_a") == in_a && namei("/s99") != -1, "Expected a closed filesystem to be written back");
+    simfs_close(a);
+    CTEST_ASSERT(namei("/default") == root_file, "Expected closing the current filesystem to go back to the default");
+
+    image_close();
+    remove("test_image");
+    remove("test_image_a");
+    remove("test_image_b");
+}
+
+static void async_counted(struct async_io *io)
+{
+    (*(int *)io->arg)++;
+}
+
+void test_async()
+{
+    const char *engines[] = { "threads", "uring" };
+    struct mkfs_params params = { 4096, 0, 0 };
+    int blocks = 32;
+    unsigned char *data = malloc((size_t)blocks * BLOCK_SIZE);
+    unsigned char *back = malloc((size_t)blocks * BLOCK_SIZE);
+    struct async_io ios[8];
+
+    CTEST_ASSERT(async_use_engine("carrier pigeon") == -1, "Expected an unknown engine to be refused");
+    for (int e = 0; e < 2; e++) {
+        if (async_use_engine(engines[e]) == -1) {
+            continue;
+        }
+        image_open("test_image", 1);
+        mkfs_format(&params);
+        CTEST_ASSERT(strcmp(async_engine_name(), engines[e]) == 0, "Expected async_use_engine to switch engines");
+        for (int i = 0; i < blocks * BLOCK_SIZE; i++) {
+            data[i] = (i / 7 + e) % 253;
+        }
+
+        // Writes of 4 blocks each, all in flight together
+        int done = 0;
+        for (int r = 0; r < 8; r++) {
+            bwrite_async(&ios[r], 2000 + r * 4, 4, data + (size_t)r * 4 * BLOCK_SIZE, async_counted, &done);
+        }
+        CTEST_ASSERT(async_pending() == 8, "Expected every write to be pending");
+        CTEST_ASSERT(async_wait(8) == 8 && done == 8 && async_pending() == 0, "Expected async_wait to reap every write");
+        int ok = 1;
+        for (int r = 0; r < 8; r++) {
+            ok &= ios[r].result == 0;
+        }
+        CTEST_ASSERT(ok, "Expected every write to succeed");
+
+        // Read back with a batch wait instead of callbacks
+        memset(back, 0, (size_t)blocks * BLOCK_SIZE);
+        for (int r = 0; r < 8; r++) {
+            bread_async(&ios[r], 2000 + r * 4, 4, back + (size_t)r * 4 * BLOCK_SIZE, NULL, NULL);
+        }
+        async_submit();
+        int reaped = 0;
+        while (async_pending() > 0) {
+            reaped += async_wait(1);
+        }
+        CTEST_ASSERT(reaped == 8 && memcmp(data, back, (size_t)blocks * BLOCK_SIZE) == 0, "Expected async reads to return what was written");
+
+        // A block changed in the cache is read from there
+        unsigned char block[BLOCK_SIZE];
+        memset(block, 0x5a, BLOCK_SIZE);
+        bwrite(2000, block);
+        bread_async(&ios[0], 2000, 2, back, NULL, NULL);
+        async_wait(1);
+        CTEST_ASSERT(ios[0].result == 0 && back[0] == 0x5a && memcmp(back + BLOCK_SIZE, data + BLOCK_SIZE, BLOCK_SIZE) == 0,
+                     "Expected an async read to see a block dirty in the cache");
+
+        // A prefetched block is there for bread
+        bprefetch(2010);
+        bprefetch(2011);
+        CTEST_ASSERT(bread(2011, block) != NULL && memcmp(block, data + (size_t)11 * BLOCK_SIZE, BLOCK_SIZE) == 0,
+                     "Expected bread to wait for a prefetch of its block");
+        async_wait(async_pending());
+        CTEST_ASSERT(bread(2010, block) != NULL && memcmp(block, data + (size_t)10 * BLOCK_SIZE, BLOCK_SIZE) == 0,
+                     "Expected a reaped prefetch to be in the cache");
+
+        CTEST_ASSERT(bread_async(&ios[0], 2000, 0, back, NULL, NULL) == -1, "Expected an empty request to be refused");
+        image_close();
+    }
+
+    free(data);
+    free(back);
+    remove("test_image");
+}
+
+// Polls for up to two seconds for the flusher to empty the cache
+static int wait_for_clean(void)
+{
+    for (int i = 0; i < 200 && bcache_dirty_count() > 0; i++) {
+        usleep(10000);
+    }
+    return bcache_dirty_count() == 0;
+}
+
+void test_writeback()
+{
+    struct writeback_params aging = { 10, 50, 1000 };
+    struct writeback_params threshold = { 60000, 60000, 8 };
+    struct writeback_stats stats;
+    unsigned char block[BLOCK_SIZE] = { "Flushed in the background" };
+    unsigned char on_disk[BLOCK_SIZE] = { 0 };
+
+    image_open("test_image", 1);
+    mkfs();
+    bsync();
+
+    // Aged blocks are written back without a bsync
+    CTEST_ASSERT(writeback_start(&aging) == 0 && writeback_running(), "Expected writeback_start to start the flusher");
+    CTEST_ASSERT(writeback_start(&aging) == -1, "Expected a second writeback_start to be refused");
+    bwrite(2000, block);
+    CTEST_ASSERT(bcache_dirty_count() == 1, "Expected bwrite to leave one dirty block");
+    CTEST_ASSERT(wait_for_clean(), "Expected the flusher to write back an aged block");
+    pread(image_fd, on_disk, BLOCK_SIZE, 2000 * BLOCK_SIZE);
+    CTEST_ASSERT(memcmp(on_disk, block, BLOCK_SIZE) == 0, "Expected the flusher to write the block to the image");
+    writeback_get_stats(&stats);
+    CTEST_ASSERT(stats.runs > 0 && stats.blocks >= 1, "Expected the flusher to count its writes");
+
+    // Dirty inodes go out with their table blocks
+    int inode_num = file_create_path("/flushed");
+    CTEST_ASSERT(inode_num != -1 && wait_for_clean(), "Expected the flusher to write back a new file");
+    CTEST_ASSERT(writeback_stop() == 0 && !writeback_running(), "Expected writeback_stop to stop the flusher");
+    CTEST_ASSERT(writeback_stop() == -1, "Expected a second writeback_stop to be refused");
+
+    // Crossing the threshold wakes the flusher long before its interval
+    writeback_start(&threshold);
+    for (int i = 0; i < 16; i++) {
+        block[0] = i;
+        bwrite(2100 + i, block);
+    }
+    CTEST_ASSERT(wait_for_clean(), "Expected crossing the dirty threshold to flush every block");
+    pread(image_fd, on_disk, BLOCK_SIZE, 2115 * BLOCK_SIZE);
+    CTEST_ASSERT(on_disk[0] == 15, "Expected the last block written to reach the image");
+
+    // simfs_sync is the barrier, flusher or not
+    block[0] = 'S';
+    bwrite(2200, block);
+    CTEST_ASSERT(simfs_sync() == 0 && bcache_dirty_count() == 0, "Expected simfs_sync to leave nothing dirty");
+    pread(image_fd, on_disk, BLOCK_SIZE, 2200 * BLOCK_SIZE);
+    CTEST_ASSERT(on_disk[0] == 'S', "Expected simfs_sync to write the block to the image");
+
+    // Closing the image stops the flusher
+    image_close();
+    CTEST_ASSERT(!writeback_running(), "Expected image_close to stop the flusher");
+    image_open("test_image", 0);
+    CTEST_ASSERT(namei("/flushed") == inode_num, "Expected the flushed file to be there after reopening");
+    image_close();
+
+    // Metadata in an open transaction never goes home ahead of the log,
+    // however eagerly the flusher runs
+    struct mkfs_params journaled = { 4096, 0, FEATURE_JOURNAL };
+    struct writeback_params eager = { 1, 0, 0 };
+    int early = 0;
+    image_open("test_image", IMAGE_TRUNCATE);
+    mkfs_format(&journaled);
+    bsync();
+    writeback_start(&eager);
+    for (int round = 1; round <= 20; round++) {
+        journal_begin();
+        memset(block, round, BLOCK_SIZE);
+        for (int i = 0; i < 32; i++) {
+            bwrite_meta(3000 + i, block);
+            pread(image_fd, on_disk, BLOCK_SIZE, (off_t)(3000 + i) * BLOCK_SIZE);
+            early += on_disk[0] == round;
+        }
+        usleep(5000);
+        for (int i = 0; i < 32; i++) {
+            pread(image_fd, on_disk, BLOCK_SIZE, (off_t)(3000 + i) * BLOCK_SIZE);
+            early += on_disk[0] == round;
+        }
+        journal_end();
+        journal_commit();
+    }
+    CTEST_ASSERT(early == 0, "Expected no journaled block to reach its home before its transaction commits");
+    image_close();
+    remove("test_image");
+}
+
+// Flips a byte of block_num in the closed image filename
+static void corrupt_block(const char *filename, int block_num)
+{
+    unsigned char byte;
+    int fd = open(filename, O_RDWR);
+    pread(fd, &byte, 1, (off_t)block_num * BLOCK_SIZE + 2);
+    byte ^= 0xff;
+    pwrite(fd, &byte, 1, (off_t)block_num * BLOCK_SIZE + 2);
+    close(fd);
+}
+
+void test_checksums()
+{
+    const char *kernels[] = { "table", "sse4.2" };
+    struct mkfs_params params = { 0, 0, FEATURE_CHECKSUMS };
+    const char *data = "not checksummed";
+    char back[16] = { 0 };
+
+    // The standard check value, all at once and in pieces, on every kernel
+    CTEST_ASSERT(checksum_use_kernel("abacus") == -1, "Expected an unknown kernel to be refused");
+    const char *best = checksum_kernel_name();
+    for (int k = 0; k < 2; k++) {
+        if (checksum_use_kernel(kernels[k]) == -1) {
+            continue;
+        }
+        CTEST_ASSERT(crc32c(0, "123456789", 9) == 0xe3069283, "Expected the CRC32C check value");
+        CTEST_ASSERT(crc32c(crc32c(0, "1234", 4), "56789", 5) == 0xe3069283, "Expected crc32c to continue a checksum");
+    }
+    checksum_use_kernel(best);
+
+    image_open("test_image", IMAGE_TRUNCATE);
+    CTEST_ASSERT(mkfs_format(&params) == 0, "Expected mkfs_format to format with checksums");
+    CTEST_ASSERT(image_map == NULL, "Expected an image with checksums not to be mapped");
+    CTEST_ASSERT(sb.checksum_blocks == 1 && sb.data_start == sb.checksum_start + 1, "Expected the checksum table before the data blocks");
+    directory_create("/dir");
+    int file_num = file_create_path("/dir/file");
+    struct file *f = file_open(file_num);
+    file_write(f, data, strlen(data));
+    file_close(f);
+    struct inode *dir_inode = iget(namei("/dir"));
+    struct inode *file_inode = iget(file_num);
+    int dir_block = bmap(dir_inode, 0);
+    int data_block = bmap(file_inode, 0);
+    iput(dir_inode);
+    iput(file_inode);
+    image_close();
+
+    // Intact blocks pass, as does file data, which is not checked
+    corrupt_block("test_image", data_block);
+    image_open("test_image", 0);
+    f = file_open(namei("/dir/file"));
+    CTEST_ASSERT(f != NULL && file_read(f, back, strlen(data)) == (int)strlen(data) && memcmp(back, data, strlen(data)) != 0,
+                 "Expected changed file data to be read back unchecked");
+    file_close(f);
+    CTEST_ASSERT(checksum_failures() == 0, "Expected intact metadata to pass its checksums");
+    image_close();
+
+    // A changed directory block is refused
+    corrupt_block("test_image", dir_block);
+    image_open("test_image", 0);
+    CTEST_ASSERT(namei("/dir") != -1 && namei("/dir/file") == -1, "Expected a changed directory block to fail its checksum");
+    CTEST_ASSERT(checksum_failures() > 0, "Expected the failure to be counted");
+    image_close();
+
+    // So is a changed inode table block
+    corrupt_block("test_image", sb.inode_table_start + file_num / INODES_PER_BLOCK);
+    image_open("test_image", 0);
+    CTEST_ASSERT(iget(file_num) == NULL, "Expected iget to fail on a changed inode table block");
+    image_close();
+
+    // Checkpoints write the checksums of what they send home, so commits
+    // survive a crash after the log has been reused
+    struct mkfs_params journaled = { 4096, 0, FEATURE_JOURNAL | FEATURE_CHECKSUMS };
+    struct journal_stats stats;
+    char path[32];
+    image_open("test_image", IMAGE_TRUNCATE);
+    mkfs_format(&journaled);
+    directory_create("/c");
+    journal_reset_stats();
+    for (int i = 0; i < 300; i++) {
+        sprintf(path, "/c/f%d", i);
+        file_create_path(path);
+        inode_sync();
+        journal_commit();
+    }
+    journal_get_stats(&stats);
+    CTEST_ASSERT(stats.checkpoints > 0, "Expected the log to be checkpointed");
+    crash_image();
+    unsigned long failures = checksum_failures();
+    image_open("test_image", 0);
+    int found = 0;
+    for (int i = 0; i < 300; i++) {
+        sprintf(path, "/c/f%d", i);
+        found += namei(path) != -1;
+    }
+    CTEST_ASSERT(found == 300, "Expected every commit to survive a crash across checkpoints");
+    struct fsck_report report;
+    CTEST_ASSERT(fsck(0, 0, &report) == 0 && checksum_failures() == failures,
+                 "Expected blocks sent home by a checkpoint to pass their checksums");
+    image_close();
+
+    // Without a journal the table follows each write, so blocks written
+    // back outside bsync pass after a crash
+    image_open("test_image", IMAGE_TRUNCATE);
+    mkfs_format(&params);
+    file_create_path("/written");
+    inode_sync();
+    bcache_flush();
+    crash_image();
+    failures = checksum_failures();
+    image_open("test_image", 0);
+    CTEST_ASSERT(namei("/written") != -1 && checksum_failures() == failures, "Expected written blocks to pass after a crash");
+    image_close();
+
+    // A block written without its checksum fails until fsck rebuilds it.
+    // This one holds the root and /written; the byte changed is inode 63's.
+    int fd = open("test_image", O_RDWR);
+    pwrite(fd, "x", 1, (off_t)(sb.inode_table_start + 1) * BLOCK_SIZE - 1);
+    close(fd);
+    image_open("test_image", 0);
+    CTEST_ASSERT(fsck(0, 0, &report) > 0 && report.unreadable == 1, "Expected a block without its checksum to be unreadable");
+    CTEST_ASSERT(fsck(0, 1, &report) == 1 && report.bad_checksums == 1 && report.unreadable == 0,
+                 "Expected fsck to rebuild the checksum");
+    CTEST_ASSERT(fsck(0, 0, &report) == 0 && namei("/written") != -1, "Expected the image to be clean after the rebuild");
+    image_close();
+    remove("test_image");
+}
+
+// Flips bit of the bitmap starting at block map_start in the closed image
+// filename
+static void flip_bit(const char *filename, int map_start, int bit)
+{
+    unsigned char byte;
+    int fd = open(filename, O_RDWR);
+    pread(fd, &byte, 1, (off_t)map_start * BLOCK_SIZE + bit / 8);
+    byte ^= 1 << (bit % 8);
+    pwrite(fd, &byte, 1, (off_t)map_start * BLOCK_SIZE + bit / 8);
+    close(fd);
+}
+
+void test_fsck()
+{
+    struct mkfs_params params = { 0, 0, 0 };
+    struct fsck_report report;
+
+    image_open("test_image", IMAGE_TRUNCATE);
+    mkfs_format(&params);
+    directory_create("/dir");
+    int file_num = file_create_path("/dir/file");
+    int other_num = file_create_path("/other");
+    struct file *f = file_open(file_num);
+    file_write(f, "data", 4);
+    file_close(f);
+    CTEST_ASSERT(fsck(4, 0, &report) == 0, "Expected a new image to be clean");
+    CTEST_ASSERT(report.inodes == 4 && report.directories == 2 && report.orphans == 0,
+                 "Expected fsck to find the root, the directory and both files");
+
+    struct inode *in = iget(other_num);
+    CTEST_ASSERT(in->link_count == 1, "Expected directory_add to count the entry in link_count");
+    ilock(in);
+    in->link_count = 3;
+    idirty(in);
+    iunlock(in);
+    iput(in);
+    struct inode *dir_inode = iget(namei("/dir"));
+    struct inode *file_inode = iget(file_num);
+    int dir_block = bmap(dir_inode, 0);
+    int data_block = bmap(file_inode, 0);
+    iput(dir_inode);
+    iput(file_inode);
+    image_close();
+
+    // A free inode still named, which leaks its block, a used block
+    // marked free and a wrong link count
+    flip_bit("test_image", sb.inode_map_start, file_num);
+    flip_bit("test_image", sb.block_map_start, dir_block);
+    image_open("test_image", 0);
+    CTEST_ASSERT(fsck(1, 0, &report) == 4, "Expected fsck to find every problem");
+    CTEST_ASSERT(report.dangling == 1 && report.leaked_blocks == 1 && report.missing_blocks == 1 && report.bad_links == 1,
+                 "Expected fsck to tell the problems apart");
+    CTEST_ASSERT(report.repaired == 0, "Expected fsck not to repair unless asked");
+    CTEST_ASSERT(fsck(0, 1, &report) == 4 && report.repaired == 4, "Expected fsck to repair every problem");
+    CTEST_ASSERT(fsck(0, 0, &report) == 0, "Expected the repaired image to be clean");
+    CTEST_ASSERT(namei("/dir/file") == -1, "Expected the dangling entry to be gone");
+    image_close();
+
+    image_open("test_image", 0);
+    CTEST_ASSERT(fsck(2, 0, &report) == 0, "Expected the repairs to reach the image");
+    struct inode *other = iget(other_num);
+    CTEST_ASSERT(other->link_count == 1, "Expected the link count to be repaired");
+    iput(other);
+    unsigned char map[BLOCK_SIZE];
+    bread(sb.block_map_start, map);
+    CTEST_ASSERT(!(map[data_block / 8] & (1 << (data_block % 8))) && (map[dir_block / 8] & (1 << (dir_block % 8))),
+                 "Expected the block map to be repaired");
+    image_close();
+
+    // Emptying slots of a hashed directory keeps the entries that had
+    // overflowed past them reachable
+    struct mkfs_params indexed = { 8192, 0, FEATURE_DIR_INDEX };
+    int nums[1022];
+    char name[16];
+    image_open("test_image", IMAGE_TRUNCATE);
+    mkfs_format(&indexed);
+    directory_create("/h");
+    for (int i = 0; i < 1022; i++) {
+        sprintf(name, "/h/n%d", i);
+        nums[i] = file_create_path(name);
+    }
+    image_close();
+    for (int i = 0; i < 1022; i += 3) {
+        flip_bit("test_image", sb.inode_map_start, nums[i]);
+    }
+    image_open("test_image", 0);
+    CTEST_ASSERT(fsck(0, 1, &report) > 0 && report.dangling == 341, "Expected the freed entries to be dangling");
+    int reachable = 0;
+    for (int i = 0; i < 1022; i++) {
+        sprintf(name, "/h/n%d", i);
+        reachable += (namei(name) != -1) == (i % 3 != 0);
+    }
+    CTEST_ASSERT(reachable == 1022 && fsck(0, 0, &report) == 0, "Expected every entry left to stay reachable");
+    image_close();
+
+    // Orphans are freed with their blocks, and with a directory what only
+    // it named
+    image_open("test_image", IMAGE_TRUNCATE);
+    mkfs_format(&params);
+    int free_inodes = bitmap_count_free(&inode_bitmap);
+    int free_blocks = bitmap_count_free(&block_bitmap);
+    struct inode *lone = ialloc();
+    inode_add_blocks(lone, 0, 20);
+    lone->size = 20 * BLOCK_SIZE;
+    idirty(lone);
+    iput(lone);
+    struct inode *lost = create_directory(ROOT_INODE_NUM);
+    struct inode *child = ialloc();
+    inode_add_blocks(child, 0, 2);
+    child->size = 2 * BLOCK_SIZE;
+    idirty(child);
+    struct directory *lost_dir = directory_open(lost->inode_num);
+    directory_add(lost_dir, "child", child->inode_num);
+    directory_close(lost_dir);
+    iput(child);
+    iput(lost);
+    CTEST_ASSERT(fsck(0, 0, &report) == 2 && report.orphans == 2, "Expected the unnamed inodes to be orphans");
+    CTEST_ASSERT(fsck(0, 1, &report) == 2 && report.repaired == 3, "Expected the orphans and their child to be freed");
+    CTEST_ASSERT(fsck(0, 0, &report) == 0 && bitmap_count_free(&inode_bitmap) == free_inodes &&
+                     bitmap_count_free(&block_bitmap) == free_blocks,
+                 "Expected the orphans' inodes and blocks to be free again");
+    image_close();
+
+    // Blocks behind a damaged pointer block are not freed
+    struct mkfs_params checked = { 0, 0, FEATURE_CHECKSUMS };
+    image_open("test_image", IMAGE_TRUNCATE);
+    mkfs_format(&checked);
+    in = iget(file_create_path("/big"));
+    ilock(in);
+    inode_add_blocks(in, 0, 40);
+    in->size = 40 * BLOCK_SIZE;
+    idirty(in);
+    iunlock(in);
+    int indirect = in->indirect;
+    int mapped = bmap(in, INODE_PTR_COUNT);
+    iput(in);
+    image_close();
+    corrupt_block("test_image", indirect);
+    image_open("test_image", 0);
+    CTEST_ASSERT(fsck(0, 0, &report) > 0 && report.unreadable == 1, "Expected the pointer block to fail its checksum");
+    fsck(0, 1, &report);
+    CTEST_ASSERT(report.bad_pointers == 1 && report.leaked_blocks > 0, "Expected the damaged pointer to be found");
+    bread(sb.block_map_start, map);
+    CTEST_ASSERT(map[mapped / 8] & (1 << (mapped % 8)), "Expected blocks it may still map to stay in use");
+    image_close();
+    remove("test_image");
+}
+
+void test_inline_data()
+{
+    struct mkfs_params params = { 0, 0, FEATURE_INLINE_DATA | FEATURE_EXTENTS };
+    struct fsck_report report;
+    struct directory_entry ent;
+    char path[32];
+    char back[128] = { 0 };
+    char data[100];
+
+    for (int i = 0; i < 100; i++) {
+        data[i] = 'a' + i % 26;
+    }
+    image_open("test_image", IMAGE_TRUNCATE);
+    mkfs_format(&params);
+    int free_blocks = bitmap_count_free(&block_bitmap);
+    struct inode *root = iget(ROOT_INODE_NUM);
+    CTEST_ASSERT((root->flags & INLINE_FLAG) && root->size == DIR_INLINE_START_SIZE && bmap(root, 0) == 0,
+                 "Expected the root directory to start out inline");
+    iput(root);
+
+    // Small files and directories take no blocks
+    directory_create("/d");
+    int file_num = file_create_path("/d/a");
+    struct file *f = file_open(file_num);
+    CTEST_ASSERT(file_write(f, data, 20) == 20 && file_write(f, data + 20, 20) == 20, "Expected writes to an inline file");
+    file_close(f);
+    CTEST_ASSERT(bitmap_count_free(&block_bitmap) == free_blocks, "Expected inline files and directories to take no blocks");
+    CTEST_ASSERT(namei("/d/a") == file_num && namei("/d/b") == -1, "Expected lookups in inline directories");
+
+    struct directory *dir = directory_open(namei("/d"));
+    CTEST_ASSERT(directory_get(dir, &ent) == 1 && strcmp(ent.name, ".") == 0 && ent.inode_num == dir->inode->inode_num,
+                 "Expected an inline directory to list . first");
+    CTEST_ASSERT(directory_get(dir, &ent) == 1 && strcmp(ent.name, "..") == 0 && ent.inode_num == ROOT_INODE_NUM,
+                 "Expected an inline directory to list .. second");
+    CTEST_ASSERT(directory_get(dir, &ent) == 1 && strcmp(ent.name, "a") == 0 && (int)ent.inode_num == file_num,
+                 "Expected an inline directory to list its entries");
+    CTEST_ASSERT(directory_get(dir, &ent) == -1, "Expected the listing to end");
+    directory_close(dir);
+    CTEST_ASSERT(directory_lookup(dir = directory_open(namei("/d")), "..") == ROOT_INODE_NUM, "Expected .. to name the parent");
+    directory_close(dir);
+    image_close();
+
+    // Inline data is written back with the inode
+    image_open("test_image", 0);
+    f = file_open(namei("/d/a"));
+    CTEST_ASSERT(file_read(f, back, sizeof(back)) == 40 && memcmp(back, data, 40) == 0, "Expected inline data to be read back");
+
+    // Growing past the inode moves the data to a block
+    file_seek(f, 0, SEEK_END);
+    CTEST_ASSERT(file_write(f, data + 40, 60) == 60, "Expected a write past the inline space");
+    CTEST_ASSERT(!(f->inode->flags & INLINE_FLAG) && bmap(f->inode, 0) > 0, "Expected the file to move to a block");
+    file_seek(f, 0, SEEK_SET);
+    CTEST_ASSERT(file_read(f, back, sizeof(back)) == 100 && memcmp(back, data, 100) == 0, "Expected data kept across the move");
+    file_close(f);
+
+    // So does a directory running out of room
+    for (int i = 0; i < 12; i++) {
+        sprintf(path, "/d/file%d", i);
+        CTEST_ASSERT(file_create_path(path) != -1, "Expected to add to a growing directory");
+    }
+    struct inode *d = iget(namei("/d"));
+    CTEST_ASSERT(!(d->flags & INLINE_FLAG) && d->size == 15 * DIR_ENTRY_SIZE, "Expected the directory to move to a block");
+    iput(d);
+    int found = 0;
+    for (int i = 0; i < 12; i++) {
+        sprintf(path, "/d/file%d", i);
+        found += namei(path) != -1;
+    }
+    CTEST_ASSERT(found == 12 && namei("/d/a") == file_num && namei("/d/..") == ROOT_INODE_NUM,
+                 "Expected every entry to survive the move");
+    CTEST_ASSERT(fsck(0, 0, &report) == 0 && report.bad_links == 0, "Expected inline inodes to pass fsck");
+    image_close();
+    remove("test_image");
+}
+
 void test_directory_close()
 {
     image_open("test_image", 1);
@@ -522,23 +2507,70 @@ void test_directory_close()
 
 
 
-int main() 
+int main(int argc, char **argv) 
 {
+    // "simfs_test mmap" runs the suite against memory-mapped images
+    if (argc > 1 && strcmp(argv[1], "mmap") == 0) {
+        image_default_flags = IMAGE_MMAP;
+    }
+
     CTEST_VERBOSE(1);
     test_image();
+    test_pack();
+    test_inode_encode();
     test_mkfs();
+    test_mkfs_sparse();
+    test_mkfs_format();
     test_read_write();
+    if (!(image_default_flags & IMAGE_MMAP)) {
+        // Buffer cache behavior
+        test_bsync();
+        test_bcache_stats();
+        test_bwrite_many();
+        test_file_write_no_read();
+        test_inode_batching();
+        test_file_ptr_cache();
+        test_file_readahead();
+        test_directory_readahead();
+        test_journal();
+        test_writeback();
+    }
+    test_bread_many();
+    test_bget();
     test_find_and_set_free();
+    test_free_ranges();
     test_ialloc();
     test_alloc();
+    test_bitmap_alloc();
+    test_alloc_run();
+    test_inode_add_blocks();
+    test_file_read_write();
+    test_file_seek();
+    test_file_large();
+    test_extents();
+    test_extent_tree();
     test_find_incore();
     test_find_free_incore();
     test_write_inode();
     test_read_inode();
     test_iput();
     test_iget();
+    test_iget_cached();
+    test_iget_dirty_victim();
+    test_incore_resize();
+    test_inode_dirty();
     test_directory_get();
     test_directory_open();
     test_directory_close();
+    test_directory_add();
+    test_directory_hashed();
+    test_namei();
+    test_dcache();
+    test_threads();
+    test_simfs();
+    test_async();
+    test_checksums();
+    test_fsck();
+    test_inline_data();
     CTEST_RESULTS();
 }
@@ -0,0 +1,175 @@
+#include "super.h"
+#include "block.h"
+#include "inode.h"
+#include "mkfs.h"
+#include "journal.h"
+#include "checksum.h"
+#include "pack.h"
+#include "simfs.h"
+#include <stddef.h>
+
+static int blocks_for(int count, int per_block)
+{
+    return (count + per_block - 1) / per_block;
+}
+
+// Lays out an image of block_count blocks: the superblock, the free inode
+// map, the free block map, the inode table and, with FEATURE_JOURNAL, the
+// journal and, with FEATURE_CHECKSUMS, the checksum table, in that order,
+// followed by the data blocks. An inode_count of 0 picks one inode per
+// BYTES_PER_INODE_DEFAULT bytes of image.
+int super_layout(struct superblock *s, int block_count, int inode_count, unsigned int features)
+{
+    if (inode_count == 0)
+    {
+        long long bytes = (long long)block_count * BLOCK_SIZE;
+        inode_count = bytes / BYTES_PER_INODE_DEFAULT;
+        if (inode_count > MAX_INODE_COUNT)
+        {
+            inode_count = MAX_INODE_COUNT;
+        }
+    }
+    if (block_count <= 0 || block_count > MAX_BLOCK_COUNT || inode_count <= 0 || inode_count > MAX_INODE_COUNT)
+    {
+        return -1;
+    }
+
+    s->magic = SUPER_MAGIC;
+    s->block_size = BLOCK_SIZE;
+    s->block_count = block_count;
+    s->inode_count = inode_count;
+    s->inode_map_start = SUPER_BLOCK_NUM + 1;
+    s->inode_map_blocks = blocks_for(inode_count, BITS_PER_BLOCK);
+    s->block_map_start = s->inode_map_start + s->inode_map_blocks;
+    s->block_map_blocks = blocks_for(block_count, BITS_PER_BLOCK);
+    s->inode_table_start = s->block_map_start + s->block_map_blocks;
+    s->inode_table_blocks = blocks_for(inode_count, INODES_PER_BLOCK);
+    s->journal_start = s->inode_table_start + s->inode_table_blocks;
+    s->journal_blocks = 0;
+    if (features & FEATURE_JOURNAL)
+    {
+        // An eighth of the image, but never less than a transaction needs
+        s->journal_blocks = block_count / 8 < JOURNAL_BLOCKS_DEFAULT ? block_count / 8 : JOURNAL_BLOCKS_DEFAULT;
+        if (s->journal_blocks < JOURNAL_MIN_BLOCKS)
+        {
+            return -1;
+        }
+    }
+    s->checksum_start = s->journal_start + s->journal_blocks;
+    s->checksum_blocks = features & FEATURE_CHECKSUMS ? blocks_for(block_count, CHECKSUMS_PER_BLOCK) : 0;
+    s->data_start = s->checksum_start + s->checksum_blocks;
+    s->features = features;
+
+    // Room for at least the root directory's block
+    if (s->data_start >= s->block_count)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+// The first block past the region of blocks blocks at start
+static unsigned long long region_end(unsigned int start, unsigned int blocks)
+{
+    return (unsigned long long)start + blocks;
+}
+
+// Checks that the regions super_layout lays out are in its order, do not
+// overlap, fit in the image and are as large as the counts need
+static int super_valid(const struct superblock *s)
+{
+    // Buffers throughout are BLOCK_SIZE bytes, so the image has to match
+    if (s->block_size != BLOCK_SIZE || s->block_count == 0 || s->block_count > MAX_BLOCK_COUNT ||
+        s->inode_count == 0 || s->inode_count > MAX_INODE_COUNT)
+    {
+        return 0;
+    }
+    if (s->inode_map_blocks != (unsigned int)blocks_for(s->inode_count, BITS_PER_BLOCK) ||
+        s->block_map_blocks != (unsigned int)blocks_for(s->block_count, BITS_PER_BLOCK) ||
+        s->inode_table_blocks != (unsigned int)blocks_for(s->inode_count, INODES_PER_BLOCK))
+    {
+        return 0;
+    }
+    if ((s->features & FEATURE_JOURNAL) ? s->journal_blocks < JOURNAL_MIN_BLOCKS : s->journal_blocks != 0)
+    {
+        return 0;
+    }
+    if (s->checksum_blocks !=
+        ((s->features & FEATURE_CHECKSUMS) ? (unsigned int)blocks_for(s->block_count, CHECKSUMS_PER_BLOCK) : 0))
+    {
+        return 0;
+    }
+    return s->inode_map_start > SUPER_BLOCK_NUM &&
+           s->block_map_start >= region_end(s->inode_map_start, s->inode_map_blocks) &&
+           s->inode_table_start >= region_end(s->block_map_start, s->block_map_blocks) &&
+           s->journal_start >= region_end(s->inode_table_start, s->inode_table_blocks) &&
+           s->checksum_start >= region_end(s->journal_start, s->journal_blocks) &&
+           s->data_start >= region_end(s->checksum_start, s->checksum_blocks) &&
+           s->data_start < s->block_count;
+}
+
+// Loads the geometry of the open image from its superblock. An image
+// without one (not yet formatted) gets the default geometry. Returns -1,
+// leaving sb alone, if the geometry cannot be right.
+int super_read(void)
+{
+    unsigned char block[BLOCK_SIZE];
+    struct superblock s;
+
+    if (bread(SUPER_BLOCK_NUM, block) == NULL)
+    {
+        return -1;
+    }
+    if (read_u32(block + MAGIC_OFFSET) != SUPER_MAGIC)
+    {
+        return super_layout(&sb, NUMBER_OF_BLOCKS, 0, 0);
+    }
+
+    s.magic = SUPER_MAGIC;
+    s.block_size = read_u32(block + SB_BLOCK_SIZE_OFFSET);
+    s.block_count = read_u32(block + BLOCK_COUNT_OFFSET);
+    s.inode_count = read_u32(block + INODE_COUNT_OFFSET);
+    s.inode_map_start = read_u32(block + INODE_MAP_START_OFFSET);
+    s.inode_map_blocks = read_u32(block + INODE_MAP_BLOCKS_OFFSET);
+    s.block_map_start = read_u32(block + BLOCK_MAP_START_OFFSET);
+    s.block_map_blocks = read_u32(block + BLOCK_MAP_BLOCKS_OFFSET);
+    s.inode_table_start = read_u32(block + INODE_TABLE_START_OFFSET);
+    s.inode_table_blocks = read_u32(block + INODE_TABLE_BLOCKS_OFFSET);
+    s.data_start = read_u32(block + DATA_START_OFFSET);
+    s.features = read_u32(block + FEATURES_OFFSET);
+    s.journal_start = read_u32(block + JOURNAL_START_OFFSET);
+    s.journal_blocks = read_u32(block + JOURNAL_BLOCKS_OFFSET);
+    s.checksum_start = read_u32(block + CHECKSUM_START_OFFSET);
+    s.checksum_blocks = read_u32(block + CHECKSUM_BLOCKS_OFFSET);
+
+    if (!super_valid(&s))
+    {
+        return -1;
+    }
+    sb = s;
+    return 0;
+}
+
+int super_write(void)
+{
+    unsigned char block[BLOCK_SIZE] = { 0 };
+
+    write_u32(block + MAGIC_OFFSET, SUPER_MAGIC);
+    write_u32(block + SB_BLOCK_SIZE_OFFSET, sb.block_size);
+    write_u32(block + BLOCK_COUNT_OFFSET, sb.block_count);
+    write_u32(block + INODE_COUNT_OFFSET, sb.inode_count);
+    write_u32(block + INODE_MAP_START_OFFSET, sb.inode_map_start);
+    write_u32(block + INODE_MAP_BLOCKS_OFFSET, sb.inode_map_blocks);
+    write_u32(block + BLOCK_MAP_START_OFFSET, sb.block_map_start);
+    write_u32(block + BLOCK_MAP_BLOCKS_OFFSET, sb.block_map_blocks);
+    write_u32(block + INODE_TABLE_START_OFFSET, sb.inode_table_start);
+    write_u32(block + INODE_TABLE_BLOCKS_OFFSET, sb.inode_table_blocks);
+    write_u32(block + DATA_START_OFFSET, sb.data_start);
+    write_u32(block + FEATURES_OFFSET, sb.features);
+    write_u32(block + JOURNAL_START_OFFSET, sb.journal_start);
+    write_u32(block + JOURNAL_BLOCKS_OFFSET, sb.journal_blocks);
+    write_u32(block + CHECKSUM_START_OFFSET, sb.checksum_start);
+    write_u32(block + CHECKSUM_BLOCKS_OFFSET, sb.checksum_blocks);
+
+    return bwrite(SUPER_BLOCK_NUM, block);
+}
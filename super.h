@@ -0,0 +1,61 @@
+#ifndef SUPER_H
+#define SUPER_H
+
+#define SUPER_BLOCK_NUM 0
+#define SUPER_MAGIC 0x53494d46  // "SIMF"
+
+#define BITS_PER_BLOCK (BLOCK_SIZE * 8)
+#define BYTES_PER_INODE_DEFAULT 16384
+#define MAX_INODE_COUNT 65536   // directory entries hold 16-bit inode numbers
+#define MAX_BLOCK_COUNT (1 << 24)  // inodes hold 24-bit block pointers
+
+#define MAGIC_OFFSET 0
+#define SB_BLOCK_SIZE_OFFSET (MAGIC_OFFSET + 4)
+#define BLOCK_COUNT_OFFSET (SB_BLOCK_SIZE_OFFSET + 4)
+#define INODE_COUNT_OFFSET (BLOCK_COUNT_OFFSET + 4)
+#define INODE_MAP_START_OFFSET (INODE_COUNT_OFFSET + 4)
+#define INODE_MAP_BLOCKS_OFFSET (INODE_MAP_START_OFFSET + 4)
+#define BLOCK_MAP_START_OFFSET (INODE_MAP_BLOCKS_OFFSET + 4)
+#define BLOCK_MAP_BLOCKS_OFFSET (BLOCK_MAP_START_OFFSET + 4)
+#define INODE_TABLE_START_OFFSET (BLOCK_MAP_BLOCKS_OFFSET + 4)
+#define INODE_TABLE_BLOCKS_OFFSET (INODE_TABLE_START_OFFSET + 4)
+#define DATA_START_OFFSET (INODE_TABLE_BLOCKS_OFFSET + 4)
+#define FEATURES_OFFSET (DATA_START_OFFSET + 4)
+#define JOURNAL_START_OFFSET (FEATURES_OFFSET + 4)
+#define JOURNAL_BLOCKS_OFFSET (JOURNAL_START_OFFSET + 4)
+#define CHECKSUM_START_OFFSET (JOURNAL_BLOCKS_OFFSET + 4)
+#define CHECKSUM_BLOCKS_OFFSET (CHECKSUM_START_OFFSET + 4)
+
+// Optional on-disk formats, set by mkfs
+#define FEATURE_EXTENTS 1   // new files map their blocks with extents
+#define FEATURE_DIR_INDEX 2 // directories past one block are hashed
+#define FEATURE_JOURNAL 4   // metadata goes through a journal (journal.h)
+#define FEATURE_CHECKSUMS 8 // metadata blocks are checksummed (checksum.h)
+#define FEATURE_INLINE_DATA 16 // new files and directories start out inline in their inode
+
+struct superblock {
+    unsigned int magic;
+    unsigned int block_size;
+    unsigned int block_count;
+    unsigned int inode_count;
+    unsigned int inode_map_start;
+    unsigned int inode_map_blocks;
+    unsigned int block_map_start;
+    unsigned int block_map_blocks;
+    unsigned int inode_table_start;
+    unsigned int inode_table_blocks;
+    unsigned int data_start;     // first block not reserved for metadata
+    unsigned int features;       // FEATURE_* flags
+    unsigned int journal_start;  // with FEATURE_JOURNAL, after the inode table
+    unsigned int journal_blocks;
+    unsigned int checksum_start;  // with FEATURE_CHECKSUMS, after the journal
+    unsigned int checksum_blocks;
+};
+
+// The open image's geometry is sb (see simfs.h)
+
+int super_layout(struct superblock *s, int block_count, int inode_count, unsigned int features);
+int super_read(void);
+int super_write(void);
+
+#endif
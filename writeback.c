@@ -0,0 +1,134 @@
+#include "writeback.h"
+#include "bcache.h"
+#include "inode.h"
+#include "journal.h"
+#include "simfs.h"
+#include <string.h>
+#include <time.h>
+
+// This thread's filesystem's flusher
+#define writeback (simfs_current->writeback)
+
+static void writeback_run(void)
+{
+    struct writeback_stats run = { 1, 0, 0 };
+
+    inode_sync();
+    // Pages of a mapped image are the kernel's to write back
+    if (image_map == NULL)
+    {
+        if (journal_pending() > 0 && journal_commit_idle() > 0)
+        {
+            run.commits++;
+        }
+        int all = bcache_dirty_count() > writeback.params.dirty_threshold;
+        int written = bcache_flush_aged(all ? 0 : writeback.params.max_age_ms);
+        if (written > 0)
+        {
+            run.blocks += written;
+        }
+    }
+
+    pthread_mutex_lock(&writeback.lock);
+    writeback.stats.runs += run.runs;
+    writeback.stats.blocks += run.blocks;
+    writeback.stats.commits += run.commits;
+    pthread_mutex_unlock(&writeback.lock);
+}
+
+static void *flusher(void *arg)
+{
+    simfs_use(arg);
+    pthread_mutex_lock(&writeback.lock);
+    while (!writeback.stopping)
+    {
+        if (!writeback.kicked)
+        {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            long long ns = deadline.tv_nsec + writeback.params.interval_ms * 1000000LL;
+            deadline.tv_sec += ns / 1000000000;
+            deadline.tv_nsec = ns % 1000000000;
+            pthread_cond_timedwait(&writeback.wake, &writeback.lock, &deadline);
+            if (writeback.stopping)
+            {
+                break;
+            }
+        }
+        __atomic_store_n(&writeback.kicked, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&writeback.lock);
+        writeback_run();
+        pthread_mutex_lock(&writeback.lock);
+    }
+    pthread_mutex_unlock(&writeback.lock);
+    return NULL;
+}
+
+// Starts the current filesystem's flusher, with the defaults above if
+// params is NULL. Returns -1 if it is already running or cannot start.
+int writeback_start(const struct writeback_params *params)
+{
+    struct writeback_params defaults = { WRITEBACK_INTERVAL_MS, WRITEBACK_MAX_AGE_MS, WRITEBACK_DIRTY_THRESHOLD };
+
+    if (writeback_running())
+    {
+        return -1;
+    }
+    writeback.params = params == NULL ? defaults : *params;
+    if (writeback.params.interval_ms < 1)
+    {
+        writeback.params.interval_ms = 1;
+    }
+    writeback.stopping = 0;
+    writeback.kicked = 0;
+    if (pthread_create(&writeback.thread, NULL, flusher, simfs_current) != 0)
+    {
+        return -1;
+    }
+    __atomic_store_n(&writeback.running, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Stops the flusher, leaving whatever is still dirty to bsync. Returns -1
+// if it was not running.
+int writeback_stop(void)
+{
+    if (!writeback_running())
+    {
+        return -1;
+    }
+    pthread_mutex_lock(&writeback.lock);
+    writeback.stopping = 1;
+    pthread_cond_signal(&writeback.wake);
+    pthread_mutex_unlock(&writeback.lock);
+    pthread_join(writeback.thread, NULL);
+    __atomic_store_n(&writeback.running, 0, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int writeback_running(void)
+{
+    return __atomic_load_n(&writeback.running, __ATOMIC_ACQUIRE);
+}
+
+// Called by the cache with its dirty block count each time a block is
+// dirtied; wakes the flusher once the threshold is crossed
+void writeback_dirtied(int dirty_count)
+{
+    if (!writeback_running() || dirty_count <= writeback.params.dirty_threshold ||
+        __atomic_load_n(&writeback.kicked, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+    pthread_mutex_lock(&writeback.lock);
+    __atomic_store_n(&writeback.kicked, 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&writeback.wake);
+    pthread_mutex_unlock(&writeback.lock);
+}
+
+void writeback_get_stats(struct writeback_stats *s)
+{
+    pthread_mutex_lock(&writeback.lock);
+    *s = writeback.stats;
+    pthread_mutex_unlock(&writeback.lock);
+}
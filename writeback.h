@@ -0,0 +1,52 @@
+#ifndef WRITEBACK_H
+#define WRITEBACK_H
+
+#include <pthread.h>
+
+// Opt-in background write-back. Normally dirty blocks leave the cache
+// only when bsync is called or when they are evicted, so whichever
+// operation needs a buffer pays for writing the old one. Once
+// writeback_start is called, a flusher thread instead wakes every
+// interval_ms, moves dirty inodes into their table blocks, commits the
+// journal if no operation is in progress, and writes back the blocks
+// that have been dirty for max_age_ms, in block order so adjacent ones
+// go out together. Crossing dirty_threshold wakes it early, and then it
+// writes back every dirty block. It runs until writeback_stop, image_open,
+// image_close or image_zero. simfs_sync is the barrier for callers that
+// need their changes on disk.
+
+#define WRITEBACK_INTERVAL_MS 100
+#define WRITEBACK_MAX_AGE_MS 500
+#define WRITEBACK_DIRTY_THRESHOLD 64
+
+struct writeback_params {
+    int interval_ms;
+    int max_age_ms;       // 0 writes back everything dirty every time
+    int dirty_threshold;  // dirty cached blocks
+};
+
+struct writeback_stats {
+    unsigned long runs;
+    unsigned long blocks;   // written back by the flusher
+    unsigned long commits;  // journal commits made by the flusher
+};
+
+// One filesystem's flusher (see simfs.h)
+struct writeback_state {
+    int running;
+    int stopping;
+    int kicked;  // dirty_threshold was crossed
+    struct writeback_params params;
+    struct writeback_stats stats;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+};
+
+int writeback_start(const struct writeback_params *params);
+int writeback_stop(void);
+int writeback_running(void);
+void writeback_dirtied(int dirty_count);
+void writeback_get_stats(struct writeback_stats *stats);
+
+#endif